@@ -6,7 +6,7 @@ $CFLAGS << " #{ENV["CFLAGS"]}"
 $CFLAGS << " -g"
 $CFLAGS << " -O3" unless $CFLAGS[/-O\d/]
 $CFLAGS << " -Wall -Wno-comment"
-$LDFLAGS << "-Wl,--exclude-libs=ALL"
+$LDFLAGS << " -Wl,--exclude-libs=ALL"
 
 def sys(cmd)
 	puts " -- #{cmd}"
@@ -33,4 +33,26 @@ dir_config('freeimage', "#{FREEIMAGE_DIR}/Dist", "#{FREEIMAGE_DIR}/Dist")
 have_library('stdc++')
 have_library('freeimage')
 
+# FreeImage calls run without the GVL where available, batch work is spread
+# over a native thread pool
+have_library('pthread')
+have_header('ruby/thread.h')
+have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+
+# pixels are exported without copying as IO::Buffer and MemoryView
+have_header('ruby/memory_view.h')
+have_header('ruby/io/buffer.h')
+
+# JPEG and PNG are decoded straight to the requested bpp with the codecs
+# built into libfreeimage
+$INCFLAGS << " -I#{FREEIMAGE_DIR}/Source/LibJPEG -I#{FREEIMAGE_DIR}/Source/LibPNG"
+have_header('jpeglib.h', ['stdio.h'])
+have_header('png.h')
+# libjpeg-turbo can skip the columns and rows around a region
+have_func('jpeg_crop_scanline', ['stdio.h', 'jpeglib.h'])
+
+# files are decoded from a read-only mapping
+have_header('sys/mman.h')
+have_func('madvise', 'sys/mman.h')
+
 create_makefile("rfreeimage/rfreeimage")
@@ -0,0 +1,276 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rfi_alloc.h"
+
+/* blocks below this are not worth pooling */
+#define RFI_ALLOC_MIN (64 << 10)
+#define RFI_ALLOC_LIMIT (64 << 20)
+#define RFI_ALLOC_ALIGN 64
+/* four classes per power of two, at most 25% slack */
+#define RFI_ALLOC_STEPS 4
+#define RFI_ALLOC_CLASSES (64 * RFI_ALLOC_STEPS)
+
+struct rfi_block {
+	BYTE *bits;
+	size_t size;
+	/* header over bits while handed out */
+	FIBITMAP *dib;
+	struct rfi_block *next;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	/* free blocks per size class */
+	struct rfi_block *free[RFI_ALLOC_CLASSES];
+	/* blocks handed out, open addressing on the header, not the bits: views share those */
+	struct rfi_block **live;
+	size_t live_cap;
+	size_t live_count;
+	size_t limit;
+	struct rfi_alloc_stats stats;
+} pool = { PTHREAD_MUTEX_INITIALIZER, { NULL }, NULL, 0, 0, RFI_ALLOC_LIMIT };
+
+/* smallest class holding size bytes, and its block size */
+static int rfi_size_class(size_t size, size_t *class_size)
+{
+	size_t base = 1, step;
+	int log = 0, i;
+
+	while (base * 2 <= size) {
+		base *= 2;
+		log++;
+	}
+	step = base / RFI_ALLOC_STEPS;
+	for (i = 0; i < RFI_ALLOC_STEPS; i++) {
+		if (base + step * i >= size)
+			break;
+	}
+	if (i == RFI_ALLOC_STEPS) {
+		log++;
+		base *= 2;
+		i = 0;
+		step = base / RFI_ALLOC_STEPS;
+	}
+	*class_size = base + step * i;
+	return log * RFI_ALLOC_STEPS + i;
+}
+
+static size_t rfi_hash(const FIBITMAP *dib, size_t cap)
+{
+	uintptr_t v = (uintptr_t)dib / sizeof(void *);
+	return (size_t)(v * 0x9E3779B97F4A7C15ull) & (cap - 1);
+}
+
+/* with the lock held */
+static int rfi_live_insert(struct rfi_block *b)
+{
+	size_t i;
+
+	if ((pool.live_count + 1) * 2 > pool.live_cap) {
+		size_t cap = pool.live_cap ? pool.live_cap * 2 : 64, j;
+		struct rfi_block **live = calloc(cap, sizeof(*live));
+		if (!live)
+			return -1;
+		for (j = 0; j < pool.live_cap; j++) {
+			if (!pool.live[j])
+				continue;
+			for (i = rfi_hash(pool.live[j]->dib, cap); live[i]; i = (i + 1) & (cap - 1))
+				;
+			live[i] = pool.live[j];
+		}
+		free(pool.live);
+		pool.live = live;
+		pool.live_cap = cap;
+	}
+	for (i = rfi_hash(b->dib, pool.live_cap); pool.live[i]; i = (i + 1) & (pool.live_cap - 1))
+		;
+	pool.live[i] = b;
+	pool.live_count++;
+	return 0;
+}
+
+/* with the lock held, NULL if dib is not from the pool */
+static struct rfi_block *rfi_live_remove(const FIBITMAP *dib)
+{
+	struct rfi_block *b;
+	size_t i, j, k, mask = pool.live_cap - 1;
+
+	if (!pool.live_count)
+		return NULL;
+	for (i = rfi_hash(dib, pool.live_cap); pool.live[i]; i = (i + 1) & mask) {
+		if (pool.live[i]->dib != dib)
+			continue;
+		b = pool.live[i];
+		pool.live[i] = NULL;
+		pool.live_count--;
+		/* move the rest of the cluster up into the gap */
+		for (j = (i + 1) & mask; pool.live[j]; j = (j + 1) & mask) {
+			k = rfi_hash(pool.live[j]->dib, pool.live_cap);
+			if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+				pool.live[i] = pool.live[j];
+				pool.live[j] = NULL;
+				i = j;
+			}
+		}
+		return b;
+	}
+	return NULL;
+}
+
+/* with the lock held, drop cached blocks until cached_bytes <= limit */
+static void rfi_alloc_shrink(size_t limit)
+{
+	struct rfi_block *b;
+	int c;
+
+	for (c = RFI_ALLOC_CLASSES - 1; c >= 0 && pool.stats.cached_bytes > limit; c--) {
+		while ((b = pool.free[c]) && pool.stats.cached_bytes > limit) {
+			pool.free[c] = b->next;
+			pool.stats.cached_bytes -= b->size;
+			pool.stats.cached_blocks--;
+			free(b->bits);
+			free(b);
+		}
+	}
+}
+
+FIBITMAP *rfi_bitmap_allocate(int width, int height, int bpp)
+{
+	struct rfi_block *b;
+	FIBITMAP *dib;
+	size_t pitch, line, size, class_size;
+	int c, y;
+
+	if (width <= 0 || height <= 0)
+		return NULL;
+	if (bpp != 8 && bpp != 24 && bpp != 32)
+		return FreeImage_Allocate(width, height, bpp, 0, 0, 0);
+	/* FreeImage's pitch, rows padded to 32 bits */
+	pitch = ((size_t)width * bpp + 31) / 32 * 4;
+	size = pitch * height;
+	if (size < RFI_ALLOC_MIN || !pool.limit)
+		return FreeImage_Allocate(width, height, bpp,
+				FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK);
+
+	c = rfi_size_class(size, &class_size);
+	pthread_mutex_lock(&pool.lock);
+	b = pool.free[c];
+	if (b) {
+		pool.free[c] = b->next;
+		pool.stats.cached_bytes -= b->size;
+		pool.stats.cached_blocks--;
+		pool.stats.hits++;
+	} else {
+		pool.stats.misses++;
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	if (!b) {
+		b = malloc(sizeof(*b));
+		if (!b)
+			return NULL;
+		b->size = class_size;
+		if (posix_memalign((void **)&b->bits, RFI_ALLOC_ALIGN, class_size)) {
+			free(b);
+			return NULL;
+		}
+	}
+
+	dib = FreeImage_AllocateHeaderForBits(b->bits, (unsigned)pitch, FIT_BITMAP,
+			width, height, bpp, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK);
+	b->dib = dib;
+	pthread_mutex_lock(&pool.lock);
+	if (!dib || rfi_live_insert(b) < 0) {
+		pthread_mutex_unlock(&pool.lock);
+		if (dib)
+			FreeImage_Unload(dib);
+		free(b->bits);
+		free(b);
+		return NULL;
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	/* callers fill the rows, the padding past them would keep old pixels */
+	line = ((size_t)width * bpp + 7) / 8;
+	if (line < pitch)
+		for (y = 0; y < height; y++)
+			memset(b->bits + (size_t)y * pitch + line, 0, pitch - line);
+	return dib;
+}
+
+void rfi_bitmap_unload(FIBITMAP *dib)
+{
+	struct rfi_block *b;
+	int c;
+	size_t class_size;
+
+	if (!dib)
+		return;
+	pthread_mutex_lock(&pool.lock);
+	b = rfi_live_remove(dib);
+	if (b && pool.stats.cached_bytes + b->size <= pool.limit) {
+		c = rfi_size_class(b->size, &class_size);
+		b->next = pool.free[c];
+		pool.free[c] = b;
+		pool.stats.cached_bytes += b->size;
+		pool.stats.cached_blocks++;
+		b = NULL;
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	/* a header over the block's pixels, or a plain FreeImage bitmap */
+	FreeImage_Unload(dib);
+	if (b) {
+		free(b->bits);
+		free(b);
+	}
+}
+
+FIBITMAP *rfi_bitmap_clone(FIBITMAP *dib)
+{
+	FIBITMAP *dst;
+	unsigned bpp = FreeImage_GetBPP(dib), line, y, h;
+
+	if (!FreeImage_HasPixels(dib) || FreeImage_GetImageType(dib) != FIT_BITMAP
+			|| (bpp != 8 && bpp != 24 && bpp != 32))
+		return FreeImage_Clone(dib);
+
+	dst = rfi_bitmap_allocate(FreeImage_GetWidth(dib), FreeImage_GetHeight(dib), bpp);
+	if (!dst)
+		return NULL;
+	h = FreeImage_GetHeight(dib);
+	line = FreeImage_GetLine(dib);
+	for (y = 0; y < h; y++)
+		memcpy(FreeImage_GetScanLine(dst, y), FreeImage_GetScanLine(dib, y), line);
+	if (bpp == 8)
+		memcpy(FreeImage_GetPalette(dst), FreeImage_GetPalette(dib), 256 * sizeof(RGBQUAD));
+	FreeImage_SetDotsPerMeterX(dst, FreeImage_GetDotsPerMeterX(dib));
+	FreeImage_SetDotsPerMeterY(dst, FreeImage_GetDotsPerMeterY(dib));
+	FreeImage_CloneMetadata(dst, dib);
+	return dst;
+}
+
+void rfi_alloc_set_limit(size_t limit)
+{
+	pthread_mutex_lock(&pool.lock);
+	pool.limit = limit;
+	rfi_alloc_shrink(limit);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+void rfi_alloc_trim(void)
+{
+	pthread_mutex_lock(&pool.lock);
+	rfi_alloc_shrink(0);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+void rfi_alloc_get_stats(struct rfi_alloc_stats *stats)
+{
+	pthread_mutex_lock(&pool.lock);
+	*stats = pool.stats;
+	stats->limit = pool.limit;
+	pthread_mutex_unlock(&pool.lock);
+}
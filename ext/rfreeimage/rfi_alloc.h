@@ -0,0 +1,37 @@
+#ifndef RFI_ALLOC_H
+#define RFI_ALLOC_H
+
+#include <stddef.h>
+#include <FreeImage.h>
+
+/*
+ * Bitmaps whose pixels come from a process-wide pool of size-classed
+ * blocks, so streams of same-sized images reuse warm memory instead of
+ * fresh mmaps. Small bitmaps are left to FreeImage. Every bitmap, pooled
+ * or not, must be freed with rfi_bitmap_unload. Unlike FreeImage_Allocate
+ * only the row padding is cleared: callers write every row, or clear the
+ * ones they don't, as the pixels may be another image's.
+ */
+FIBITMAP *rfi_bitmap_allocate(int width, int height, int bpp);
+
+/* copy of an 8, 24 or 32 bpp bitmap into pooled pixels, FreeImage_Clone otherwise */
+FIBITMAP *rfi_bitmap_clone(FIBITMAP *dib);
+
+void rfi_bitmap_unload(FIBITMAP *dib);
+
+struct rfi_alloc_stats {
+	unsigned long hits;
+	unsigned long misses;
+	/* free blocks kept for reuse */
+	size_t cached_bytes;
+	size_t cached_blocks;
+	size_t limit;
+};
+
+/* cap on cached_bytes, 0 disables the pool; trims down to it */
+void rfi_alloc_set_limit(size_t limit);
+/* free all cached blocks */
+void rfi_alloc_trim(void);
+void rfi_alloc_get_stats(struct rfi_alloc_stats *stats);
+
+#endif
@@ -0,0 +1,721 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#ifdef HAVE_JPEGLIB_H
+#include <jpeglib.h>
+#endif
+#ifdef HAVE_PNG_H
+#include <png.h>
+/* FreeImage.h has its own PNG save flag of that name */
+#undef PNG_Z_DEFAULT_COMPRESSION
+#endif
+#include "rfi_alloc.h"
+#include "rfi_decode.h"
+#ifdef HAVE_JPEGLIB_H
+#include "rfi_jpeg.h"
+#endif
+
+/* same as FreeImage_ConvertToGreyscale */
+#define RFI_GREY(r, g, b) (BYTE)(0.2126F * (r) + 0.7152F * (g) + 0.0722F * (b) + 0.5F)
+
+static unsigned int rd16(const BYTE *p, int le)
+{
+	return le ? p[0] | p[1] << 8 : p[0] << 8 | p[1];
+}
+
+static unsigned int rd32(const BYTE *p, int le)
+{
+	return le ? rd16(p, 1) | rd16(p + 2, 1) << 16 : rd16(p, 0) << 16 | rd16(p + 2, 0);
+}
+
+/* offset in p of the Orientation tag's value, 0 if there is none */
+static unsigned int rfi_exif_orientation_at(const BYTE *p, unsigned int len, int *le)
+{
+	const BYTE *tiff;
+	unsigned int n, ifd, count, e, i;
+
+	if (len < 14 || memcmp(p, "Exif\0\0", 6))
+		return 0;
+	tiff = p + 6;
+	n = len - 6;
+	if (!memcmp(tiff, "II*\0", 4))
+		*le = 1;
+	else if (!memcmp(tiff, "MM\0*", 4))
+		*le = 0;
+	else
+		return 0;
+
+	ifd = rd32(tiff + 4, *le);
+	if (ifd > n - 2)
+		return 0;
+	count = rd16(tiff + ifd, *le);
+	for (i = 0; i < count; i++) {
+		e = ifd + 2 + 12 * i;
+		if (e + 12 > n)
+			break;
+		/* Orientation, SHORT */
+		if (rd16(tiff + e, *le) == 0x0112 && rd16(tiff + e + 2, *le) == 3)
+			return 6 + e + 8;
+	}
+	return 0;
+}
+
+int rfi_exif_orientation(const BYTE *p, unsigned int len)
+{
+	unsigned int at, v;
+	int le;
+
+	at = rfi_exif_orientation_at(p, len, &le);
+	if (!at)
+		return 0;
+	v = rd16(p + at, le);
+	return v >= 1 && v <= 8 ? (int)v : 0;
+}
+
+void rfi_jpeg_clear_orientation(BYTE *data, size_t size)
+{
+	size_t off = 2, len;
+	unsigned int at;
+	int le;
+
+	/* the markers before the first scan */
+	while (off + 4 <= size && data[off] == 0xFF && data[off + 1] != 0xDA) {
+		len = rd16(data + off + 2, 0);
+		if (len < 2 || off + 2 + len > size)
+			break;
+		if (data[off + 1] == 0xE1) {
+			at = rfi_exif_orientation_at(data + off + 4, len - 2, &le);
+			if (at) {
+				data[off + 4 + at] = le ? 1 : 0;
+				data[off + 4 + at + 1] = le ? 0 : 1;
+			}
+		}
+		off += 2 + len;
+	}
+}
+
+/*
+ * attach len bytes of value to dib as key of model, like FreeImage's
+ * loaders: FIDT_ASCII values get a terminating NUL
+ */
+static void rfi_set_tag(FIBITMAP *dib, FREE_IMAGE_MDMODEL model, const char *key,
+		FREE_IMAGE_MDTYPE type, const BYTE *value, size_t len)
+{
+	FITAG *tag;
+	BYTE *buf;
+	DWORD n = (DWORD)len + (type == FIDT_ASCII);
+
+	if (!(buf = malloc(n)))
+		return;
+	memcpy(buf, value, len);
+	if (type == FIDT_ASCII)
+		buf[len] = 0;
+	if ((tag = FreeImage_CreateTag())) {
+		FreeImage_SetTagKey(tag, key);
+		FreeImage_SetTagType(tag, type);
+		FreeImage_SetTagCount(tag, n);
+		FreeImage_SetTagLength(tag, n);
+		FreeImage_SetTagValue(tag, buf);
+		FreeImage_SetMetadata(model, dib, key, tag);
+		FreeImage_DeleteTag(tag);
+	}
+	free(buf);
+}
+
+#ifdef HAVE_JPEGLIB_H
+
+#if defined(JCS_EXTENSIONS) && FREEIMAGE_COLORORDER == FREEIMAGE_COLORORDER_BGR
+/* libjpeg-turbo writes BGR and BGRA itself */
+#define RFI_JPEG_EXT
+#endif
+
+/* as FreeImage's RotateExif */
+static FIBITMAP *rfi_exif_rotate(FIBITMAP *dib, int orientation)
+{
+	FIBITMAP *rotated = NULL;
+
+	switch (orientation) {
+		case 2:
+			FreeImage_FlipHorizontal(dib);
+			return dib;
+		case 3:
+			rotated = FreeImage_Rotate(dib, 180, NULL);
+			break;
+		case 4:
+			FreeImage_FlipVertical(dib);
+			return dib;
+		case 5:
+			rotated = FreeImage_Rotate(dib, 90, NULL);
+			if (rotated)
+				FreeImage_FlipVertical(rotated);
+			break;
+		case 6:
+			rotated = FreeImage_Rotate(dib, -90, NULL);
+			break;
+		case 7:
+			rotated = FreeImage_Rotate(dib, -90, NULL);
+			if (rotated)
+				FreeImage_FlipVertical(rotated);
+			break;
+		case 8:
+			rotated = FreeImage_Rotate(dib, 90, NULL);
+			break;
+	}
+	if (!rotated)
+		return dib;
+	rfi_bitmap_unload(dib);
+	return rotated;
+}
+
+#ifndef RFI_JPEG_EXT
+/* reorder a row of RGB triples in place */
+static void rfi_rgb_to_bgr(BYTE *row, unsigned int w)
+{
+	BYTE r, g, b;
+
+	for (; w--; row += 3) {
+		r = row[0];
+		g = row[1];
+		b = row[2];
+		row[FI_RGBA_RED] = r;
+		row[FI_RGBA_GREEN] = g;
+		row[FI_RGBA_BLUE] = b;
+	}
+}
+
+/* widen a row of RGB triples to 32 bpp in place */
+static void rfi_rgb_to_bgra(BYTE *row, unsigned int w)
+{
+	BYTE *s = row + 3 * w, *d = row + 4 * w;
+	BYTE r, g, b;
+
+	while (w--) {
+		s -= 3;
+		d -= 4;
+		r = s[0];
+		g = s[1];
+		b = s[2];
+		d[FI_RGBA_RED] = r;
+		d[FI_RGBA_GREEN] = g;
+		d[FI_RGBA_BLUE] = b;
+		d[FI_RGBA_ALPHA] = 0xff;
+	}
+}
+#endif
+
+/* zero the bottom n rows of dib, left unread */
+static void rfi_clear_rows(FIBITMAP *dib, unsigned int n)
+{
+	memset(FreeImage_GetBits(dib), 0, (size_t)FreeImage_GetPitch(dib) * n);
+}
+
+void rfi_jpeg_error_exit(j_common_ptr cinfo)
+{
+	longjmp(((struct rfi_jpeg_error *)cinfo->err)->jb, 1);
+}
+
+/*
+ * Resolution, comments, raw Exif and XMP, as FreeImage's JPEG loader
+ * keeps them. Exif is not parsed into the FIMD_EXIF_* models; FreeImage
+ * writes the raw block back into JPEGs.
+ */
+static void rfi_jpeg_metadata(j_decompress_ptr cinfo, FIBITMAP *dib)
+{
+	static const char xmp[] = "http://ns.adobe.com/xap/1.0/";
+	jpeg_saved_marker_ptr m;
+
+	if (cinfo->density_unit == 1) {
+		FreeImage_SetDotsPerMeterX(dib, (unsigned int)(cinfo->X_density / 0.0254 + 0.5));
+		FreeImage_SetDotsPerMeterY(dib, (unsigned int)(cinfo->Y_density / 0.0254 + 0.5));
+	} else if (cinfo->density_unit == 2) {
+		FreeImage_SetDotsPerMeterX(dib, cinfo->X_density * 100);
+		FreeImage_SetDotsPerMeterY(dib, cinfo->Y_density * 100);
+	}
+	for (m = cinfo->marker_list; m; m = m->next) {
+		if (m->marker == JPEG_COM)
+			rfi_set_tag(dib, FIMD_COMMENTS, "Comment", FIDT_ASCII, m->data, m->data_length);
+		else if (m->marker != JPEG_APP0 + 1)
+			continue;
+		else if (m->data_length > 6 && !memcmp(m->data, "Exif\0\0", 6))
+			rfi_set_tag(dib, FIMD_EXIF_RAW, "ExifRaw", FIDT_BYTE, m->data, m->data_length);
+		else if (m->data_length > sizeof(xmp) && !memcmp(m->data, xmp, sizeof(xmp)))
+			rfi_set_tag(dib, FIMD_XMP, "XMLPacket", FIDT_ASCII,
+					m->data + sizeof(xmp), m->data_length - sizeof(xmp));
+	}
+}
+
+/* corrupt data warnings aren't fatal, as in FreeImage */
+static void rfi_jpeg_output_message(j_common_ptr cinfo)
+{
+}
+
+/*
+ * The stored rectangle of a w x h JPEG that shows as rect once rotated
+ * by rfi_exif_rotate
+ */
+static void rfi_exif_unrotate_rect(const int *rect, int orientation, int w, int h, int *out)
+{
+	int l = rect[0], t = rect[1], r = rect[2], b = rect[3];
+
+	switch (orientation) {
+		case 2:
+			out[0] = w - r; out[1] = t; out[2] = w - l; out[3] = b;
+			break;
+		case 3:
+			out[0] = w - r; out[1] = h - b; out[2] = w - l; out[3] = h - t;
+			break;
+		case 4:
+			out[0] = l; out[1] = h - b; out[2] = r; out[3] = h - t;
+			break;
+		case 5:
+			out[0] = t; out[1] = l; out[2] = b; out[3] = r;
+			break;
+		case 6:
+			out[0] = t; out[1] = h - r; out[2] = b; out[3] = h - l;
+			break;
+		case 7:
+			out[0] = w - b; out[1] = h - r; out[2] = w - t; out[3] = h - l;
+			break;
+		case 8:
+			out[0] = w - b; out[1] = l; out[2] = w - t; out[3] = r;
+			break;
+		default:
+			memcpy(out, rect, sizeof(int) * 4);
+			break;
+	}
+}
+
+/*
+ * Whole image, or with rect the (left, top, right, bottom) part of it at
+ * 1/scale size, skipping the rest as far as the codec can:
+ * libjpeg-turbo only decodes the iMCU columns and rows covering it. With
+ * orientation_out a whole image is left as stored, see rfi_decode.
+ */
+static enum rfi_decode_status
+rfi_decode_jpeg(FILE *fp, const BYTE *data, long size, unsigned int bpp,
+		int max_size_hint, const int *rect, int rect_scale, int *orientation_out,
+		FIBITMAP **out)
+{
+	struct jpeg_decompress_struct cinfo;
+	struct rfi_jpeg_error jerr;
+	FIBITMAP *volatile dib = NULL;
+	BYTE *volatile line = NULL;
+	jpeg_saved_marker_ptr m;
+	JSAMPROW row;
+	volatile int orientation = 0;
+	double scale;
+	int win[4], w, h, s, y;
+	JDIMENSION skip = 0, xoff = 0;
+#ifdef HAVE_JPEG_CROP_SCANLINE
+	JDIMENSION cw;
+#endif
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = rfi_jpeg_error_exit;
+	jerr.pub.output_message = rfi_jpeg_output_message;
+	if (setjmp(jerr.jb)) {
+		jpeg_destroy_decompress(&cinfo);
+		free(line);
+		if (dib)
+			rfi_bitmap_unload(dib);
+		return RFI_DECODE_FAIL;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	if (fp)
+		jpeg_stdio_src(&cinfo, fp);
+	else
+		jpeg_mem_src(&cinfo, (unsigned char *)data, (unsigned long)size);
+	jpeg_save_markers(&cinfo, JPEG_COM, 0xFFFF);
+	jpeg_save_markers(&cinfo, JPEG_APP0 + 1, 0xFFFF);
+	/* only noted, see below */
+	jpeg_save_markers(&cinfo, JPEG_APP0 + 2, 0);
+	jpeg_save_markers(&cinfo, JPEG_APP0 + 13, 0);
+	jpeg_read_header(&cinfo, TRUE);
+
+	switch (cinfo.jpeg_color_space) {
+		case JCS_GRAYSCALE:
+		case JCS_YCbCr:
+		case JCS_RGB:
+			break;
+		default:
+			/* leave CMYK and friends to FreeImage */
+			jpeg_destroy_decompress(&cinfo);
+			return RFI_DECODE_UNSUPPORTED;
+	}
+	/* ICC profiles and IPTC need FreeImage's parsers to survive */
+	for (m = cinfo.marker_list; m; m = m->next)
+		if (m->marker == JPEG_APP0 + 2 || m->marker == JPEG_APP0 + 13) {
+			jpeg_destroy_decompress(&cinfo);
+			return RFI_DECODE_UNSUPPORTED;
+		}
+
+	for (m = cinfo.marker_list; m && !orientation; m = m->next)
+		if (m->marker == JPEG_APP0 + 1)
+			orientation = rfi_exif_orientation(m->data, m->data_length);
+
+	if (rect) {
+		w = cinfo.image_width;
+		h = cinfo.image_height;
+		if (orientation >= 5) {
+			w = cinfo.image_height;
+			h = cinfo.image_width;
+		}
+		if (rect[0] < 0 || rect[1] < 0 || rect[2] <= rect[0] || rect[3] <= rect[1]
+				|| rect[2] > w || rect[3] > h) {
+			jpeg_destroy_decompress(&cinfo);
+			return RFI_DECODE_RANGE;
+		}
+		rfi_exif_unrotate_rect(rect, orientation, cinfo.image_width, cinfo.image_height, win);
+		/* in output pixels, partly covered ones included */
+		s = rect_scale;
+		win[0] /= s;
+		win[1] /= s;
+		win[2] = (win[2] + s - 1) / s;
+		win[3] = (win[3] + s - 1) / s;
+		cinfo.scale_num = 1;
+		cinfo.scale_denom = s;
+	} else if (max_size_hint > 0) {
+		/* the codec can scale by 1/2, 1/4 or 1/8 while decoding */
+		scale = (double)(cinfo.image_width > cinfo.image_height ?
+				cinfo.image_width : cinfo.image_height) / max_size_hint;
+		cinfo.scale_num = 1;
+		cinfo.scale_denom = scale >= 8 ? 8 : scale >= 4 ? 4 : scale >= 2 ? 2 : 1;
+	}
+
+	if (bpp == 8)
+		cinfo.out_color_space = JCS_GRAYSCALE;
+	else
+#ifdef RFI_JPEG_EXT
+		cinfo.out_color_space = bpp == 24 ? JCS_EXT_BGR : JCS_EXT_BGRA;
+#else
+		cinfo.out_color_space = JCS_RGB;
+#endif
+	jpeg_start_decompress(&cinfo);
+
+	if (rect) {
+		if (win[2] > (int)cinfo.output_width)
+			win[2] = cinfo.output_width;
+		if (win[3] > (int)cinfo.output_height)
+			win[3] = cinfo.output_height;
+#ifdef HAVE_JPEG_CROP_SCANLINE
+		/* widened to iMCU boundaries, xoff moves left */
+		xoff = win[0];
+		cw = win[2] - win[0];
+		jpeg_crop_scanline(&cinfo, &xoff, &cw);
+		skip = jpeg_skip_scanlines(&cinfo, win[1]);
+#endif
+		dib = rfi_bitmap_allocate(win[2] - win[0], win[3] - win[1], bpp);
+		line = malloc((size_t)cinfo.output_width * cinfo.output_components);
+		if (!dib || !line) {
+			jpeg_destroy_decompress(&cinfo);
+			free(line);
+			if (dib)
+				rfi_bitmap_unload(dib);
+			return RFI_DECODE_FAIL;
+		}
+		rfi_jpeg_metadata(&cinfo, dib);
+		row = line;
+		for (y = skip; y < win[3]; y++) {
+			if (jpeg_read_scanlines(&cinfo, &row, 1) != 1) {
+				rfi_clear_rows(dib, win[3] - win[1] - (y > win[1] ? y - win[1] : 0));
+				break;
+			}
+			if (y < win[1])
+				continue;
+			memcpy(FreeImage_GetScanLine(dib, win[3] - 1 - y),
+				line + (size_t)(win[0] - xoff) * cinfo.output_components,
+				(size_t)(win[2] - win[0]) * cinfo.output_components);
+#ifndef RFI_JPEG_EXT
+			if (bpp == 24)
+				rfi_rgb_to_bgr(FreeImage_GetScanLine(dib, win[3] - 1 - y), win[2] - win[0]);
+			else if (bpp == 32)
+				rfi_rgb_to_bgra(FreeImage_GetScanLine(dib, win[3] - 1 - y), win[2] - win[0]);
+#endif
+		}
+		/* the rows below aren't needed */
+		jpeg_destroy_decompress(&cinfo);
+		free(line);
+		*out = rfi_exif_rotate(dib, orientation);
+		return RFI_DECODE_OK;
+	}
+
+	dib = rfi_bitmap_allocate(cinfo.output_width, cinfo.output_height, bpp);
+	if (!dib) {
+		jpeg_destroy_decompress(&cinfo);
+		return RFI_DECODE_FAIL;
+	}
+	rfi_jpeg_metadata(&cinfo, dib);
+	while (cinfo.output_scanline < cinfo.output_height) {
+		row = FreeImage_GetScanLine(dib, cinfo.output_height - 1 - cinfo.output_scanline);
+		if (jpeg_read_scanlines(&cinfo, &row, 1) != 1) {
+			rfi_clear_rows(dib, cinfo.output_height - cinfo.output_scanline);
+			break;
+		}
+#ifndef RFI_JPEG_EXT
+		if (bpp == 24)
+			rfi_rgb_to_bgr(row, cinfo.output_width);
+		else if (bpp == 32)
+			rfi_rgb_to_bgra(row, cinfo.output_width);
+#endif
+	}
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+
+	if (orientation_out) {
+		*orientation_out = orientation;
+		*out = dib;
+		return RFI_DECODE_OK;
+	}
+	*out = rfi_exif_rotate(dib, orientation);
+	return RFI_DECODE_OK;
+}
+
+#endif /* HAVE_JPEGLIB_H */
+
+#ifdef HAVE_PNG_H
+
+struct rfi_png_src {
+	const BYTE *data;
+	png_size_t size;
+	png_size_t pos;
+};
+
+static void rfi_png_read(png_structp png, png_bytep buf, png_size_t len)
+{
+	struct rfi_png_src *src = png_get_io_ptr(png);
+
+	if (len > src->size - src->pos)
+		png_error(png, "Read Error");
+	memcpy(buf, src->data + src->pos, len);
+	src->pos += len;
+}
+
+static void rfi_png_error(png_structp png, png_const_charp msg)
+{
+	png_longjmp(png, 1);
+}
+
+static void rfi_png_warning(png_structp png, png_const_charp msg)
+{
+}
+
+/* resolution and text chunks, as FreeImage's PNG loader keeps them */
+static void rfi_png_metadata(png_structp png, png_infop info, FIBITMAP *dib)
+{
+	png_uint_32 res_x, res_y;
+	png_textp text;
+	int unit, n, i;
+
+	if (png_get_pHYs(png, info, &res_x, &res_y, &unit) && unit == PNG_RESOLUTION_METER) {
+		FreeImage_SetDotsPerMeterX(dib, res_x);
+		FreeImage_SetDotsPerMeterY(dib, res_y);
+	}
+	n = png_get_text(png, info, &text, NULL);
+	for (i = 0; i < n; i++) {
+		if (!strcmp(text[i].key, "XML:com.adobe.xmp"))
+			rfi_set_tag(dib, FIMD_XMP, "XMLPacket", FIDT_ASCII,
+					(const BYTE *)text[i].text, strlen(text[i].text));
+		else
+			rfi_set_tag(dib, FIMD_COMMENTS, text[i].key, FIDT_ASCII,
+					(const BYTE *)text[i].text, strlen(text[i].text));
+	}
+}
+
+enum rfi_png_mode {
+	/* libpng writes the final pixels */
+	RFI_PNG_DIRECT,
+	/* palette indices, mapped to grey afterwards */
+	RFI_PNG_PALETTE,
+	/* one RGB row at a time, converted to grey */
+	RFI_PNG_ROWS,
+};
+
+static enum rfi_decode_status
+rfi_decode_png(FILE *fp, const BYTE *data, long size, unsigned int bpp, FIBITMAP **out)
+{
+	png_structp png;
+	png_infop info;
+	struct rfi_png_src src;
+	FIBITMAP *volatile dib = NULL;
+	BYTE *volatile tmp = NULL;
+	png_bytep *volatile rows = NULL;
+	volatile enum rfi_decode_status status = RFI_DECODE_FAIL;
+	volatile enum rfi_png_mode mode = RFI_PNG_DIRECT;
+	png_uint_32 w, h, x, y;
+	int depth, color, interlace, npal = 0, i;
+	png_colorp pal;
+	double gamma;
+	BYTE grey[256], *line;
+
+	png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, rfi_png_error, rfi_png_warning);
+	if (!png)
+		return RFI_DECODE_FAIL;
+	info = png_create_info_struct(png);
+	if (!info) {
+		png_destroy_read_struct(&png, NULL, NULL);
+		return RFI_DECODE_FAIL;
+	}
+	if (setjmp(png_jmpbuf(png))) {
+		status = RFI_DECODE_FAIL;
+		goto out;
+	}
+
+	if (fp) {
+		png_init_io(png, fp);
+	} else {
+		src.data = data;
+		src.size = size;
+		src.pos = 0;
+		png_set_read_fn(png, &src, rfi_png_read);
+	}
+	png_read_info(png, info);
+	png_get_IHDR(png, info, &w, &h, &depth, &color, &interlace, NULL, NULL);
+	/* 16 bit samples, and ICC profiles FreeImage would attach */
+	if (depth > 8 || png_get_valid(png, info, PNG_INFO_iCCP)) {
+		status = RFI_DECODE_UNSUPPORTED;
+		goto out;
+	}
+	/* FreeImage's default screen gamma */
+	if (png_get_gAMA(png, info, &gamma))
+		png_set_gamma(png, 2.2, gamma);
+
+	if (bpp == 24 || bpp == 32) {
+		/* palette, low bit depths and tRNS */
+		png_set_expand(png);
+		if (!(color & PNG_COLOR_MASK_COLOR))
+			png_set_gray_to_rgb(png);
+#if FREEIMAGE_COLORORDER == FREEIMAGE_COLORORDER_BGR
+		png_set_bgr(png);
+#endif
+		if (bpp == 24)
+			png_set_strip_alpha(png);
+		else
+			png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+	} else if (color == PNG_COLOR_TYPE_PALETTE) {
+		png_set_packing(png);
+		mode = RFI_PNG_PALETTE;
+	} else if (!(color & PNG_COLOR_MASK_COLOR)) {
+		png_set_expand_gray_1_2_4_to_8(png);
+		png_set_strip_alpha(png);
+	} else {
+		/* the rows of an interlaced image must all be kept around */
+		if (interlace != PNG_INTERLACE_NONE) {
+			status = RFI_DECODE_UNSUPPORTED;
+			goto out;
+		}
+		png_set_strip_alpha(png);
+		mode = RFI_PNG_ROWS;
+	}
+	png_set_interlace_handling(png);
+	png_read_update_info(png, info);
+
+	dib = rfi_bitmap_allocate(w, h, bpp);
+	if (!dib)
+		goto out;
+
+	if (mode == RFI_PNG_ROWS) {
+		tmp = malloc(png_get_rowbytes(png, info));
+		if (!tmp)
+			goto out;
+		for (y = 0; y < h; y++) {
+			png_read_row(png, tmp, NULL);
+			line = FreeImage_GetScanLine(dib, h - 1 - y);
+			for (x = 0; x < w; x++)
+				line[x] = RFI_GREY(tmp[3 * x], tmp[3 * x + 1], tmp[3 * x + 2]);
+		}
+	} else {
+		rows = malloc(sizeof(png_bytep) * h);
+		if (!rows)
+			goto out;
+		for (y = 0; y < h; y++)
+			rows[y] = FreeImage_GetScanLine(dib, h - 1 - y);
+		png_read_image(png, rows);
+	}
+
+	if (mode == RFI_PNG_PALETTE) {
+		memset(grey, 0, sizeof(grey));
+		if (png_get_PLTE(png, info, &pal, &npal))
+			for (i = 0; i < npal && i < 256; i++)
+				grey[i] = RFI_GREY(pal[i].red, pal[i].green, pal[i].blue);
+		for (y = 0; y < h; y++)
+			for (x = 0; x < w; x++)
+				rows[y][x] = grey[rows[y][x]];
+	}
+	/* text after the pixels too */
+	png_read_end(png, info);
+	rfi_png_metadata(png, info, dib);
+	status = RFI_DECODE_OK;
+
+out:
+	free(tmp);
+	free(rows);
+	png_destroy_read_struct(&png, &info, NULL);
+	if (status == RFI_DECODE_OK)
+		*out = dib;
+	else if (dib)
+		rfi_bitmap_unload(dib);
+	return status;
+}
+
+#endif /* HAVE_PNG_H */
+
+enum rfi_decode_status rfi_decode(FREE_IMAGE_FORMAT fif, const char *filename,
+		const BYTE *data, long size, unsigned int bpp, int max_size_hint,
+		int *orientation, FIBITMAP **out)
+{
+	enum rfi_decode_status status = RFI_DECODE_UNSUPPORTED;
+	FILE *fp = NULL;
+
+	if (orientation)
+		*orientation = 0;
+	if (bpp != 8 && bpp != 24 && bpp != 32)
+		return RFI_DECODE_UNSUPPORTED;
+	switch (fif) {
+#ifdef HAVE_JPEGLIB_H
+		case FIF_JPEG:
+#endif
+#ifdef HAVE_PNG_H
+		case FIF_PNG:
+#endif
+			break;
+		default:
+			return RFI_DECODE_UNSUPPORTED;
+	}
+
+	if (filename && !(fp = fopen(filename, "rb")))
+		return RFI_DECODE_FAIL;
+#ifdef HAVE_JPEGLIB_H
+	if (fif == FIF_JPEG)
+		status = rfi_decode_jpeg(fp, data, size, bpp, max_size_hint, NULL, 0, orientation, out);
+#endif
+#ifdef HAVE_PNG_H
+	if (fif == FIF_PNG)
+		status = rfi_decode_png(fp, data, size, bpp, out);
+#endif
+	if (fp)
+		fclose(fp);
+	return status;
+}
+
+enum rfi_decode_status rfi_decode_region(FREE_IMAGE_FORMAT fif, const char *filename,
+		const BYTE *data, long size, unsigned int bpp, const int *rect, int scale,
+		FIBITMAP **out)
+{
+	enum rfi_decode_status status = RFI_DECODE_UNSUPPORTED;
+	FILE *fp = NULL;
+
+	if (bpp != 8 && bpp != 24 && bpp != 32)
+		return RFI_DECODE_UNSUPPORTED;
+#ifdef HAVE_JPEGLIB_H
+	if (fif != FIF_JPEG)
+		return RFI_DECODE_UNSUPPORTED;
+	if (filename && !(fp = fopen(filename, "rb")))
+		return RFI_DECODE_FAIL;
+	status = rfi_decode_jpeg(fp, data, size, bpp, 0, rect, scale, NULL, out);
+	if (fp)
+		fclose(fp);
+#endif
+	return status;
+}
@@ -0,0 +1,46 @@
+#ifndef RFI_DECODE_H
+#define RFI_DECODE_H
+
+#include <stddef.h>
+#include <FreeImage.h>
+
+enum rfi_decode_status {
+	RFI_DECODE_OK = 0,
+	RFI_DECODE_FAIL,
+	/* not handled here, load with FreeImage and convert */
+	RFI_DECODE_UNSUPPORTED,
+	/* the region is not inside the image */
+	RFI_DECODE_RANGE,
+};
+
+/*
+ * Decode a JPEG or PNG file (or blob, when filename is NULL) straight into
+ * a new 8, 24 or 32 bpp bitmap, without FreeImage's intermediate bitmap
+ * at the source depth. Follows FreeImage's JPEG_EXIFROTATE | JPEG_ACCURATE
+ * loader, max_size_hint as in FreeImage's JPEG size hint. With orientation
+ * not NULL the Exif rotation is left to the caller: the bitmap is as
+ * stored and *orientation is the tag (0 or 1 for none).
+ * Resolution, comments, PNG text, raw Exif and XMP are kept as FreeImage
+ * keeps them. Images with an ICC profile or IPTC data are
+ * RFI_DECODE_UNSUPPORTED, FreeImage's loaders keep those.
+ */
+enum rfi_decode_status rfi_decode(FREE_IMAGE_FORMAT fif, const char *filename,
+		const BYTE *data, long size, unsigned int bpp, int max_size_hint,
+		int *orientation, FIBITMAP **out);
+
+/*
+ * Decode only rect (left, top, right, bottom, in Exif rotated pixels) of
+ * a JPEG, at 1/scale size for scale 1, 2, 4 or 8. Pixels only partly
+ * covered at that scale are included.
+ */
+enum rfi_decode_status rfi_decode_region(FREE_IMAGE_FORMAT fif, const char *filename,
+		const BYTE *data, long size, unsigned int bpp, const int *rect, int scale,
+		FIBITMAP **out);
+
+/* Orientation tag (1..8) of an APP1 Exif segment, 0 if it has none */
+int rfi_exif_orientation(const BYTE *p, unsigned int len);
+
+/* set the Exif orientation of a JPEG stream to 1 (normal), in place */
+void rfi_jpeg_clear_orientation(BYTE *data, size_t size);
+
+#endif
@@ -0,0 +1,534 @@
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rfi_draw.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define RFI_GREY(r, g, b) (BYTE)(0.2126F * (r) + 0.7152F * (g) + 0.0722F * (b) + 0.5F)
+
+static inline BYTE *rfi_canvas_row(const struct rfi_canvas *c, int y)
+{
+	return c->bits + (size_t)(c->height - 1 - y) * c->pitch;
+}
+
+/* v saturated to int, for span ends computed past the int range */
+static inline int rfi_sat(int64_t v)
+{
+	return v < INT_MIN ? INT_MIN : v > INT_MAX ? INT_MAX : (int)v;
+}
+
+/* x rounded to a span end just off the canvas at most */
+static inline int rfi_clamp_x(const struct rfi_canvas *c, double x)
+{
+	return x < -1 ? -1 : x > c->width ? c->width : (int)x;
+}
+
+int rfi_canvas_init(struct rfi_canvas *c, FIBITMAP *dib, unsigned int bgra)
+{
+	unsigned int bpp = FreeImage_GetBPP(dib);
+
+	if (FreeImage_GetImageType(dib) != FIT_BITMAP || !FreeImage_HasPixels(dib)
+			|| (bpp != 8 && bpp != 24 && bpp != 32))
+		return -1;
+	c->bits = FreeImage_GetBits(dib);
+	c->pitch = FreeImage_GetPitch(dib);
+	c->width = FreeImage_GetWidth(dib);
+	c->height = FreeImage_GetHeight(dib);
+	c->channels = bpp / 8;
+	rfi_canvas_color(c, bgra);
+	return 0;
+}
+
+void rfi_canvas_color(struct rfi_canvas *c, unsigned int bgra)
+{
+	c->pixel[FI_RGBA_BLUE] = bgra & 0xff;
+	c->pixel[FI_RGBA_GREEN] = (bgra >> 8) & 0xff;
+	c->pixel[FI_RGBA_RED] = (bgra >> 16) & 0xff;
+	c->pixel[FI_RGBA_ALPHA] = bgra >> 24;
+	if (c->channels == 1)
+		c->pixel[0] = RFI_GREY((bgra >> 16) & 0xff, (bgra >> 8) & 0xff, bgra & 0xff);
+}
+
+void rfi_fill_span(const struct rfi_canvas *c, int y, int x1, int x2)
+{
+	BYTE *p;
+	int n;
+
+	if (y < 0 || y >= c->height)
+		return;
+	if (x1 < 0)
+		x1 = 0;
+	if (x2 >= c->width)
+		x2 = c->width - 1;
+	if (x1 > x2)
+		return;
+	n = x2 - x1 + 1;
+	p = rfi_canvas_row(c, y) + (size_t)x1 * c->channels;
+
+	switch (c->channels) {
+		case 1:
+			memset(p, c->pixel[0], n);
+			break;
+		case 4: {
+			uint32_t v;
+			memcpy(&v, c->pixel, 4);
+#ifdef __SSE2__
+			{
+				__m128i vv = _mm_set1_epi32((int)v);
+				for (; n >= 4; n -= 4, p += 16)
+					_mm_storeu_si128((__m128i *)p, vv);
+			}
+#endif
+			for (; n > 0; n--, p += 4)
+				memcpy(p, &v, 4);
+			break;
+		}
+		default: {
+			/* 16 pixels of pattern, copied in 48 byte blocks */
+			BYTE pat[48];
+			int i;
+			for (i = 0; i < 48; i += 3)
+				memcpy(pat + i, c->pixel, 3);
+			for (; n >= 16; n -= 16, p += 48)
+				memcpy(p, pat, 48);
+			memcpy(p, pat, n * 3);
+			break;
+		}
+	}
+}
+
+void rfi_fill_rect(const struct rfi_canvas *c, int x1, int y1, int x2, int y2)
+{
+	int y;
+
+	if (y1 < 0)
+		y1 = 0;
+	if (y2 >= c->height)
+		y2 = c->height - 1;
+	for (y = y1; y <= y2; y++)
+		rfi_fill_span(c, y, x1, x2);
+}
+
+/*
+ * Edge functions of int coordinates take up to 66 bits, int64_t is only
+ * exact for coordinates within +-2^30 where there is no __int128.
+ */
+#ifdef __SIZEOF_INT128__
+__extension__ typedef __int128 rfi_wide;
+#else
+typedef int64_t rfi_wide;
+#endif
+
+static inline rfi_wide rfi_floor_div(rfi_wide a, rfi_wide b)
+{
+	rfi_wide q = a / b;
+	return (a % b != 0 && ((a < 0) != (b < 0))) ? q - 1 : q;
+}
+
+/*
+ * Narrow [*lo, *hi] to the x with a * x + b > 0, which for an edge is
+ * the side the interior lies on.
+ */
+static inline void rfi_clip_halfplane(rfi_wide a, rfi_wide b, rfi_wide *lo, rfi_wide *hi)
+{
+	rfi_wide x;
+
+	if (a == 0) {
+		if (b <= 0)
+			*hi = *lo - 1;
+	} else if (a > 0) {
+		x = rfi_floor_div(-b, a) + 1;
+		if (x > *lo)
+			*lo = x;
+	} else {
+		/* x < -b / a, i.e. x <= ceil(b / -a) - 1 */
+		x = -rfi_floor_div(-b, -a) - 1;
+		if (x < *hi)
+			*hi = x;
+	}
+}
+
+void rfi_fill_quad(const struct rfi_canvas *c, const int *xy)
+{
+	rfi_wide lo[2], hi[2], a, b;
+	int minx = xy[0], maxx = xy[0], miny = xy[1], maxy = xy[1];
+	int i, s, y, x0, y0, x1, y1;
+
+	for (i = 1; i < 4; i++) {
+		if (xy[2 * i] < minx) minx = xy[2 * i];
+		if (xy[2 * i] > maxx) maxx = xy[2 * i];
+		if (xy[2 * i + 1] < miny) miny = xy[2 * i + 1];
+		if (xy[2 * i + 1] > maxy) maxy = xy[2 * i + 1];
+	}
+	if (minx < 0)
+		minx = 0;
+	if (maxx >= c->width)
+		maxx = c->width - 1;
+	if (miny < 0)
+		miny = 0;
+	if (maxy >= c->height)
+		maxy = c->height - 1;
+
+	for (y = miny; y <= maxy; y++) {
+		/* s = 0 for clockwise, 1 for counter-clockwise interiors */
+		for (s = 0; s < 2; s++) {
+			lo[s] = minx;
+			hi[s] = maxx;
+		}
+		for (i = 0; i < 4; i++) {
+			x0 = xy[2 * i];
+			y0 = xy[2 * i + 1];
+			x1 = xy[(2 * i + 2) & 7];
+			y1 = xy[(2 * i + 3) & 7];
+			/* cross product of the edge and (x, y) - (x0, y0) */
+			a = -((rfi_wide)y1 - y0);
+			b = ((rfi_wide)x1 - x0) * ((rfi_wide)y - y0) + ((rfi_wide)y1 - y0) * x0;
+			rfi_clip_halfplane(a, b, &lo[0], &hi[0]);
+			rfi_clip_halfplane(-a, -b, &lo[1], &hi[1]);
+		}
+		for (s = 0; s < 2; s++)
+			if (lo[s] <= hi[s])
+				rfi_fill_span(c, y, (int)lo[s], (int)hi[s]);
+	}
+}
+
+static inline void rfi_put_pixel(const struct rfi_canvas *c, int x, int y)
+{
+	if (x >= 0 && x < c->width && y >= 0 && y < c->height)
+		memcpy(rfi_canvas_row(c, y) + (size_t)x * c->channels, c->pixel, c->channels);
+}
+
+/* blend the colour over pixel (x, y), cover in [0, 1] */
+static inline void rfi_blend_pixel(const struct rfi_canvas *c, int x, int y, double cover)
+{
+	unsigned int a = (unsigned int)(cover * 256 + 0.5);
+	BYTE *p;
+	int i;
+
+	if (x < 0 || x >= c->width || y < 0 || y >= c->height || a == 0)
+		return;
+	if (a > 256)
+		a = 256;
+	p = rfi_canvas_row(c, y) + (size_t)x * c->channels;
+	for (i = 0; i < c->channels; i++)
+		p[i] = (BYTE)((p[i] * (256 - a) + c->pixel[i] * a + 128) >> 8);
+}
+
+static int rfi_isqrt(int64_t v)
+{
+	int64_t r = (int64_t)sqrt((double)v);
+
+	while (r * r > v)
+		r--;
+	while ((r + 1) * (r + 1) <= v)
+		r++;
+	return (int)r;
+}
+
+void rfi_fill_disc(const struct rfi_canvas *c, int x, int y, int r)
+{
+	int64_t j, jlo = -(int64_t)r, jhi = r, w;
+
+	/* only the rows on the canvas */
+	if (jlo < -(int64_t)y)
+		jlo = -(int64_t)y;
+	if (jhi > (int64_t)c->height - 1 - y)
+		jhi = (int64_t)c->height - 1 - y;
+	for (j = jlo; j <= jhi; j++) {
+		w = rfi_isqrt((int64_t)r * r - j * j);
+		rfi_fill_span(c, (int)(y + j), rfi_sat(x - w), rfi_sat(x + w));
+	}
+}
+
+/*
+ * Bresenham, one pixel per step along the major axis. After k steps the
+ * minor axis has moved floor((2 * k * b + a) / (2 * a)) for major and
+ * minor extents a and b, which is where the error term puts it, so the
+ * walk starts and stops at the canvas edges instead of the end points.
+ */
+static void rfi_thin_line(const struct rfi_canvas *c, int x0, int y0, int x1, int y1)
+{
+	int64_t adx = x1 > x0 ? (int64_t)x1 - x0 : (int64_t)x0 - x1;
+	int64_t ady = y1 > y0 ? (int64_t)y1 - y0 : (int64_t)y0 - y1;
+	int xmajor = adx >= ady;
+	int64_t maj0 = xmajor ? x0 : y0, min0 = xmajor ? y0 : x0;
+	int smaj = (xmajor ? x0 < x1 : y0 < y1) ? 1 : -1;
+	int smin = (xmajor ? y0 < y1 : x0 < x1) ? 1 : -1;
+	int64_t len = xmajor ? c->width : c->height, k, k0, k1, m;
+	/* extents below 2^32, so k * b fits */
+	uint64_t a = xmajor ? adx : ady, b = xmajor ? ady : adx, q, r;
+
+	/* the steps with the major coordinate on the canvas */
+	if (smaj > 0) {
+		k0 = maj0 < 0 ? -maj0 : 0;
+		k1 = len - 1 - maj0;
+	} else {
+		k0 = maj0 > len - 1 ? maj0 - (len - 1) : 0;
+		k1 = maj0;
+	}
+	if (k1 > (int64_t)a)
+		k1 = a;
+	if (k0 > k1)
+		return;
+
+	/* k * b = q * a + r */
+	q = a ? (uint64_t)k0 * b / a : 0;
+	r = a ? (uint64_t)k0 * b % a : 0;
+	for (k = k0; k <= k1; k++) {
+		m = min0 + smin * (int64_t)(q + (a && 2 * r >= a));
+		if (m >= 0 && m < (xmajor ? c->height : c->width)) {
+			if (xmajor)
+				rfi_put_pixel(c, (int)(maj0 + smaj * k), (int)m);
+			else
+				rfi_put_pixel(c, (int)m, (int)(maj0 + smaj * k));
+		}
+		r += b;
+		if (r >= a) {
+			r -= a;
+			q++;
+		}
+	}
+}
+
+/* a segment and the pixel centres within r of it */
+struct rfi_capsule {
+	double x0, y0, dx, dy;
+	/* squared length */
+	double len2;
+};
+
+/* narrow [*lo, *hi] to the x with a * x + b >= 0 */
+static inline void rfi_clip_linear(double a, double b, double *lo, double *hi)
+{
+	if (a > 0) {
+		if (-b / a > *lo)
+			*lo = -b / a;
+	} else if (a < 0) {
+		if (-b / a < *hi)
+			*hi = -b / a;
+	} else if (b < 0) {
+		*lo = HUGE_VAL;
+		*hi = -HUGE_VAL;
+	}
+}
+
+/* x range of row y within r of the capsule's segment, empty if lo > hi */
+static void rfi_capsule_row(const struct rfi_capsule *s, double y, double r,
+		double *lo, double *hi)
+{
+	double ry = y - s->y0, h, blo, bhi;
+	int end;
+
+	*lo = HUGE_VAL;
+	*hi = -HUGE_VAL;
+	if (r < 0)
+		return;
+	/* the band along the segment: |cross| <= r * len, 0 <= dot <= len^2 */
+	if (s->len2 > 0) {
+		double rl = r * sqrt(s->len2);
+		blo = -HUGE_VAL;
+		bhi = HUGE_VAL;
+		/* cross = dx * ry - dy * (x - x0) */
+		rfi_clip_linear(-s->dy, s->dx * ry + s->dy * s->x0 + rl, &blo, &bhi);
+		rfi_clip_linear(s->dy, -s->dx * ry - s->dy * s->x0 + rl, &blo, &bhi);
+		/* dot = dx * (x - x0) + dy * ry */
+		rfi_clip_linear(s->dx, -s->dx * s->x0 + s->dy * ry, &blo, &bhi);
+		rfi_clip_linear(-s->dx, s->dx * s->x0 - s->dy * ry + s->len2, &blo, &bhi);
+		if (blo <= bhi) {
+			*lo = blo;
+			*hi = bhi;
+		}
+	}
+	/* round caps, the union with the band stays one interval */
+	for (end = 0; end < 2; end++) {
+		double cx = s->x0 + end * s->dx, cy = s->y0 + end * s->dy;
+		h = r * r - (y - cy) * (y - cy);
+		if (h < 0)
+			continue;
+		h = sqrt(h);
+		if (cx - h < *lo)
+			*lo = cx - h;
+		if (cx + h > *hi)
+			*hi = cx + h;
+	}
+}
+
+static double rfi_capsule_dist(const struct rfi_capsule *s, double x, double y)
+{
+	double t = 0, px, py;
+
+	if (s->len2 > 0) {
+		t = ((x - s->x0) * s->dx + (y - s->y0) * s->dy) / s->len2;
+		t = t < 0 ? 0 : t > 1 ? 1 : t;
+	}
+	px = x - (s->x0 + t * s->dx);
+	py = y - (s->y0 + t * s->dy);
+	return sqrt(px * px + py * py);
+}
+
+void rfi_draw_line(const struct rfi_canvas *c, int x0, int y0, int x1, int y1,
+		int width, int antialias)
+{
+	struct rfi_capsule s;
+	double r = width / 2, lo, hi, ilo, ihi;
+	int64_t ymin, ymax;
+	int y, x, xa, xb, ia, ib;
+
+	if (r == 0 && !antialias) {
+		rfi_thin_line(c, x0, y0, x1, y1);
+		return;
+	}
+	if (r == 0)
+		r = 0.5;
+
+	s.x0 = x0;
+	s.y0 = y0;
+	s.dx = (double)x1 - x0;
+	s.dy = (double)y1 - y0;
+	s.len2 = s.dx * s.dx + s.dy * s.dy;
+
+	/* rows the line (plus its blended fringe) can touch */
+	ymin = (int64_t)(y0 < y1 ? y0 : y1) - (int64_t)ceil(r) - 1;
+	ymax = (int64_t)(y0 > y1 ? y0 : y1) + (int64_t)ceil(r) + 1;
+	if (ymin < 0)
+		ymin = 0;
+	if (ymax >= c->height)
+		ymax = c->height - 1;
+
+	for (y = (int)ymin; y <= ymax; y++) {
+		if (!antialias) {
+			rfi_capsule_row(&s, y, r, &lo, &hi);
+			if (lo <= hi)
+				rfi_fill_span(c, y, rfi_clamp_x(c, ceil(lo)), rfi_clamp_x(c, floor(hi)));
+			continue;
+		}
+		/* solid inside r - 0.5, blended out to r + 0.5 */
+		rfi_capsule_row(&s, y, r + 0.5, &lo, &hi);
+		if (lo > hi)
+			continue;
+		rfi_capsule_row(&s, y, r - 0.5, &ilo, &ihi);
+		xa = rfi_clamp_x(c, ceil(lo));
+		xb = rfi_clamp_x(c, floor(hi));
+		if (xa < 0)
+			xa = 0;
+		if (xb >= c->width)
+			xb = c->width - 1;
+		if (ilo <= ihi) {
+			ia = rfi_clamp_x(c, ceil(ilo));
+			ib = rfi_clamp_x(c, floor(ihi));
+			if (ia < xa)
+				ia = xa;
+		} else {
+			ia = xb + 1;
+			ib = xb;
+		}
+		for (x = xa; x <= xb; x++) {
+			if (x == ia && ia <= ib) {
+				rfi_fill_span(c, y, ia, ib);
+				x = ib;
+				continue;
+			}
+			rfi_blend_pixel(c, x, y, r + 0.5 - rfi_capsule_dist(&s, x, y));
+		}
+	}
+}
+
+void rfi_draw_rect(const struct rfi_canvas *c, int x1, int y1, int x2, int y2, int width)
+{
+	int hs = width / 2, t;
+
+	if (x2 < x1) {
+		t = x1; x1 = x2; x2 = t;
+	}
+	if (y2 < y1) {
+		t = y1; y1 = y2; y2 = t;
+	}
+	rfi_fill_rect(c, x1, rfi_sat((int64_t)y1 - hs), x2, rfi_sat((int64_t)y1 + hs));
+	rfi_fill_rect(c, x1, rfi_sat((int64_t)y2 - hs), x2, rfi_sat((int64_t)y2 + hs));
+	rfi_fill_rect(c, rfi_sat((int64_t)x1 - hs), y1, rfi_sat((int64_t)x1 + hs), y2);
+	rfi_fill_rect(c, rfi_sat((int64_t)x2 - hs), y1, rfi_sat((int64_t)x2 + hs), y2);
+}
+
+#define RFI_TILE_SHIFT 6
+
+struct rfi_tile_key {
+	uint64_t key;
+	const int32_t *rec;
+};
+
+static int rfi_tile_cmp(const void *a, const void *b)
+{
+	const struct rfi_tile_key *ka = a, *kb = b;
+
+	if (ka->key != kb->key)
+		return ka->key < kb->key ? -1 : 1;
+	/* keep the given order within a tile */
+	return ka->rec < kb->rec ? -1 : ka->rec > kb->rec;
+}
+
+static uint64_t rfi_tile_of(const int32_t *r)
+{
+	int64_t x = r[0] < r[2] ? r[0] : r[2];
+	int64_t y = r[1] < r[3] ? r[1] : r[3];
+
+	/* row major over tiles, offset so negative corners sort first */
+	x = (x >> RFI_TILE_SHIFT) + ((int64_t)1 << 31);
+	y = (y >> RFI_TILE_SHIFT) + ((int64_t)1 << 31);
+	return (uint64_t)y << 32 | (uint64_t)x;
+}
+
+int rfi_draw_rects(struct rfi_canvas *c, const int32_t *rec, long n, int tile_sort)
+{
+	struct rfi_tile_key *keys;
+	const int32_t *r;
+	long i;
+
+	if (!tile_sort) {
+		for (i = 0, r = rec; i < n; i++, r += RFI_RECT_FIELDS) {
+			rfi_canvas_color(c, (uint32_t)r[4]);
+			rfi_draw_rect(c, r[0], r[1], r[2], r[3], r[5]);
+		}
+		return 0;
+	}
+
+	keys = malloc(sizeof(*keys) * (n ? n : 1));
+	if (!keys)
+		return -1;
+	for (i = 0, r = rec; i < n; i++, r += RFI_RECT_FIELDS) {
+		keys[i].key = rfi_tile_of(r);
+		keys[i].rec = r;
+	}
+	qsort(keys, n, sizeof(*keys), rfi_tile_cmp);
+	for (i = 0; i < n; i++) {
+		r = keys[i].rec;
+		rfi_canvas_color(c, (uint32_t)r[4]);
+		rfi_draw_rect(c, r[0], r[1], r[2], r[3], r[5]);
+	}
+	free(keys);
+	return 0;
+}
+
+void rfi_draw_lines(struct rfi_canvas *c, const int32_t *rec, long n, int antialias)
+{
+	long i;
+
+	for (i = 0; i < n; i++, rec += RFI_LINE_FIELDS) {
+		rfi_canvas_color(c, (uint32_t)rec[4]);
+		rfi_draw_line(c, rec[0], rec[1], rec[2], rec[3], rec[5], antialias);
+	}
+}
+
+void rfi_draw_points(struct rfi_canvas *c, const int32_t *rec, long n)
+{
+	long i;
+
+	for (i = 0; i < n; i++, rec += RFI_POINT_FIELDS) {
+		rfi_canvas_color(c, (uint32_t)rec[2]);
+		rfi_fill_disc(c, rec[0], rec[1], rec[3] / 2);
+	}
+}
@@ -0,0 +1,65 @@
+#ifndef RFI_DRAW_H
+#define RFI_DRAW_H
+
+#include <stdint.h>
+#include <FreeImage.h>
+
+/*
+ * Rasterisers writing straight into the rows of an 8, 24 or 32 bpp
+ * bitmap. Coordinates are top-down like the ruby API and everything is
+ * clipped to the bitmap.
+ */
+struct rfi_canvas {
+	BYTE *bits;
+	unsigned int pitch;
+	int width;
+	int height;
+	int channels;
+	/* the colour as stored in a pixel */
+	BYTE pixel[4];
+};
+
+/* bgra is 0xAARRGGBB, 8 bpp bitmaps get its grey level */
+int rfi_canvas_init(struct rfi_canvas *c, FIBITMAP *dib, unsigned int bgra);
+void rfi_canvas_color(struct rfi_canvas *c, unsigned int bgra);
+
+/* pixels x1..x2 of row y */
+void rfi_fill_span(const struct rfi_canvas *c, int y, int x1, int x2);
+
+/* the rectangle with corners (x1, y1) and (x2, y2), inclusive */
+void rfi_fill_rect(const struct rfi_canvas *c, int x1, int y1, int x2, int y2);
+
+/*
+ * Pixels strictly inside all four edges of the quadrangle xy[0..7], in
+ * either winding.
+ */
+void rfi_fill_quad(const struct rfi_canvas *c, const int *xy);
+
+/* disc of radius r around (x, y), pixels with dx^2 + dy^2 <= r^2 */
+void rfi_fill_disc(const struct rfi_canvas *c, int x, int y, int r);
+
+/*
+ * Line from (x0, y0) to (x1, y1). A width of 0 or 1 is one pixel wide
+ * and 8-connected, wider lines cover the pixels within width / 2 of the
+ * segment. Anti-aliased lines blend their edge pixels by coverage.
+ */
+void rfi_draw_line(const struct rfi_canvas *c, int x0, int y0, int x1, int y1,
+		int width, int antialias);
+
+/* rectangle outline, bars 2 * (width / 2) + 1 wide centred on the edges */
+void rfi_draw_rect(const struct rfi_canvas *c, int x1, int y1, int x2, int y2, int width);
+
+/*
+ * Batches of packed records. Rectangles and lines are (x1, y1, x2, y2,
+ * colour, width), points are (x, y, colour, size). tile_sort draws the
+ * rectangles grouped by the 64x64 tile of their top left corner, which
+ * changes the stacking order of overlapping ones.
+ */
+#define RFI_RECT_FIELDS 6
+#define RFI_LINE_FIELDS 6
+#define RFI_POINT_FIELDS 4
+int rfi_draw_rects(struct rfi_canvas *c, const int32_t *rec, long n, int tile_sort);
+void rfi_draw_lines(struct rfi_canvas *c, const int32_t *rec, long n, int antialias);
+void rfi_draw_points(struct rfi_canvas *c, const int32_t *rec, long n);
+
+#endif
@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#ifdef HAVE_JPEGLIB_H
+#include <jpeglib.h>
+#endif
+#include "rfi_alloc.h"
+#include "rfi_encode.h"
+#ifdef HAVE_JPEGLIB_H
+#include "rfi_jpeg.h"
+#endif
+
+/* an encode at some quality, kept while it is the best that fits */
+struct rfi_fit {
+	BYTE *data;
+	size_t size;
+	int quality;
+};
+
+typedef int (*rfi_encode_fn)(void *ctx, int quality, BYTE **out, size_t *size);
+
+static int rfi_search_quality(rfi_encode_fn encode, void *ctx, size_t max_bytes,
+		BYTE **out, size_t *size, int *quality)
+{
+	struct rfi_fit best = { NULL, 0, 0 };
+	BYTE *data;
+	size_t n;
+	int lo = 1, hi = 100, q;
+
+	while (lo <= hi) {
+		q = (lo + hi) / 2;
+		if (encode(ctx, q, &data, &n) < 0) {
+			free(best.data);
+			return -1;
+		}
+		if (n <= max_bytes) {
+			free(best.data);
+			best.data = data;
+			best.size = n;
+			best.quality = q;
+			lo = q + 1;
+		} else {
+			free(data);
+			hi = q - 1;
+		}
+	}
+	if (!best.data)
+		return 1;
+	*out = best.data;
+	*size = best.size;
+	*quality = best.quality;
+	return 0;
+}
+
+struct rfi_fi_encode {
+	FREE_IMAGE_FORMAT fif;
+	FIBITMAP *dib;
+	int flags;
+};
+
+/* any format FreeImage takes a quality in the low flag bits for */
+static int rfi_fi_encode(void *ctx, int quality, BYTE **out, size_t *size)
+{
+	struct rfi_fi_encode *e = ctx;
+	FIMEMORY *hmem;
+	BYTE *raw = NULL;
+	DWORD n = 0;
+	int ret = -1;
+
+	hmem = FreeImage_OpenMemory(0, 0);
+	if (!hmem)
+		return -1;
+	if (FreeImage_SaveToMemory(e->fif, e->dib, hmem, e->flags | quality)
+			&& FreeImage_AcquireMemory(hmem, &raw, &n) && (*out = malloc(n ? n : 1))) {
+		memcpy(*out, raw, n);
+		*size = n;
+		ret = 0;
+	}
+	FreeImage_CloseMemory(hmem);
+	return ret;
+}
+
+#ifdef HAVE_JPEGLIB_H
+
+/* Y, Cb and Cr (or just Y) padded to whole MCUs, Cb and Cr subsampled */
+struct rfi_planes {
+	int width;
+	int height;
+	int ncomp;
+	int h[3];
+	int v[3];
+	/* plane c is rows[c] x stride[c] */
+	int stride[3];
+	int rows[3];
+	BYTE *plane[3];
+	unsigned int dpi_x;
+	unsigned int dpi_y;
+	int flags;
+};
+
+static void rfi_planes_free(struct rfi_planes *p)
+{
+	int c;
+	for (c = 0; c < 3; c++)
+		free(p->plane[c]);
+}
+
+/* the sampling factors FreeImage's JPEG plugin uses for flags */
+static void rfi_sampling(int flags, int *h, int *v)
+{
+	if (flags & JPEG_SUBSAMPLING_444) {
+		*h = 1; *v = 1;
+	} else if (flags & JPEG_SUBSAMPLING_422) {
+		*h = 2; *v = 1;
+	} else if (flags & JPEG_SUBSAMPLING_411) {
+		*h = 4; *v = 1;
+	} else {
+		*h = 2; *v = 2;
+	}
+}
+
+/*
+ * Colour convert with libjpeg's fixed point RGB to YCbCr, then average
+ * each h x v block of Cb and Cr. Edge pixels are repeated into the
+ * padding. dib is 8 bpp greyscale, 24 or 32 bpp.
+ */
+static int rfi_planes_init(struct rfi_planes *p, FIBITMAP *dib, int flags)
+{
+	unsigned int w = FreeImage_GetWidth(dib), h = FreeImage_GetHeight(dib);
+	int bytespp = FreeImage_GetBPP(dib) / 8;
+	int pw, ph, hs, vs, x, y, i, j, sx, sy, r, g, b, sum, c;
+	BYTE *cb = NULL, *cr = NULL, *yp, *bp, *rp;
+	const BYTE *line, *px;
+
+	memset(p, 0, sizeof(*p));
+	p->width = w;
+	p->height = h;
+	p->flags = flags;
+	p->dpi_x = (unsigned int)(FreeImage_GetDotsPerMeterX(dib) * 0.0254 + 0.5);
+	p->dpi_y = (unsigned int)(FreeImage_GetDotsPerMeterY(dib) * 0.0254 + 0.5);
+	p->ncomp = bytespp == 1 ? 1 : 3;
+	if (p->ncomp == 1) {
+		hs = vs = 1;
+	} else {
+		rfi_sampling(flags, &hs, &vs);
+	}
+	p->h[0] = hs;
+	p->v[0] = vs;
+	p->h[1] = p->v[1] = p->h[2] = p->v[2] = 1;
+	pw = (w + 8 * hs - 1) / (8 * hs) * 8 * hs;
+	ph = (h + 8 * vs - 1) / (8 * vs) * 8 * vs;
+	for (c = 0; c < p->ncomp; c++) {
+		p->stride[c] = pw / (hs / p->h[c]);
+		p->rows[c] = ph / (vs / p->v[c]);
+		p->plane[c] = malloc((size_t)p->stride[c] * p->rows[c]);
+		if (!p->plane[c])
+			goto fail;
+	}
+	if (p->ncomp == 3) {
+		cb = malloc((size_t)pw * ph);
+		cr = malloc((size_t)pw * ph);
+		if (!cb || !cr)
+			goto fail;
+	}
+
+	for (y = 0; y < ph; y++) {
+		sy = y < (int)h ? y : (int)h - 1;
+		line = FreeImage_GetScanLine(dib, h - 1 - sy);
+		yp = p->plane[0] + (size_t)y * pw;
+		if (p->ncomp == 1) {
+			for (x = 0; x < pw; x++)
+				yp[x] = line[x < (int)w ? x : (int)w - 1];
+			continue;
+		}
+		bp = cb + (size_t)y * pw;
+		rp = cr + (size_t)y * pw;
+		for (x = 0; x < pw; x++) {
+			sx = x < (int)w ? x : (int)w - 1;
+			px = line + sx * bytespp;
+			r = px[FI_RGBA_RED];
+			g = px[FI_RGBA_GREEN];
+			b = px[FI_RGBA_BLUE];
+			yp[x] = (BYTE)((19595 * r + 38470 * g + 7471 * b + 32768) >> 16);
+			bp[x] = (BYTE)((-11059 * r - 21709 * g + 32768 * b + (128 << 16) + 32767) >> 16);
+			rp[x] = (BYTE)((32768 * r - 27439 * g - 5329 * b + (128 << 16) + 32767) >> 16);
+		}
+	}
+
+	if (p->ncomp == 3) {
+		for (c = 1; c < 3; c++) {
+			const BYTE *full = c == 1 ? cb : cr;
+			for (y = 0; y < p->rows[c]; y++) {
+				for (x = 0; x < p->stride[c]; x++) {
+					sum = 0;
+					for (j = 0; j < vs; j++)
+						for (i = 0; i < hs; i++)
+							sum += full[(size_t)(y * vs + j) * pw + x * hs + i];
+					p->plane[c][(size_t)y * p->stride[c] + x] = (BYTE)((sum + hs * vs / 2) / (hs * vs));
+				}
+			}
+		}
+		free(cb);
+		free(cr);
+	}
+	return 0;
+fail:
+	free(cb);
+	free(cr);
+	rfi_planes_free(p);
+	return -1;
+}
+
+/* one attempt over the planes in raw data mode, no conversion again */
+static int rfi_jpeg_encode_planes(void *ctx, int quality, BYTE **out, size_t *size)
+{
+	struct rfi_planes *p = ctx;
+	struct jpeg_compress_struct cinfo;
+	struct rfi_jpeg_error jerr;
+	unsigned char *buf = NULL;
+	unsigned long n = 0;
+	JSAMPROW rows[3][4 * DCTSIZE];
+	JSAMPARRAY planes[3];
+	JDIMENSION y;
+	int c, i, lines;
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = rfi_jpeg_error_exit;
+	if (setjmp(jerr.jb)) {
+		jpeg_destroy_compress(&cinfo);
+		free(buf);
+		return -1;
+	}
+
+	jpeg_create_compress(&cinfo);
+	jpeg_mem_dest(&cinfo, &buf, &n);
+	cinfo.image_width = p->width;
+	cinfo.image_height = p->height;
+	cinfo.input_components = p->ncomp;
+	cinfo.in_color_space = p->ncomp == 1 ? JCS_GRAYSCALE : JCS_YCbCr;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, quality, TRUE);
+	for (c = 0; c < p->ncomp; c++) {
+		cinfo.comp_info[c].h_samp_factor = p->h[c];
+		cinfo.comp_info[c].v_samp_factor = p->v[c];
+	}
+	cinfo.raw_data_in = TRUE;
+#if JPEG_LIB_VERSION >= 70
+	cinfo.do_fancy_downsampling = FALSE;
+#endif
+	if (p->dpi_x && p->dpi_y) {
+		cinfo.density_unit = 1;
+		cinfo.X_density = p->dpi_x > 0xFFFF ? 0xFFFF : p->dpi_x;
+		cinfo.Y_density = p->dpi_y > 0xFFFF ? 0xFFFF : p->dpi_y;
+	}
+	if (p->flags & JPEG_OPTIMIZE)
+		cinfo.optimize_coding = TRUE;
+	if (p->flags & JPEG_PROGRESSIVE)
+		jpeg_simple_progression(&cinfo);
+	jpeg_start_compress(&cinfo, TRUE);
+
+	lines = p->v[0] * DCTSIZE;
+	for (c = 0; c < p->ncomp; c++)
+		planes[c] = rows[c];
+	for (y = 0; cinfo.next_scanline < cinfo.image_height; y += lines) {
+		for (c = 0; c < p->ncomp; c++)
+			for (i = 0; i < p->v[c] * DCTSIZE; i++)
+				rows[c][i] = p->plane[c] + (size_t)(y / p->v[0] * p->v[c] + i) * p->stride[c];
+		jpeg_write_raw_data(&cinfo, planes, lines);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	*out = buf;
+	*size = n;
+	return 0;
+}
+
+static int rfi_jpeg_fit(FIBITMAP *dib, int flags, size_t max_bytes,
+		BYTE **out, size_t *size, int *quality)
+{
+	struct rfi_planes p;
+	FIBITMAP *src = dib;
+	unsigned int bpp = FreeImage_GetBPP(dib);
+	int ret;
+
+	if (FreeImage_GetImageType(dib) != FIT_BITMAP)
+		return -1;
+	if (!(bpp == 24 || bpp == 32 || (bpp == 8 && FreeImage_GetColorType(dib) == FIC_MINISBLACK))) {
+		src = FreeImage_ConvertTo24Bits(dib);
+		if (!src)
+			return -1;
+	}
+	ret = rfi_planes_init(&p, src, flags);
+	if (src != dib)
+		rfi_bitmap_unload(src);
+	if (ret < 0)
+		return -1;
+	ret = rfi_search_quality(rfi_jpeg_encode_planes, &p, max_bytes, out, size, quality);
+	rfi_planes_free(&p);
+	return ret;
+}
+
+#endif
+
+int rfi_encode_fit(FREE_IMAGE_FORMAT fif, FIBITMAP *dib, int flags, size_t max_bytes,
+		BYTE **out, size_t *size, int *quality)
+{
+	struct rfi_fi_encode e;
+	int ret;
+
+#ifdef HAVE_JPEGLIB_H
+	if (fif == FIF_JPEG)
+		return rfi_jpeg_fit(dib, flags, max_bytes, out, size, quality);
+#endif
+	e.fif = fif;
+	e.dib = dib;
+	e.flags = flags;
+	/* as Image#to_blob saves a JPEG */
+	if (fif == FIF_JPEG && FreeImage_GetBPP(dib) != 8 && FreeImage_GetBPP(dib) != 24) {
+		e.dib = FreeImage_ConvertTo24Bits(dib);
+		if (!e.dib)
+			return -1;
+		e.flags |= JPEG_BASELINE;
+	}
+	ret = rfi_search_quality(rfi_fi_encode, &e, max_bytes, out, size, quality);
+	if (e.dib != dib)
+		rfi_bitmap_unload(e.dib);
+	return ret;
+}
@@ -0,0 +1,19 @@
+#ifndef RFI_ENCODE_H
+#define RFI_ENCODE_H
+
+#include <stddef.h>
+#include <FreeImage.h>
+
+/*
+ * Encode dib as a JPEG or WebP of at most max_bytes, at the highest
+ * quality (1..100) that fits, found by binary search. flags are the other
+ * save flags, as FreeImage takes them. JPEGs are colour converted and
+ * subsampled once, each attempt then only quantises and entropy codes
+ * the planes, with no metadata markers; their sizes only compare with
+ * each other, not with FreeImage's JPEG encodes. Returns 0 with *out (to free), *size and *quality set, 1 if
+ * even quality 1 is too large, -1 if encoding failed.
+ */
+int rfi_encode_fit(FREE_IMAGE_FORMAT fif, FIBITMAP *dib, int flags, size_t max_bytes,
+		BYTE **out, size_t *size, int *quality);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef RFI_JPEG_H
+#define RFI_JPEG_H
+
+#include <stdio.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+
+/*
+ * libjpeg error manager of the decoders and encoders: fatal errors
+ * longjmp to jb, set up by the caller before any libjpeg call.
+ */
+struct rfi_jpeg_error {
+	struct jpeg_error_mgr pub;
+	jmp_buf jb;
+};
+
+__attribute__((noreturn)) void rfi_jpeg_error_exit(j_common_ptr cinfo);
+
+#endif
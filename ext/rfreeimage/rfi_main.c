@@ -1,10 +1,35 @@
+#include <errno.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
 #include <ruby.h>
+#include <ruby/io.h>
+#ifdef HAVE_RUBY_THREAD_H
+#include <ruby/thread.h>
+#endif
+#ifdef HAVE_RUBY_MEMORY_VIEW_H
+#include <ruby/memory_view.h>
+#endif
+#ifdef HAVE_RUBY_IO_BUFFER_H
+#include <ruby/io/buffer.h>
+#endif
 #include <FreeImage.h>
+#include "rfi_alloc.h"
+#include "rfi_pool.h"
+#include "rfi_probe.h"
+#include "rfi_decode.h"
+#include "rfi_draw.h"
+#include "rfi_encode.h"
+#include "rfi_resize.h"
 
 static VALUE rb_mFI;
 //static VALUE rb_eFI;
 static VALUE Class_Image;
 static VALUE Class_RFIError;
+static VALUE Class_Job;
 
 __attribute__((constructor))
 static void __rfi_module_init() {
@@ -25,24 +50,6 @@ static void try_sort(int *x, int *y)
 	}
 }
 
-static int min_of_arrary(int x1, int x2, int x3, int x4)
-{
-	int m = x1;
-	if(x2 < m) m = x2;
-	if(x3 < m) m = x3;
-	if(x4 < m) m = x4;
-	return m;
-}
-
-static int max_of_arrary(int x1, int x2, int x3, int x4)
-{
-	int m = x1;
-	if(x2 > m) m = x2;
-	if(x3 > m) m = x3;
-	if(x4 > m) m = x4;
-	return m;
-}
-
 static VALUE rb_rfi_version(VALUE self)
 {
 	return rb_ary_new3(3, INT2NUM(FREEIMAGE_MAJOR_VERSION),
@@ -57,6 +64,15 @@ static VALUE rb_rfi_string_version(VALUE self)
 	return result;
 }
 
+/*
+ * Count of the crop views sharing an image's pixels. The image and each
+ * view hold a reference, as GC may free them in any order.
+ */
+struct rfi_crops {
+	long refs;
+	long views;
+};
+
 struct native_image {
 	int w;
 	int h;
@@ -64,86 +80,178 @@ struct native_image {
 	int stride;
 	FREE_IMAGE_FORMAT fif;
 	FIBITMAP *handle;
+	/* number of threads working on handle without the GVL */
+	int busy;
+	/* memory views of handle's pixels still held */
+	int views;
+	/* IO::Buffer over handle's pixels, freed along with them */
+	VALUE io_buffer;
+	/*
+	 * frozen String holding the pixels handle wraps, or for a crop view
+	 * the Image it shares them with; nil if it owns them
+	 */
+	VALUE source;
+	/* the wrapped rows are top-down, so handle is upside down */
+	int top_down;
+	/* pixel bytes of handle reported to the GC, 0 for wrapped ones */
+	size_t mem;
+	/* crop views of handle's pixels, NULL before the first */
+	struct rfi_crops *crops;
+	/* for a crop view, the crops of source */
+	struct rfi_crops *parent_crops;
 };
 
-static void dd_line(struct native_image* img, int x0, int y0,
-		int x1,int y1,
-		unsigned int bgra, int size)
+/* pixels held by live images, across the process */
+static struct {
+	size_t bytes;
+	size_t peak_bytes;
+	long images;
+} rfi_live;
+
+/*
+ * Tell the GC about pixels handle owns, so big bitmaps count towards
+ * its malloc limit like strings do. Called with the GVL.
+ */
+static void rfi_account(struct native_image *img)
 {
-	float x, dx, dy, y, k, deta, threshold=0.0001;
-	int hs = size / 2, i;
+	img->mem = NIL_P(img->source) && FreeImage_HasPixels(img->handle) ?
+		(size_t)FreeImage_GetPitch(img->handle) * FreeImage_GetHeight(img->handle) : 0;
+	rfi_live.images++;
+	rfi_live.bytes += img->mem;
+	if (rfi_live.bytes > rfi_live.peak_bytes)
+		rfi_live.peak_bytes = rfi_live.bytes;
+	if (img->mem)
+		rb_gc_adjust_memory_usage((ssize_t)img->mem);
+}
 
-	dx = x1-x0;
-	dy = y1-y0;
+/* unload handle, if any */
+static void rfi_unload(struct native_image *img)
+{
+	if (!img->handle)
+		return;
+	rfi_bitmap_unload(img->handle);
+	img->handle = NULL;
+	rfi_live.images--;
+	rfi_live.bytes -= img->mem;
+	if (img->mem)
+		rb_gc_adjust_memory_usage(-(ssize_t)img->mem);
+	img->mem = 0;
+}
 
-	if(dx < threshold && dx > -threshold){
-		k = 0.0;
-	}
-	else
-	{
-		k=dy * 1.0 / dx;
-	}
+static void rfi_crops_put(struct rfi_crops *crops)
+{
+	if (crops && --crops->refs == 0)
+		free(crops);
+}
 
-	if(dx > threshold)
-	{
-		deta = k > 1 ? 1.0 / k : 1;
-		for(i = -hs; i <= hs; i++) {
-			y = y0;
-			for (x = x0; x <= x1; x += deta){
-				FreeImage_SetPixelColor(img->handle, x + i, img->h - (y + i) - 1 , (RGBQUAD*)&bgra);
-				y = y + k * deta;
-			}
-		}
-	}
-	else if(dx < -threshold)
-	{
-		deta = k > 1 ? 1.0 / k : 1;
-		for(i = -hs; i <= hs; i++) {
-			y = y0;
-			for (x = x0; x >= x1; x -= deta){
-				FreeImage_SetPixelColor(img->handle, x + i, img->h - (y + i) - 1, (RGBQUAD*)&bgra);
-				y = y - k * deta;
-			}
-		}
-	}
-	else
-	{
-		if(dy >= 0)
-		{
-			for(i = -hs; i <= hs; i++) {
-				for (y = y0; y <= y1; y++){
-					FreeImage_SetPixelColor(img->handle, x0 + i, img->h - (y + i) - 1, (RGBQUAD*)&bgra);
-				}
-			}
-		}
-		else
-		{
-			for(i = -hs; i <= hs; i++) {
-				for (y = y0; y >= y1; y--){
-					FreeImage_SetPixelColor(img->handle, x0 + i, img->h - (y + i) - 1, (RGBQUAD*)&bgra);
-				}
-			}
-		}
-	}
+/* a crop view lets go of its parent's pixels */
+static void rfi_uncrop(struct native_image *img)
+{
+	if (!img->parent_crops)
+		return;
+	img->parent_crops->views--;
+	rfi_crops_put(img->parent_crops);
+	img->parent_crops = NULL;
 }
 
-static void Image_free(struct native_image* img)
+static void Image_free(void *ptr)
 {
+	struct native_image* img = ptr;
 	if(!img)
 		return;
-	if(img->handle)
-		FreeImage_Unload(img->handle);
+	rfi_unload(img);
+	rfi_uncrop(img);
+	rfi_crops_put(img->crops);
 	free(img);
 }
 
+static void Image_mark(void *ptr)
+{
+	struct native_image* img = ptr;
+	rb_gc_mark(img->io_buffer);
+	/* rb_gc_mark pins it, compaction must not move the wrapped bytes */
+	rb_gc_mark(img->source);
+}
+
+static size_t Image_memsize(const void *ptr)
+{
+	const struct native_image* img = ptr;
+	return sizeof(*img) + img->mem;
+}
+
+static const rb_data_type_t rfi_image_type = {
+	"RFreeImage::Image",
+	{ Image_mark, Image_free, Image_memsize, },
+	0, 0, RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
 static VALUE Image_alloc(VALUE self)
 {
 	/* allocate */
 	struct native_image* img = malloc(sizeof(struct native_image));
 	memset(img, 0, sizeof(struct native_image));
+	img->io_buffer = Qnil;
+	img->source = Qnil;
 
 	/* wrap */
-	return Data_Wrap_Struct(self, NULL, Image_free, img);
+	return TypedData_Wrap_Struct(self, &rfi_image_type, img);
+}
+
+/* pixels held by live images: live_bytes, peak_bytes and live_images */
+static VALUE rb_rfi_memory_stats(VALUE self)
+{
+	VALUE h = rb_hash_new();
+	rb_hash_aset(h, ID2SYM(rb_intern("live_bytes")), SIZET2NUM(rfi_live.bytes));
+	rb_hash_aset(h, ID2SYM(rb_intern("peak_bytes")), SIZET2NUM(rfi_live.peak_bytes));
+	rb_hash_aset(h, ID2SYM(rb_intern("live_images")), LONG2NUM(rfi_live.images));
+	return h;
+}
+
+static VALUE rb_rfi_buffer_pool_stats(VALUE self)
+{
+	struct rfi_alloc_stats st;
+	VALUE h = rb_hash_new();
+	rfi_alloc_get_stats(&st);
+	rb_hash_aset(h, ID2SYM(rb_intern("hits")), ULONG2NUM(st.hits));
+	rb_hash_aset(h, ID2SYM(rb_intern("misses")), ULONG2NUM(st.misses));
+	rb_hash_aset(h, ID2SYM(rb_intern("cached_bytes")), SIZET2NUM(st.cached_bytes));
+	rb_hash_aset(h, ID2SYM(rb_intern("cached_blocks")), SIZET2NUM(st.cached_blocks));
+	rb_hash_aset(h, ID2SYM(rb_intern("limit")), SIZET2NUM(st.limit));
+	return h;
+}
+
+static VALUE rb_rfi_set_buffer_pool_limit(VALUE self, VALUE limit)
+{
+	long l = NUM2LONG(limit);
+	if (l < 0)
+		rb_raise(rb_eArgError, "negative limit");
+	rfi_alloc_set_limit((size_t)l);
+	return limit;
+}
+
+static VALUE rb_rfi_buffer_pool_trim(VALUE self)
+{
+	rfi_alloc_trim();
+	return Qnil;
+}
+
+/* decode files through rfi_load_mapped, off by default */
+static int rfi_mmap_loads;
+
+/*
+ * A file truncated while it is mapped (rotated away, still being
+ * written) raises SIGBUS in the decoder, which kills the process instead
+ * of raising IOError. Only turn this on for files nothing else writes.
+ */
+static VALUE rb_rfi_set_mmap_loads(VALUE self, VALUE on)
+{
+	rfi_mmap_loads = RTEST(on);
+	return on;
+}
+
+static VALUE rb_rfi_mmap_loads(VALUE self)
+{
+	return rfi_mmap_loads ? Qtrue : Qfalse;
 }
 
 static inline char *rfi_value_to_str(VALUE v)
@@ -158,6 +266,17 @@ static inline char *rfi_value_to_str(VALUE v)
 	return filename;
 }
 
+/* img must not have a handle, set source first for wrapped pixels */
+static void rfi_set_handle(struct native_image *img, FIBITMAP *h)
+{
+	img->handle = h;
+	img->w = FreeImage_GetWidth(h);
+	img->h = FreeImage_GetHeight(h);
+	img->bpp = FreeImage_GetBPP(h);
+	img->stride = FreeImage_GetPitch(h);
+	rfi_account(img);
+}
+
 static FIBITMAP *
 convert_bpp(FIBITMAP *orig, unsigned int bpp) {
 	FIBITMAP *h = NULL;
@@ -165,6 +284,9 @@ convert_bpp(FIBITMAP *orig, unsigned int bpp) {
 		case 8:
 			h = FreeImage_ConvertToGreyscale(orig);
 			break;
+		case 24:
+			h = FreeImage_ConvertTo24Bits(orig);
+			break;
 		case 32:
 			h = FreeImage_ConvertTo32Bits(orig);
 			break;
@@ -172,99 +294,509 @@ convert_bpp(FIBITMAP *orig, unsigned int bpp) {
 	return h;
 }
 
+enum rfi_error {
+	RFI_OK = 0,
+	RFI_ERR_FORMAT,
+	RFI_ERR_LOAD,
+	RFI_ERR_BPP,
+	RFI_ERR_REGION,
+};
+
+struct rfi_load_args {
+	/* either a file name, an in-memory blob or a FreeImageIO stream */
+	const char *filename;
+	BYTE *data;
+	long size;
+	FreeImageIO *io;
+	fi_handle handle;
+	unsigned int bpp;
+	BOOL ping;
+	int max_size_hint;
+	/* with scale > 0 only region (left, top, right, bottom) at 1/scale */
+	int region[4];
+	int scale;
+	/*
+	 * with defer_orientation, bitmaps from rfi_decode are as stored and
+	 * orientation is their Exif tag, for the caller to apply
+	 */
+	BOOL defer_orientation;
+	int orientation;
+
+	FIBITMAP *result;
+	FREE_IMAGE_FORMAT fif;
+	enum rfi_error err;
+};
+
+struct rfi_nogvl_call {
+	void *(*fn)(void *);
+	void *data;
+};
+
+static VALUE rfi_nogvl_body(VALUE arg)
+{
+	struct rfi_nogvl_call *call = (struct rfi_nogvl_call *)arg;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+	rb_thread_call_without_gvl(call->fn, call->data, RUBY_UBF_IO, NULL);
+#else
+	call->fn(call->data);
+#endif
+	return Qnil;
+}
+
+/*
+ * Run fn(data) with the GVL released, fn must not touch any ruby object.
+ * Returns non-zero if the thread got interrupted (Thread#raise, kill...)
+ * after fn finished; the caller must then release fn's results and
+ * rb_jump_tag() the returned state.
+ */
+static int rfi_nogvl(void *(*fn)(void *), void *data)
+{
+	struct rfi_nogvl_call call;
+	int state = 0;
+
+	call.fn = fn;
+	call.data = data;
+	rb_protect(rfi_nogvl_body, (VALUE)&call, &state);
+	return state;
+}
+
+/*
+ * FreeImageIO over a Ruby IO, for read_io and write_io. The codec runs
+ * without the GVL, each refill or flush takes it back for one read or
+ * write of RFI_STREAM_CHUNK bytes. Reads keep up to RFI_STREAM_KEEP
+ * bytes behind the position, so loaders can seek back over headers on
+ * pipes and sockets too.
+ */
+#define RFI_STREAM_CHUNK (64 << 10)
+#define RFI_STREAM_KEEP (256 << 10)
+
+struct rfi_stream {
+	VALUE io;
+	/* stream offset of data[0], and the position */
+	long base;
+	long pos;
+	BYTE *data;
+	size_t len;
+	size_t cap;
+	int eof;
+	/* of a failed IO call, for rb_jump_tag once the codec returned */
+	int state;
+};
+
+struct rfi_stream_call {
+	VALUE (*fn)(VALUE);
+	struct rfi_stream *st;
+};
+
+static void *rfi_stream_call_body(void *ptr)
+{
+	struct rfi_stream_call *call = ptr;
+	rb_protect(call->fn, (VALUE)call->st, &call->st->state);
+	return NULL;
+}
+
+/* fn(st) with the GVL, -1 once any IO call has raised */
+static int rfi_stream_with_gvl(VALUE (*fn)(VALUE), struct rfi_stream *st)
+{
+	struct rfi_stream_call call;
+
+	if (st->state)
+		return -1;
+	call.fn = fn;
+	call.st = st;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+	rb_thread_call_with_gvl(rfi_stream_call_body, &call);
+#else
+	rfi_stream_call_body(&call);
+#endif
+	return st->state ? -1 : 0;
+}
+
+static VALUE rfi_stream_refill(VALUE arg)
+{
+	struct rfi_stream *st = (struct rfi_stream *)arg;
+	VALUE str = rb_funcall(st->io, rb_intern("read"), 1, INT2FIX(RFI_STREAM_CHUNK));
+	size_t drop, n;
+	BYTE *data;
+
+	if (NIL_P(str) || !RSTRING_LEN(StringValue(str))) {
+		st->eof = 1;
+		return Qnil;
+	}
+	n = RSTRING_LEN(str);
+	/* forget what is too far behind */
+	if (st->pos - st->base > RFI_STREAM_KEEP) {
+		drop = st->pos - st->base - RFI_STREAM_KEEP;
+		memmove(st->data, st->data + drop, st->len - drop);
+		st->base += drop;
+		st->len -= drop;
+	}
+	if (st->len + n > st->cap) {
+		data = realloc(st->data, st->len + n);
+		if (!data)
+			rb_memerror();
+		st->data = data;
+		st->cap = st->len + n;
+	}
+	memcpy(st->data + st->len, RSTRING_PTR(str), n);
+	st->len += n;
+	return Qnil;
+}
+
+static VALUE rfi_stream_rewind(VALUE arg)
+{
+	struct rfi_stream *st = (struct rfi_stream *)arg;
+	rb_funcall(st->io, rb_intern("seek"), 1, LONG2NUM(st->pos));
+	st->base = st->pos;
+	st->len = 0;
+	st->eof = 0;
+	return Qnil;
+}
+
+static unsigned DLL_CALLCONV rfi_stream_read(void *buffer, unsigned size, unsigned count, fi_handle handle)
+{
+	struct rfi_stream *st = handle;
+	size_t want = (size_t)size * count, n;
+
+	if (!want)
+		return 0;
+	while ((size_t)(st->base + st->len - st->pos) < want && !st->eof)
+		if (rfi_stream_with_gvl(rfi_stream_refill, st) < 0)
+			return 0;
+	n = st->base + st->len - st->pos;
+	if (n > want)
+		n = want;
+	memcpy(buffer, st->data + (st->pos - st->base), n);
+	st->pos += n;
+	return n / size;
+}
+
+static int DLL_CALLCONV rfi_stream_seek(fi_handle handle, long offset, int origin)
+{
+	struct rfi_stream *st = handle;
+	long target;
+
+	if (origin == SEEK_END) {
+		while (!st->eof)
+			if (rfi_stream_with_gvl(rfi_stream_refill, st) < 0)
+				return -1;
+		target = st->base + st->len + offset;
+	} else {
+		target = origin == SEEK_CUR ? st->pos + offset : offset;
+	}
+	if (target < 0)
+		return -1;
+	/* past what was kept, only seekable IOs can go back */
+	if (target < st->base) {
+		st->pos = target;
+		return rfi_stream_with_gvl(rfi_stream_rewind, st);
+	}
+	while (target > st->base + (long)st->len && !st->eof)
+		if (rfi_stream_with_gvl(rfi_stream_refill, st) < 0)
+			return -1;
+	st->pos = target > st->base + (long)st->len ? st->base + (long)st->len : target;
+	return 0;
+}
+
+static long DLL_CALLCONV rfi_stream_tell(fi_handle handle)
+{
+	return ((struct rfi_stream *)handle)->pos;
+}
+
+static VALUE rfi_stream_flush_body(VALUE arg)
+{
+	struct rfi_stream *st = (struct rfi_stream *)arg;
+	rb_io_write(st->io, rb_str_new((const char *)st->data, st->len));
+	st->base += st->len;
+	st->len = 0;
+	return Qnil;
+}
+
+static int rfi_stream_flush(struct rfi_stream *st)
+{
+	if (!st->len)
+		return 0;
+	return rfi_stream_with_gvl(rfi_stream_flush_body, st);
+}
+
+static unsigned DLL_CALLCONV rfi_stream_write(void *buffer, unsigned size, unsigned count, fi_handle handle)
+{
+	struct rfi_stream *st = handle;
+	size_t n = (size_t)size * count, c;
+	const BYTE *p = buffer;
+
+	while (n) {
+		if (st->len == st->cap && rfi_stream_flush(st) < 0)
+			return 0;
+		c = st->cap - st->len < n ? st->cap - st->len : n;
+		memcpy(st->data + st->len, p, c);
+		st->len += c;
+		st->pos += c;
+		p += c;
+		n -= c;
+	}
+	return count;
+}
+
+/* encoders only seek to where they are, or back on seekable IOs */
+static int DLL_CALLCONV rfi_stream_write_seek(fi_handle handle, long offset, int origin)
+{
+	struct rfi_stream *st = handle;
+	long target = origin == SEEK_CUR ? st->pos + offset : offset;
+
+	if (origin == SEEK_END)
+		return -1;
+	if (target == st->pos)
+		return 0;
+	if (rfi_stream_flush(st) < 0)
+		return -1;
+	st->pos = target;
+	if (rfi_stream_with_gvl(rfi_stream_rewind, st) < 0)
+		return -1;
+	return 0;
+}
+
+static FreeImageIO rfi_stream_read_io = {
+	rfi_stream_read, NULL, rfi_stream_seek, rfi_stream_tell,
+};
+
+static FreeImageIO rfi_stream_write_io = {
+	NULL, rfi_stream_write, rfi_stream_write_seek, rfi_stream_tell,
+};
+
+static void *rfi_load_nogvl(void *ptr);
+
+#ifdef HAVE_SYS_MMAN_H
+/*
+ * Decode a file as a blob over a read-only mapping of it, which saves
+ * stdio's reads and copies. The mapping is gone when this returns. 1 if
+ * the file can't be mapped (empty, not a regular file, ...), for the
+ * caller to read it instead. See rb_rfi_set_mmap_loads for the catch.
+ */
+static int rfi_load_mapped(struct rfi_load_args *args)
+{
+	const char *filename = args->filename;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return 1;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0
+			|| (unsigned long long)st.st_size > LONG_MAX) {
+		close(fd);
+		return 1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 1;
+#ifdef HAVE_MADVISE
+	/* a ping only looks at the headers */
+	if (!args->ping)
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif
+
+	args->filename = NULL;
+	args->data = map;
+	args->size = st.st_size;
+	rfi_load_nogvl(args);
+	/* errors still name a file */
+	args->filename = filename;
+	args->data = NULL;
+	args->size = 0;
+	munmap(map, st.st_size);
+	return 0;
+}
+#endif
+
+static void *rfi_load_nogvl(void *ptr)
+{
+	struct rfi_load_args *args = ptr;
+	FIBITMAP *orig, *tmp;
+	FIMEMORY *fmh = NULL;
+	enum rfi_decode_status status = RFI_DECODE_UNSUPPORTED;
+	int flags = 0, *rc = args->region, s = args->scale;
+
+#ifdef HAVE_SYS_MMAN_H
+	if (rfi_mmap_loads && args->filename && !args->io && !rfi_load_mapped(args))
+		return NULL;
+#endif
+	if (args->io) {
+		args->fif = FreeImage_GetFileTypeFromHandle(args->io, args->handle, 0);
+	} else if (args->filename) {
+		args->fif = FreeImage_GetFileType(args->filename, 0);
+	} else {
+		fmh = FreeImage_OpenMemory(args->data, args->size);
+		args->fif = FreeImage_GetFileTypeFromMemory(fmh, 0);
+	}
+	if (args->fif == FIF_UNKNOWN) {
+		args->err = RFI_ERR_FORMAT;
+		goto out;
+	}
+
+	/* streams are left to FreeImage's loaders */
+	if (s && !args->io)
+		status = rfi_decode_region(args->fif, args->filename, args->data, args->size,
+				args->bpp, rc, s, &args->result);
+	else if (!args->ping && !args->io)
+		status = rfi_decode(args->fif, args->filename, args->data, args->size,
+				args->bpp, args->max_size_hint,
+				args->defer_orientation ? &args->orientation : NULL, &args->result);
+	switch (status) {
+		case RFI_DECODE_OK:
+			goto out;
+		case RFI_DECODE_FAIL:
+			args->err = RFI_ERR_LOAD;
+			goto out;
+		case RFI_DECODE_RANGE:
+			args->err = RFI_ERR_REGION;
+			goto out;
+		case RFI_DECODE_UNSUPPORTED:
+			break;
+	}
+
+	if (args->ping) flags |= FIF_LOAD_NOPIXELS;
+	if (!args->ping) flags |= args->max_size_hint << 16;
+	// use JPEG_ACCURATE to keep sync with opencv
+	if (args->fif == FIF_JPEG)
+		flags |= JPEG_EXIFROTATE | JPEG_ACCURATE;
+	if (args->io)
+		orig = FreeImage_LoadFromHandle(args->fif, args->io, args->handle, flags);
+	else if (fmh)
+		orig = FreeImage_LoadFromMemory(args->fif, fmh, flags);
+	else
+		orig = FreeImage_Load(args->fif, args->filename, flags);
+	if (!orig) {
+		args->err = RFI_ERR_LOAD;
+		goto out;
+	}
+
+	if (args->ping) {
+		args->result = orig;
+	} else {
+		args->result = convert_bpp(orig, args->bpp);
+		rfi_bitmap_unload(orig);
+		if (!args->result) args->err = RFI_ERR_BPP;
+	}
+
+	/* other formats are decoded whole, then cut and shrunk */
+	if (s && args->result) {
+		tmp = args->result;
+		args->result = NULL;
+		if (rc[0] < 0 || rc[1] < 0 || rc[2] <= rc[0] || rc[3] <= rc[1]
+				|| rc[2] > (int)FreeImage_GetWidth(tmp) || rc[3] > (int)FreeImage_GetHeight(tmp)) {
+			args->err = RFI_ERR_REGION;
+		} else {
+			orig = FreeImage_Copy(tmp, rc[0], rc[1], rc[2], rc[3]);
+			if (orig && s > 1) {
+				args->result = rfi_area_resize(orig,
+						(rc[2] - rc[0] + s - 1) / s, (rc[3] - rc[1] + s - 1) / s);
+				rfi_bitmap_unload(orig);
+			} else {
+				args->result = orig;
+			}
+			if (!args->result)
+				args->err = RFI_ERR_LOAD;
+		}
+		rfi_bitmap_unload(tmp);
+	}
+out:
+	if (fmh)
+		FreeImage_CloseMemory(fmh);
+	return NULL;
+}
+
+/* the exception for a failed load, Qnil if it succeeded */
+static VALUE rfi_load_error(struct rfi_load_args *args)
+{
+	switch (args->err) {
+		case RFI_ERR_FORMAT:
+			return rb_exc_new_cstr(rb_eIOError,
+					args->data ? "Invalid image blob" : "Invalid image file");
+		case RFI_ERR_LOAD:
+			return rb_exc_new_cstr(rb_eIOError,
+					args->data ? "Fail to load image from memory" : "Fail to load image file");
+		case RFI_ERR_BPP:
+			return rb_exc_new_cstr(rb_eArgError, "Invalid bpp");
+		case RFI_ERR_REGION:
+			return rb_exc_new_cstr(rb_eArgError, "Invalid boundary");
+		default:
+			return Qnil;
+	}
+}
+
+static void rfi_finish_load(int state, struct rfi_load_args *args, struct native_image *img)
+{
+	VALUE err;
+
+	if (state) {
+		if (args->result)
+			rfi_bitmap_unload(args->result);
+		rb_jump_tag(state);
+	}
+	err = rfi_load_error(args);
+	if (!NIL_P(err))
+		rb_exc_raise(err);
+
+	rfi_set_handle(img, args->result);
+	img->fif = args->fif;
+}
+
 static void
 rd_image(VALUE clazz, VALUE file, struct native_image *img, unsigned int bpp, BOOL ping,
 		int max_size_hint)
 {
+	struct rfi_load_args args;
 	char *filename;
-	int flags = 0;
-	FIBITMAP *h = NULL, *orig = NULL;
-	FREE_IMAGE_FORMAT in_fif;
-
-	filename = rfi_value_to_str(file);
+	int state;
 
-	in_fif = FreeImage_GetFileType(filename, 0);
-	if (in_fif == FIF_UNKNOWN) {
-		free(filename);
-		rb_raise(rb_eIOError, "Invalid image file");
-	}
 	if (max_size_hint < 0 || max_size_hint > 65535)
 		rb_raise(rb_eArgError, "Invalid max_size_hint");
 
-	if (ping) flags |= FIF_LOAD_NOPIXELS;
-	if (!ping) flags |= max_size_hint << 16;
-	// use JPEG_ACCURATE to keep sync with opencv
-	if (in_fif == FIF_JPEG)
-		flags |= JPEG_EXIFROTATE | JPEG_ACCURATE;
-	orig = FreeImage_Load(in_fif, filename, flags);
+	filename = rfi_value_to_str(file);
+	memset(&args, 0, sizeof(args));
+	args.filename = filename;
+	args.bpp = bpp > 0 ? bpp : 32;
+	args.ping = ping;
+	args.max_size_hint = max_size_hint;
+
+	state = rfi_nogvl(rfi_load_nogvl, &args);
 	free(filename);
-	if (!orig)
-		rb_raise(rb_eIOError, "Fail to load image file");
-	if (ping) {
-		h = orig;
-	} else {
-		if (bpp <= 0) bpp = 32;
-		h = convert_bpp(orig, bpp);
-		FreeImage_Unload(orig);
-		if (!h) rb_raise(rb_eArgError, "Invalid bpp");
-	}
-	img->handle = h;
-	img->w = FreeImage_GetWidth(h);
-	img->h = FreeImage_GetHeight(h);
-	img->bpp = FreeImage_GetBPP(h);
-	img->stride = FreeImage_GetPitch(h);
-	img->fif = in_fif;
+	rfi_finish_load(state, &args, img);
 }
 
 static void
 rd_image_blob(VALUE clazz, VALUE blob, struct native_image *img, unsigned int bpp, BOOL ping, int max_size_hint)
 {
-	FIBITMAP *h = NULL, *orig = NULL;
-	FIMEMORY *fmh;
-	int flags = 0;
-	FREE_IMAGE_FORMAT in_fif;
+	struct rfi_load_args args;
+	VALUE pinned;
+	int state;
 
 	Check_Type(blob, T_STRING);
-	fmh = FreeImage_OpenMemory((BYTE*)RSTRING_PTR(blob), RSTRING_LEN(blob));
-
-	in_fif = FreeImage_GetFileTypeFromMemory(fmh, 0);
-	if (in_fif == FIF_UNKNOWN) {
-		FreeImage_CloseMemory(fmh);
-		rb_raise(rb_eIOError, "Invalid image blob");
-	}
 	if (max_size_hint < 0 || max_size_hint > 65535)
 		rb_raise(rb_eArgError, "Invalid max_size_hint");
 
-	if (ping) flags |= FIF_LOAD_NOPIXELS;
-	if (!ping) flags |= max_size_hint << 16;
-	if (in_fif == FIF_JPEG)
-		flags |= JPEG_EXIFROTATE | JPEG_ACCURATE;
-	orig = FreeImage_LoadFromMemory(in_fif, fmh, flags);
-	FreeImage_CloseMemory(fmh);
-	if (!orig)
-		rb_raise(rb_eIOError, "Fail to load image from memory");
-
-	if (ping) {
-		h = orig;
-	} else {
-		if (bpp <= 0) bpp = 32;
-		h = convert_bpp(orig, bpp);
-		FreeImage_Unload(orig);
-		if (!h) rb_raise(rb_eArgError, "Invalid bpp");
-	}
-	img->handle = h;
-	img->w = FreeImage_GetWidth(h);
-	img->h = FreeImage_GetHeight(h);
-	img->bpp = FreeImage_GetBPP(h);
-	img->stride = FreeImage_GetPitch(h);
-	img->fif = in_fif;
+	/* a frozen twin shares the buffer and keeps it alive and unmodified */
+	pinned = rb_str_new_frozen(blob);
+	memset(&args, 0, sizeof(args));
+	args.data = (BYTE*)RSTRING_PTR(pinned);
+	args.size = RSTRING_LEN(pinned);
+	args.bpp = bpp > 0 ? bpp : 32;
+	args.ping = ping;
+	args.max_size_hint = max_size_hint;
+
+	state = rfi_nogvl(rfi_load_nogvl, &args);
+	RB_GC_GUARD(pinned);
+	rfi_finish_load(state, &args, img);
 }
 
 static VALUE Image_initialize(int argc, VALUE *argv, VALUE self)
 {
 	struct native_image* img;
 	/* unwrap */
-	Data_Get_Struct(self, struct native_image, img);
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
 
 	switch (argc)
 	{
@@ -288,113 +820,517 @@ static VALUE Image_initialize(int argc, VALUE *argv, VALUE self)
 #define RFI_CHECK_IMG(x) \
 	if (!img->handle) rb_raise(Class_RFIError, "Image pixels not loaded");
 
-static VALUE Image_save(VALUE self, VALUE file)
+static void rfi_drop_io_buffer(struct native_image *img)
 {
-	char *filename;
-	struct native_image* img;
-	BOOL result;
-	FREE_IMAGE_FORMAT out_fif;
+#ifdef HAVE_RUBY_IO_BUFFER_H
+	if (!NIL_P(img->io_buffer)) {
+		/* later access through the buffer raises instead of reading freed pixels */
+		rb_io_buffer_free(img->io_buffer);
+		img->io_buffer = Qnil;
+	}
+#endif
+}
 
-	Data_Get_Struct(self, struct native_image, img);
-	RFI_CHECK_IMG(img);
+static void rfi_jobs_reap(void);
 
-	Check_Type(file, T_STRING);
-	filename = rfi_value_to_str(file);
+/* why img's pixels can't be freed now, NULL if they can */
+static const char *rfi_image_pinned(struct native_image *img)
+{
+	/* finished to_blob_jobs still count in busy until settled */
+	if (img->busy)
+		rfi_jobs_reap();
+	if (img->busy)
+		return "Image is in use by another thread";
+	if (img->views)
+		return "Image pixels are held by a memory view";
+	if (img->crops && img->crops->views)
+		return "Image pixels are shared with a crop view";
+#ifdef HAVE_RUBY_IO_BUFFER_H
+	/* rfi_drop_io_buffer would raise, and leak the replacement bitmap */
+	if (!NIL_P(img->io_buffer) && RTEST(rb_funcall(img->io_buffer, rb_intern("locked?"), 0)))
+		return "Image pixels are locked through its IO::Buffer";
+#endif
+	return NULL;
+}
 
-	out_fif = FreeImage_GetFIFFromFilename(filename);
-	if (out_fif == FIF_UNKNOWN) {
-		free(filename);
-		rb_raise(Class_RFIError, "Invalid format");
-	}
+/* for changes to img's pixels in place, which others may be reading */
+static void rfi_image_check_writable(struct native_image *img)
+{
+	const char *pinned = rfi_image_pinned(img);
+	if (pinned)
+		rb_raise(Class_RFIError, "%s", pinned);
+}
 
-	if (out_fif == FIF_JPEG && img->bpp != 8 && img->bpp != 24) {
-		FIBITMAP *to_save = FreeImage_ConvertTo24Bits(img->handle);
-		result = FreeImage_Save(out_fif, to_save, filename, JPEG_BASELINE);
-		FreeImage_Unload(to_save);
-	} else {
-		result = FreeImage_Save(out_fif, img->handle, filename, 0);
+/* free img's pixels, check rfi_image_pinned first */
+static void rfi_image_drop(struct native_image *img)
+{
+	rfi_drop_io_buffer(img);
+	rfi_unload(img);
+	rfi_uncrop(img);
+	img->source = Qnil;
+	img->top_down = 0;
+}
+
+/*
+ * Swap img's bitmap for h, freeing the old pixels. h is unloaded instead
+ * while those are still in use, see rfi_image_pinned.
+ */
+static void rfi_image_replace(struct native_image *img, FIBITMAP *h)
+{
+	const char *pinned = rfi_image_pinned(img);
+	if (pinned) {
+		rfi_bitmap_unload(h);
+		rb_raise(Class_RFIError, "%s", pinned);
 	}
+	rfi_image_drop(img);
+	rfi_set_handle(img, h);
+}
 
-	free(filename);
+/* copy of img's pixels in FreeImage's row order */
+static FIBITMAP *rfi_image_upright(struct native_image *img)
+{
+	FIBITMAP *h;
+	unsigned line;
+	int y;
 
-	if(!result)
-		rb_raise(rb_eIOError, "Fail to save image");
-	return Qnil;
+	h = rfi_bitmap_allocate(img->w, img->h, img->bpp);
+	if (!h)
+		rb_memerror();
+	line = FreeImage_GetLine(h);
+	for (y = 0; y < img->h; y++)
+		memcpy(FreeImage_GetScanLine(h, y),
+			FreeImage_GetScanLine(img->handle, img->top_down ? img->h - 1 - y : y), line);
+	return h;
 }
 
-static VALUE Image_to_blob(VALUE self, VALUE type)
+/*
+ * Copy the pixels of an image made by wrap_bytes, or of a crop view, into
+ * a bitmap of its own, in FreeImage's row order. Drawing does this first,
+ * so neither the wrapped String nor the parent image is written to.
+ */
+static void rfi_image_own(struct native_image *img)
 {
-	char *filetype;
-	struct native_image* img;
-	FIMEMORY *hmem;
-	BOOL result;
-	FREE_IMAGE_FORMAT out_fif;
-	VALUE ret;
-	BYTE *raw = NULL;
-	DWORD file_size;
-
-	Data_Get_Struct(self, struct native_image, img);
-	RFI_CHECK_IMG(img);
+	const char *pinned;
 
-	Check_Type(type, T_STRING);
-	filetype = rfi_value_to_str(type);
+	if (NIL_P(img->source))
+		return;
+	if ((pinned = rfi_image_pinned(img)))
+		rb_raise(Class_RFIError, "%s", pinned);
 
-	out_fif = FreeImage_GetFIFFromFormat(filetype);
+	rfi_image_replace(img, rfi_image_upright(img));
+	img->fif = FIF_BMP;
+}
+
+/*
+ * img's bitmap for FreeImage calls that only read it. Wrapped top-down
+ * rows are copied upright into a temporary bitmap, handed back with
+ * rfi_image_dib_done; img, its views and io_buffer are left alone.
+ */
+static FIBITMAP *rfi_image_dib(struct native_image *img)
+{
+	return img->top_down ? rfi_image_upright(img) : img->handle;
+}
+
+static void rfi_image_dib_done(struct native_image *img, FIBITMAP *dib)
+{
+	if (dib != img->handle)
+		rfi_bitmap_unload(dib);
+}
+
+/*
+ * Like rfi_nogvl, for work reading img's bitmap. The image can't be
+ * released by another thread until fn returns.
+ */
+static int rfi_image_nogvl(struct native_image *img, void *(*fn)(void *), void *data)
+{
+	int state;
+	img->busy++;
+	state = rfi_nogvl(fn, data);
+	img->busy--;
+	return state;
+}
+
+struct rfi_save_args {
+	FIBITMAP *dib;
+	int bpp;
+	FREE_IMAGE_FORMAT fif;
+	/* either a file name, a memory stream or a FreeImageIO stream */
+	const char *filename;
+	FIMEMORY *hmem;
+	FreeImageIO *io;
+	fi_handle handle;
+	/* encoder flags from the options hash, see rfi_save_flags */
+	int flags;
+
+	BOOL result;
+};
+
+static void *rfi_save_nogvl(void *ptr)
+{
+	struct rfi_save_args *args = ptr;
+	FIBITMAP *to_save = args->dib;
+	int flags = args->flags;
+
+	if (args->fif == FIF_JPEG && args->bpp != 8 && args->bpp != 24) {
+		to_save = FreeImage_ConvertTo24Bits(args->dib);
+		flags |= JPEG_BASELINE;
+	}
+	if (args->io)
+		args->result = FreeImage_SaveToHandle(args->fif, to_save, args->io, args->handle, flags);
+	else if (args->hmem)
+		args->result = FreeImage_SaveToMemory(args->fif, to_save, args->hmem, flags);
+	else
+		args->result = FreeImage_Save(args->fif, to_save, args->filename, flags);
+	if (to_save != args->dib)
+		rfi_bitmap_unload(to_save);
+	return NULL;
+}
+
+static int rfi_save_flags(FREE_IMAGE_FORMAT fif, VALUE opts);
+
+static VALUE Image_save(int argc, VALUE *argv, VALUE self)
+{
+	char *filename;
+	struct native_image* img;
+	struct rfi_save_args args;
+	VALUE file, opts;
+	int state;
+
+	rb_scan_args(argc, argv, "11", &file, &opts);
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	RFI_CHECK_IMG(img);
+
+	Check_Type(file, T_STRING);
+	memset(&args, 0, sizeof(args));
+	args.fif = FreeImage_GetFIFFromFilename(StringValueCStr(file));
+	if (args.fif == FIF_UNKNOWN)
+		rb_raise(Class_RFIError, "Invalid format");
+	args.flags = rfi_save_flags(args.fif, opts);
+	filename = rfi_value_to_str(file);
+	args.dib = rfi_image_dib(img);
+	args.bpp = img->bpp;
+	args.filename = filename;
+
+	state = rfi_image_nogvl(img, rfi_save_nogvl, &args);
+	rfi_image_dib_done(img, args.dib);
+	free(filename);
+	if (state)
+		rb_jump_tag(state);
+
+	if(!args.result)
+		rb_raise(rb_eIOError, "Fail to save image");
+	return Qnil;
+}
+
+/* copy the encoded stream into a new String, hmem is closed */
+static VALUE rfi_memory_to_str(FIMEMORY *hmem)
+{
+	VALUE ret;
+	BYTE *raw = NULL;
+	DWORD file_size;
+
+	file_size = FreeImage_TellMemory(hmem);
+	FreeImage_SeekMemory(hmem, 0, SEEK_SET);
+	FreeImage_AcquireMemory(hmem, &raw, &file_size);
+	ret = rb_str_new((char*)raw, (long)file_size);
+	FreeImage_CloseMemory(hmem);
+	return ret;
+}
+
+/* FIF for a format name like "jpeg", raises on unknown formats */
+static FREE_IMAGE_FORMAT rfi_format_from_type(VALUE type)
+{
+	char *filetype;
+	FREE_IMAGE_FORMAT fif;
+
+	Check_Type(type, T_STRING);
+	filetype = rfi_value_to_str(type);
+	fif = FreeImage_GetFIFFromFormat(filetype);
 	free(filetype);
-	if (out_fif == FIF_UNKNOWN)
+	if (fif == FIF_UNKNOWN)
 		rb_raise(Class_RFIError, "Invalid format");
+	return fif;
+}
+
+struct rfi_save_opts {
+	FREE_IMAGE_FORMAT fif;
+	int flags;
+};
+
+/* an integer option within lo..hi */
+static int rfi_opt_int(VALUE key, VALUE val, int lo, int hi)
+{
+	int v = NUM2INT(val);
+	if (v < lo || v > hi)
+		rb_raise(rb_eArgError, "%"PRIsVALUE" must be in %d..%d", rb_sym2str(key), lo, hi);
+	return v;
+}
+
+static int rfi_save_opt(VALUE key, VALUE val, VALUE arg)
+{
+	struct rfi_save_opts *o = (struct rfi_save_opts *)arg;
+	ID id;
+	int v;
+
+	if (!SYMBOL_P(key))
+		rb_raise(rb_eArgError, "encoder options must be symbols");
+	id = SYM2ID(key);
+	switch (o->fif) {
+		case FIF_JPEG:
+			if (id == rb_intern("quality")) {
+				o->flags |= rfi_opt_int(key, val, 1, 100);
+			} else if (id == rb_intern("subsampling")) {
+				v = NUM2INT(val);
+				if (v == 411)
+					o->flags |= JPEG_SUBSAMPLING_411;
+				else if (v == 420)
+					o->flags |= JPEG_SUBSAMPLING_420;
+				else if (v == 422)
+					o->flags |= JPEG_SUBSAMPLING_422;
+				else if (v == 444)
+					o->flags |= JPEG_SUBSAMPLING_444;
+				else
+					rb_raise(rb_eArgError, "subsampling must be 411, 420, 422 or 444");
+			} else if (id == rb_intern("progressive")) {
+				if (RTEST(val))
+					o->flags |= JPEG_PROGRESSIVE;
+			} else if (id == rb_intern("optimize")) {
+				if (RTEST(val))
+					o->flags |= JPEG_OPTIMIZE;
+			} else {
+				goto unknown;
+			}
+			break;
+		case FIF_PNG:
+			if (id == rb_intern("compression")) {
+				/* zlib level, 0 is stored */
+				v = rfi_opt_int(key, val, 0, 9);
+				o->flags |= v ? v : PNG_Z_NO_COMPRESSION;
+			} else if (id == rb_intern("interlaced")) {
+				if (RTEST(val))
+					o->flags |= PNG_INTERLACED;
+			} else {
+				goto unknown;
+			}
+			break;
+		case FIF_WEBP:
+			if (id == rb_intern("quality")) {
+				o->flags |= rfi_opt_int(key, val, 1, 100);
+			} else if (id == rb_intern("lossless")) {
+				if (RTEST(val))
+					o->flags |= WEBP_LOSSLESS;
+			} else {
+				goto unknown;
+			}
+			break;
+		default:
+			goto unknown;
+	}
+	return ST_CONTINUE;
+unknown:
+	rb_raise(rb_eArgError, "%s does not support the %"PRIsVALUE" option",
+			FreeImage_GetFormatFromFIF(o->fif), rb_sym2str(key));
+	return ST_STOP;
+}
+
+/*
+ * Encoder flags for an options hash, only those FreeImage's plugin for fif
+ * takes: JPEG quality, subsampling, progressive and optimize, PNG
+ * compression and interlaced, WebP quality and lossless. 0 for nil.
+ */
+static int rfi_save_flags(FREE_IMAGE_FORMAT fif, VALUE opts)
+{
+	struct rfi_save_opts o;
+
+	if (NIL_P(opts))
+		return 0;
+	Check_Type(opts, T_HASH);
+	o.fif = fif;
+	o.flags = 0;
+	rb_hash_foreach(opts, rfi_save_opt, (VALUE)&o);
+	return o.flags;
+}
+
+static VALUE Image_to_blob(int argc, VALUE *argv, VALUE self)
+{
+	struct native_image* img;
+	struct rfi_save_args args;
+	FIMEMORY *hmem;
+	VALUE type, opts;
+	int state;
+
+	rb_scan_args(argc, argv, "11", &type, &opts);
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	RFI_CHECK_IMG(img);
+
+	memset(&args, 0, sizeof(args));
+	args.fif = rfi_format_from_type(type);
+	args.flags = rfi_save_flags(args.fif, opts);
 
 	hmem = FreeImage_OpenMemory(0, 0);
 	if (!hmem)
 		rb_raise(rb_eIOError, "Fail to allocate blob");
-	if (out_fif == FIF_JPEG && img->bpp != 8 && img->bpp != 24) {
-		FIBITMAP *to_save = FreeImage_ConvertTo24Bits(img->handle);
-		result = FreeImage_SaveToMemory(out_fif, to_save, hmem, JPEG_BASELINE);
-		FreeImage_Unload(to_save);
-	} else {
-		result = FreeImage_SaveToMemory(out_fif, img->handle, hmem, 0);
-	}
+	args.dib = rfi_image_dib(img);
+	args.bpp = img->bpp;
+	args.hmem = hmem;
 
-	if(!result) {
+	state = rfi_image_nogvl(img, rfi_save_nogvl, &args);
+	rfi_image_dib_done(img, args.dib);
+	if(state || !args.result) {
 		FreeImage_CloseMemory(hmem);
+		if (state)
+			rb_jump_tag(state);
 		rb_raise(rb_eIOError, "Fail to save image to blob");
 	}
-	file_size = FreeImage_TellMemory(hmem);
-	FreeImage_SeekMemory(hmem, 0, SEEK_SET);
-	FreeImage_AcquireMemory(hmem, &raw, &file_size);
-	ret = rb_str_new((char*)raw, (long)file_size);
-	FreeImage_CloseMemory(hmem);
-	return ret;
+	return rfi_memory_to_str(hmem);
+}
+
+struct rfi_fit_args {
+	FIBITMAP *dib;
+	FREE_IMAGE_FORMAT fif;
+	int flags;
+	size_t max_bytes;
+
+	BYTE *data;
+	size_t size;
+	int quality;
+	int result;
+};
+
+static void *rfi_fit_nogvl(void *ptr)
+{
+	struct rfi_fit_args *args = ptr;
+	args->result = rfi_encode_fit(args->fif, args->dib, args->flags, args->max_bytes,
+			&args->data, &args->size, &args->quality);
+	return NULL;
+}
+
+/*
+ * [blob, quality] for the highest JPEG or WebP quality whose encode is at
+ * most max_bytes long, nil if not even quality 1 is, see rfi_encode_fit.
+ * JPEGs come from libjpeg's raw data path, not FreeImage's plugin: its
+ * colour conversion and subsampling differ, so to_blob at the returned
+ * quality gives another blob, of another size. Nor are the Exif and ICC
+ * markers to_blob writes carried over, only a JFIF header.
+ */
+static VALUE Image_to_blob_max_bytes(int argc, VALUE *argv, VALUE self)
+{
+	struct native_image* img;
+	struct rfi_fit_args args;
+	VALUE type, max_bytes, opts, blob;
+	int state;
+
+	rb_scan_args(argc, argv, "21", &type, &max_bytes, &opts);
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	RFI_CHECK_IMG(img);
+
+	memset(&args, 0, sizeof(args));
+	args.fif = rfi_format_from_type(type);
+	if (args.fif != FIF_JPEG && args.fif != FIF_WEBP)
+		rb_raise(rb_eArgError, "Quality search only works for JPEG and WebP");
+	args.flags = rfi_save_flags(args.fif, opts);
+	/* the low bits are the quality, which is searched for */
+	if (args.flags & 0x7F)
+		rb_raise(rb_eArgError, "quality is what gets searched");
+	if (NUM2LONG(max_bytes) <= 0)
+		rb_raise(rb_eArgError, "max_bytes must be positive");
+	args.max_bytes = NUM2SIZET(max_bytes);
+	args.dib = rfi_image_dib(img);
+
+	state = rfi_image_nogvl(img, rfi_fit_nogvl, &args);
+	rfi_image_dib_done(img, args.dib);
+	if (!state && args.result == 0) {
+		blob = rb_str_new((const char *)args.data, args.size);
+		free(args.data);
+		return rb_assoc_new(blob, INT2FIX(args.quality));
+	}
+	free(args.data);
+	if (state)
+		rb_jump_tag(state);
+	if (args.result < 0)
+		rb_raise(rb_eIOError, "Fail to save image to blob");
+	return Qnil;
+}
+
+struct rfi_write_io_args {
+	struct rfi_save_args save;
+	struct rfi_stream *st;
+};
+
+static void *rfi_write_io_nogvl(void *ptr)
+{
+	struct rfi_write_io_args *args = ptr;
+	rfi_save_nogvl(&args->save);
+	if (args->save.result && rfi_stream_flush(args->st) < 0)
+		args->save.result = FALSE;
+	return NULL;
 }
 
+/* encode to any IO responding to write, a chunk at a time */
+static VALUE Image_write_io(int argc, VALUE *argv, VALUE self)
+{
+	struct native_image* img;
+	struct rfi_write_io_args args;
+	struct rfi_stream st;
+	VALUE io, type, opts;
+	int state;
 
+	rb_scan_args(argc, argv, "21", &io, &type, &opts);
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	RFI_CHECK_IMG(img);
 
+	memset(&args, 0, sizeof(args));
+	args.save.fif = rfi_format_from_type(type);
+	args.save.flags = rfi_save_flags(args.save.fif, opts);
+	memset(&st, 0, sizeof(st));
+	st.io = io;
+	st.cap = RFI_STREAM_CHUNK;
+	st.data = malloc(st.cap);
+	if (!st.data)
+		rb_memerror();
+	args.save.dib = rfi_image_dib(img);
+	args.save.bpp = img->bpp;
+	args.save.io = &rfi_stream_write_io;
+	args.save.handle = &st;
+	args.st = &st;
+
+	state = rfi_image_nogvl(img, rfi_write_io_nogvl, &args);
+	rfi_image_dib_done(img, args.save.dib);
+	free(st.data);
+	if (state)
+		rb_jump_tag(state);
+	if (st.state)
+		rb_jump_tag(st.state);
+	if (!args.save.result)
+		rb_raise(rb_eIOError, "Fail to save image");
+	return Qnil;
+}
 
 static VALUE Image_cols(VALUE self)
 {
 	struct native_image* img;
-	Data_Get_Struct(self, struct native_image, img);
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
 	return INT2NUM(img->w);
 }
 
 static VALUE Image_rows(VALUE self)
 {
 	struct native_image* img;
-	Data_Get_Struct(self, struct native_image, img);
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
 	return INT2NUM(img->h);
 }
 
 static VALUE Image_bpp(VALUE self)
 {
 	struct native_image* img;
-	Data_Get_Struct(self, struct native_image, img);
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
 	return INT2NUM(img->bpp);
 }
 
 static VALUE Image_stride(VALUE self)
 {
 	struct native_image* img;
-	Data_Get_Struct(self, struct native_image, img);
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
 	return INT2NUM(img->stride);
 }
 
@@ -402,7 +1338,7 @@ static VALUE Image_format(VALUE self)
 {
 	struct native_image* img;
 	const char *p;
-	Data_Get_Struct(self, struct native_image, img);
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
 	p = FreeImage_GetFormatFromFIF(img->fif);
 	return rb_str_new(p, strlen(p));
 }
@@ -410,10 +1346,11 @@ static VALUE Image_format(VALUE self)
 static VALUE Image_release(VALUE self)
 {
 	struct native_image* img;
-	Data_Get_Struct(self, struct native_image, img);
-	if (img->handle)
-		FreeImage_Unload(img->handle);
-	img->handle = NULL;
+	const char *pinned;
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	if ((pinned = rfi_image_pinned(img)))
+		rb_raise(Class_RFIError, "%s", pinned);
+	rfi_image_drop(img);
 	return Qnil;
 }
 
@@ -427,12 +1364,22 @@ static VALUE Image_read_bytes(VALUE self)
 	int i;
 	VALUE v;
 
-	Data_Get_Struct(self, struct native_image, img);
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
 	RFI_CHECK_IMG(img);
 	p = (const char*)FreeImage_GetBits(img->handle);
 	stride_dst = img->w * (img->bpp / 8);
 	v = rb_str_new(NULL, stride_dst * img->h);
 
+	if (img->top_down) {
+		ptr = RSTRING_PTR(v);
+		for(i = 0; i < img->h; i++) {
+			memcpy(ptr, p, stride_dst);
+			ptr += stride_dst;
+			p += img->stride;
+		}
+		return v;
+	}
+
 	/* up-side-down */
 	ptr = RSTRING_PTR(v) + img->h * stride_dst;
 	for(i = 0; i < img->h; i++) {
@@ -448,241 +1395,1712 @@ static VALUE Image_buffer_addr(VALUE self)
 	struct native_image* img;
 	const char *p;
 
-	Data_Get_Struct(self, struct native_image, img);
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
 	RFI_CHECK_IMG(img);
 	p = (const char*)FreeImage_GetBits(img->handle);
 	return ULONG2NUM((uintptr_t)p);
 }
 
+#ifdef HAVE_RUBY_IO_BUFFER_H
+/*
+ * The bitmap's memory as an IO::Buffer, no copy: rows are stride bytes
+ * apart, bottom-up unless top_down?, see pixel_layout. The buffer keeps
+ * the image alive and is freed by release. It is read-only over the
+ * String of a wrap_bytes image.
+ */
+static VALUE Image_io_buffer(VALUE self)
+{
+	struct native_image* img;
+
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	RFI_CHECK_IMG(img);
+	if (NIL_P(img->io_buffer)) {
+		img->io_buffer = rb_io_buffer_new(FreeImage_GetBits(img->handle),
+				(size_t)img->stride * img->h, NIL_P(img->source) ?
+				RB_IO_BUFFER_EXTERNAL : RB_IO_BUFFER_EXTERNAL | RB_IO_BUFFER_READONLY);
+		rb_ivar_set(img->io_buffer, rb_intern("image"), self);
+	}
+	return img->io_buffer;
+}
+#endif
+
+#ifdef HAVE_RUBY_MEMORY_VIEW_H
+/*
+ * Rows x columns (x channels) of bytes, top row first: the view starts at
+ * the last scanline and steps back one pitch per row (forward for top-down
+ * wrapped rows). The image can't be released while a view is held.
+ */
+static bool rfi_memory_view_get(VALUE self, rb_memory_view_t *view, int flags)
+{
+	struct native_image* img;
+	ssize_t *dims;
+	int channels;
+
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	if (!img->handle)
+		return false;
+	channels = img->bpp / 8;
+	/* shape then strides */
+	dims = malloc(sizeof(ssize_t) * 6);
+	if (!dims)
+		return false;
+	dims[0] = img->h;
+	dims[1] = img->w;
+	dims[2] = channels;
+	dims[3] = img->top_down ? img->stride : -(ssize_t)img->stride;
+	dims[4] = channels;
+	dims[5] = 1;
+
+	memset(view, 0, sizeof(*view));
+	view->obj = self;
+	view->data = FreeImage_GetScanLine(img->handle, img->top_down ? 0 : img->h - 1);
+	view->byte_size = (ssize_t)img->w * channels * img->h;
+	view->readonly = !NIL_P(img->source);
+	view->format = "C";
+	view->item_size = 1;
+	view->ndim = channels == 1 ? 2 : 3;
+	view->shape = dims;
+	view->strides = dims + 3;
+	view->private_data = dims;
+	img->views++;
+	return true;
+}
+
+static bool rfi_memory_view_release(VALUE self, rb_memory_view_t *view)
+{
+	struct native_image* img;
+
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	img->views--;
+	free(view->private_data);
+	return true;
+}
+
+static bool rfi_memory_view_available_p(VALUE self)
+{
+	struct native_image* img;
+
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	return img->handle != NULL;
+}
+
+static const rb_memory_view_entry_t rfi_memory_view_entry = {
+	rfi_memory_view_get,
+	rfi_memory_view_release,
+	rfi_memory_view_available_p,
+};
+#endif
+
 static VALUE Image_has_bytes(VALUE self)
 {
 	struct native_image* img;
-	Data_Get_Struct(self, struct native_image, img);
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
 	return img->handle ? Qtrue : Qfalse;
 }
 
 
-static inline VALUE rfi_get_image(FIBITMAP *nh)
-{
-	struct native_image *new_img;
-	new_img = malloc(sizeof(struct native_image));
-	memset(new_img, 0, sizeof(struct native_image));
-	new_img->handle = nh;
-	new_img->stride = FreeImage_GetPitch(nh);
-	new_img->bpp = FreeImage_GetBPP(nh);
-	new_img->w = FreeImage_GetWidth(nh);
-	new_img->h = FreeImage_GetHeight(nh);
-
-	return Data_Wrap_Struct(Class_Image, NULL, Image_free, new_img);
-}
-
-static VALUE Image_to_bpp(VALUE self, VALUE _bpp)
-{
+static inline VALUE rfi_get_image(FIBITMAP *nh)
+{
+	VALUE v = Image_alloc(Class_Image);
+	struct native_image *new_img;
+	TypedData_Get_Struct(v, struct native_image, &rfi_image_type, new_img);
+	rfi_set_handle(new_img, nh);
+
+	return v;
+}
+
+struct rfi_transform_args {
+	FIBITMAP *dib;
+	int width;
+	int height;
+	/* bpp, filter or downscale factor, depending on the transform */
+	int param;
+	double angle;
+
+	FIBITMAP *result;
+};
+
+/* run a transform of img's bitmap without the GVL */
+static FIBITMAP *rfi_image_transform_dib(struct native_image *img, void *(*fn)(void *),
+		struct rfi_transform_args *args, VALUE err_class, const char *fail_msg)
+{
+	int state;
+
+	args->dib = rfi_image_dib(img);
+	args->result = NULL;
+	state = rfi_image_nogvl(img, fn, args);
+	rfi_image_dib_done(img, args->dib);
+	if (state) {
+		if (args->result)
+			rfi_bitmap_unload(args->result);
+		rb_jump_tag(state);
+	}
+	if (!args->result)
+		rb_raise(err_class, "%s", fail_msg);
+	return args->result;
+}
+
+/* ... and wrap the result */
+static VALUE rfi_image_transform(struct native_image *img, void *(*fn)(void *),
+		struct rfi_transform_args *args, VALUE err_class, const char *fail_msg)
+{
+	return rfi_get_image(rfi_image_transform_dib(img, fn, args, err_class, fail_msg));
+}
+
+/* ... and make the result img's bitmap, for the bang methods */
+static VALUE rfi_image_transform_bang(VALUE self, struct native_image *img, void *(*fn)(void *),
+		struct rfi_transform_args *args, VALUE err_class, const char *fail_msg)
+{
+	rfi_image_replace(img, rfi_image_transform_dib(img, fn, args, err_class, fail_msg));
+	return self;
+}
+
+static void *rfi_to_bpp_nogvl(void *ptr)
+{
+	struct rfi_transform_args *args = ptr;
+	args->result = convert_bpp(args->dib, args->param);
+	return NULL;
+}
+
+static VALUE Image_to_bpp(VALUE self, VALUE _bpp)
+{
+	struct native_image *img;
+	struct rfi_transform_args args;
+	int bpp = NUM2INT(_bpp);
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	RFI_CHECK_IMG(img);
+	if (bpp == img->bpp)
+		return self;
+
+	args.param = bpp;
+	return rfi_image_transform(img, rfi_to_bpp_nogvl, &args, rb_eArgError, "Invalid bpp");
+}
+
+static VALUE Image_to_bpp_bang(VALUE self, VALUE _bpp)
+{
+	struct native_image *img;
+	struct rfi_transform_args args;
+	int bpp = NUM2INT(_bpp);
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	RFI_CHECK_IMG(img);
+	if (bpp == img->bpp)
+		return self;
+
+	args.param = bpp;
+	return rfi_image_transform_bang(self, img, rfi_to_bpp_nogvl, &args, rb_eArgError, "Invalid bpp");
+}
+
+static void *rfi_rotate_nogvl(void *ptr)
+{
+	struct rfi_transform_args *args = ptr;
+	args->result = FreeImage_Rotate(args->dib, args->angle, NULL);
+	return NULL;
+}
+
+static VALUE Image_rotate(VALUE self, VALUE _angle)
+{
+	struct native_image *img;
+	struct rfi_transform_args args;
+	double angle = NUM2DBL(_angle);
+
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	RFI_CHECK_IMG(img);
+	args.angle = angle;
+	return rfi_image_transform(img, rfi_rotate_nogvl, &args, Class_RFIError, "Fail to rotate image");
+}
+
+static VALUE Image_rotate_bang(VALUE self, VALUE _angle)
+{
+	struct native_image *img;
+	struct rfi_transform_args args;
+	double angle = NUM2DBL(_angle);
+
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	RFI_CHECK_IMG(img);
+	if (angle == 0)
+		return self;
+	args.angle = angle;
+	return rfi_image_transform_bang(self, img, rfi_rotate_nogvl, &args, Class_RFIError, "Fail to rotate image");
+}
+
+static VALUE Image_clone(VALUE self)
+{
+	struct native_image *img;
+	FIBITMAP *nh;
+
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	RFI_CHECK_IMG(img);
+	/* an upright copy is a clone already */
+	nh = img->top_down ? rfi_image_upright(img) : rfi_bitmap_clone(img->handle);
+	return rfi_get_image(nh);
+}
+
+static void *rfi_rescale_nogvl(void *ptr)
+{
+	struct rfi_transform_args *args = ptr;
+	args->result = rfi_rescale(args->dib, args->width, args->height, args->param);
+	return NULL;
+}
+
+/* reference for the resampler in rfi_resize.c */
+static void *rfi_freeimage_rescale_nogvl(void *ptr)
+{
+	struct rfi_transform_args *args = ptr;
+	args->result = FreeImage_Rescale(args->dib, args->width, args->height, args->param);
+	return NULL;
+}
+
+static VALUE rfi_rescale_with(VALUE self, VALUE dst_width, VALUE dst_height, VALUE filter_type,
+		void *(*fn)(void *))
+{
+	struct native_image *img;
+	struct rfi_transform_args args;
+	int w = NUM2INT(dst_width);
+	int h = NUM2INT(dst_height);
+	int f = NUM2INT(filter_type);
+	if (w <= 0 || h <= 0)
+		rb_raise(rb_eArgError, "Invalid size");
+
+	if (f < FILTER_BOX || f > FILTER_LANCZOS3)
+		rb_raise(rb_eArgError, "Invalid image filter type");
+
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	RFI_CHECK_IMG(img);
+
+	args.width = w;
+	args.height = h;
+	args.param = f;
+	return rfi_image_transform(img, fn, &args, Class_RFIError, "Fail to rescale image");
+}
+
+static VALUE Image_rescale(VALUE self, VALUE dst_width, VALUE dst_height, VALUE filter_type)
+{
+	return rfi_rescale_with(self, dst_width, dst_height, filter_type, rfi_rescale_nogvl);
+}
+
+static VALUE Image_freeimage_rescale(VALUE self, VALUE dst_width, VALUE dst_height, VALUE filter_type)
+{
+	return rfi_rescale_with(self, dst_width, dst_height, filter_type, rfi_freeimage_rescale_nogvl);
+}
+
+static void *rfi_downscale_nogvl(void *ptr)
+{
+	struct rfi_transform_args *args = ptr;
+
+	if (args->param <= 1) {
+		args->result = FreeImage_Copy(args->dib, 0, 0,
+			FreeImage_GetWidth(args->dib), FreeImage_GetHeight(args->dib));
+		return NULL;
+	}
+	args->result = rfi_area_resize(args->dib, args->width, args->height);
+	return NULL;
+}
+
+static VALUE Image_downscale(VALUE self, VALUE max_size) {
+	// down-sample resize
+	struct native_image *img;
+	struct rfi_transform_args args;
+	int scale;
+	int mlen;
+	int msize = NUM2INT(max_size);
+
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	RFI_CHECK_IMG(img);
+
+	mlen = img->w > img->h ? img->w : img->h;
+	if (msize <= 0 || msize >= mlen) {
+		scale = 1;
+	} else {
+		if (img->bpp != 8 && img->bpp != 24 && img->bpp != 32)
+			rb_raise(rb_eArgError, "bpp not supported");
+		scale = (mlen + msize - 1)  / msize;
+	}
+	args.width = img->w / scale;
+	args.height = img->h / scale;
+	args.param = scale;
+	return rfi_image_transform(img, rfi_downscale_nogvl, &args, rb_eArgError, "fail to allocate image");
+}
+
+static VALUE Image_downscale_bang(VALUE self, VALUE max_size) {
+	struct native_image *img;
+	struct rfi_transform_args args;
+	int scale;
+	int mlen;
+	int msize = NUM2INT(max_size);
+
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	RFI_CHECK_IMG(img);
+
+	mlen = img->w > img->h ? img->w : img->h;
+	if (msize <= 0 || msize >= mlen)
+		return self;
+	if (img->bpp != 8 && img->bpp != 24 && img->bpp != 32)
+		rb_raise(rb_eArgError, "bpp not supported");
+	scale = (mlen + msize - 1)  / msize;
+	args.width = img->w / scale;
+	args.height = img->h / scale;
+	args.param = scale;
+	return rfi_image_transform_bang(self, img, rfi_downscale_nogvl, &args, rb_eArgError, "fail to allocate image");
+}
+
+static void *rfi_shrink_nogvl(void *ptr)
+{
+	struct rfi_transform_args *args = ptr;
+	args->result = rfi_area_resize(args->dib, args->width, args->height);
+	return NULL;
+}
+
+/* area average resize, much better than rescale's filters for thumbnails */
+static VALUE Image_shrink(VALUE self, VALUE dst_width, VALUE dst_height)
+{
+	struct native_image *img;
+	struct rfi_transform_args args;
+	int w = NUM2INT(dst_width);
+	int h = NUM2INT(dst_height);
+	if (w <= 0 || h <= 0)
+		rb_raise(rb_eArgError, "Invalid size");
+
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	RFI_CHECK_IMG(img);
+	if (img->bpp != 8 && img->bpp != 24 && img->bpp != 32)
+		rb_raise(rb_eArgError, "bpp not supported");
+
+	args.width = w;
+	args.height = h;
+	return rfi_image_transform(img, rfi_shrink_nogvl, &args, rb_eArgError, "fail to allocate image");
+}
+
+static VALUE Image_flip_horizontal(VALUE self) {
+	struct native_image *img;
+	FIBITMAP *nh;
+
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	RFI_CHECK_IMG(img);
+	nh = img->top_down ? rfi_image_upright(img) : rfi_bitmap_clone(img->handle);
+	if(FreeImage_FlipHorizontal(nh) == FALSE)
+		rb_raise(Class_RFIError, "Malloc Failed");
+	return rfi_get_image(nh);
+}
+
+static VALUE Image_flip_vertical(VALUE self) {
+	struct native_image *img;
+	FIBITMAP *nh;
+
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	RFI_CHECK_IMG(img);
+	nh = img->top_down ? rfi_image_upright(img) : rfi_bitmap_clone(img->handle);
+	if(FreeImage_FlipVertical(nh) == FALSE)
+		rb_raise(Class_RFIError, "Malloc Failed");
+	return rfi_get_image(nh);
+}
+
+static VALUE Image_flip_horizontal_bang(VALUE self) {
+	struct native_image *img;
+
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	RFI_CHECK_IMG(img);
+	rfi_image_check_writable(img);
+	/* never flip the String of wrap_bytes */
+	rfi_image_own(img);
+	if(FreeImage_FlipHorizontal(img->handle) == FALSE)
+		rb_raise(Class_RFIError, "Malloc Failed");
+	return self;
+}
+
+static VALUE Image_flip_vertical_bang(VALUE self) {
+	struct native_image *img;
+
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	RFI_CHECK_IMG(img);
+	rfi_image_check_writable(img);
+	rfi_image_own(img);
+	if(FreeImage_FlipVertical(img->handle) == FALSE)
+		rb_raise(Class_RFIError, "Malloc Failed");
+	return self;
+}
+
+static FIBITMAP *rfi_crop(VALUE self, VALUE _left, VALUE _top, VALUE _right, VALUE _bottom)
+{
+	struct native_image *img;
+	FIBITMAP *dib, *nh;
+	int left = NUM2INT(_left);
+	int top = NUM2INT(_top);
+	int right = NUM2INT(_right);
+	int bottom = NUM2INT(_bottom);
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	RFI_CHECK_IMG(img);
+
+	if (left < 0 || top < 0
+		|| right < left || bottom < top
+		|| bottom > img->h || right > img->w )
+		rb_raise(rb_eArgError, "Invalid boundary");
+
+	dib = rfi_image_dib(img);
+	nh = FreeImage_Copy(dib, left, top, right, bottom);
+	rfi_image_dib_done(img, dib);
+	if (!nh)
+		rb_raise(Class_RFIError, "Fail to crop image");
+	return nh;
+}
+
+static VALUE Image_crop(VALUE self, VALUE _left, VALUE _top, VALUE _right, VALUE _bottom)
+{
+	return rfi_get_image(rfi_crop(self, _left, _top, _right, _bottom));
+}
+
+/*
+ * A crop sharing this image's pixels instead of copying them. The view
+ * copies its pixels the first time it is drawn on or transformed in
+ * place. This image can't be released, drawn on or changed in place
+ * while views of it are alive.
+ */
+static VALUE Image_crop_view(VALUE self, VALUE _left, VALUE _top, VALUE _right, VALUE _bottom)
+{
+	struct native_image *img, *view;
+	struct rfi_crops *crops;
+	FIBITMAP *nh;
+	VALUE v, parent = self;
+	int left = NUM2INT(_left);
+	int top = NUM2INT(_top);
+	int right = NUM2INT(_right);
+	int bottom = NUM2INT(_bottom);
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	RFI_CHECK_IMG(img);
+
+	if (left < 0 || top < 0
+		|| right < left || bottom < top
+		|| bottom > img->h || right > img->w )
+		rb_raise(rb_eArgError, "Invalid boundary");
+
+	/* a view of a view shares the pixels of the first parent */
+	if (img->parent_crops) {
+		parent = img->source;
+		crops = img->parent_crops;
+	} else {
+		if (!img->crops) {
+			img->crops = calloc(1, sizeof(*img->crops));
+			if (!img->crops)
+				rb_memerror();
+			img->crops->refs = 1;
+		}
+		crops = img->crops;
+	}
+	v = Image_alloc(Class_Image);
+	TypedData_Get_Struct(v, struct native_image, &rfi_image_type, view);
+	/* wrapped top-down rows are stored upside down, so is the view */
+	if (img->top_down)
+		nh = FreeImage_CreateView(img->handle, left, img->h - bottom, right, img->h - top);
+	else
+		nh = FreeImage_CreateView(img->handle, left, top, right, bottom);
+	if (!nh)
+		rb_raise(Class_RFIError, "Fail to crop image");
+
+	view->source = parent;
+	view->top_down = img->top_down;
+	view->parent_crops = crops;
+	crops->refs++;
+	crops->views++;
+	rfi_set_handle(view, nh);
+	view->fif = img->fif;
+	return v;
+}
+
+static VALUE Image_crop_bang(VALUE self, VALUE _left, VALUE _top, VALUE _right, VALUE _bottom)
+{
+	struct native_image *img;
+	FIBITMAP *nh = rfi_crop(self, _left, _top, _right, _bottom);
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	rfi_image_replace(img, nh);
+	return self;
+}
+
+enum rfi_op_kind {
+	RFI_OP_CROP,
+	RFI_OP_RESIZE,
+	RFI_OP_TO_BPP,
+};
+
+struct rfi_op {
+	enum rfi_op_kind kind;
+	/* crop: left, top, right, bottom; resize: width, height, filter; to_bpp: bpp */
+	int arg[4];
+};
+
+struct rfi_pipeline_args {
+	FIBITMAP *dib;
+	const struct rfi_op *ops;
+	long n;
+	/* with save.hmem set the result is encoded into it, not returned */
+	struct rfi_save_args save;
+
+	FIBITMAP *result;
+	int failed;
+};
+
+/* (l, t, r, b) of dib as a view, or dib itself when that is all of it */
+static FIBITMAP *rfi_window(FIBITMAP *dib, int l, int t, int r, int b)
+{
+	if (l == 0 && t == 0 && r == (int)FreeImage_GetWidth(dib) && b == (int)FreeImage_GetHeight(dib))
+		return dib;
+	return FreeImage_CreateView(dib, l, t, r, b);
+}
+
+/*
+ * Crops only narrow a window on the current bitmap, which the next step
+ * reads through a view. A to_bpp right after a resize converts the
+ * resampler's output rows as they are written. Each intermediate is
+ * freed as soon as the next one exists.
+ */
+static void *rfi_pipeline_nogvl(void *ptr)
+{
+	struct rfi_pipeline_args *args = ptr;
+	const struct rfi_op *op;
+	FIBITMAP *cur = args->dib, *in, *out, *tmp;
+	/* cur is an intermediate of ours */
+	int owned = 0;
+	int l = 0, t = 0, r = FreeImage_GetWidth(cur), b = FreeImage_GetHeight(cur);
+	int bpp;
+	long i;
+
+	for (i = 0; i < args->n; i++) {
+		op = &args->ops[i];
+		if (op->kind == RFI_OP_CROP) {
+			r = l + op->arg[2];
+			b = t + op->arg[3];
+			l += op->arg[0];
+			t += op->arg[1];
+			continue;
+		}
+		if (op->kind == RFI_OP_TO_BPP && (int)FreeImage_GetBPP(cur) == op->arg[0])
+			continue;
+		in = rfi_window(cur, l, t, r, b);
+		if (!in) {
+			args->failed = 1;
+			goto out;
+		}
+		if (op->kind == RFI_OP_RESIZE) {
+			bpp = i + 1 < args->n && op[1].kind == RFI_OP_TO_BPP ? op[1].arg[0] : 0;
+			out = rfi_rescale_to(in, op->arg[0], op->arg[1], op->arg[2], bpp);
+			if (bpp) {
+				i++;
+				if (out && (int)FreeImage_GetBPP(out) != bpp) {
+					tmp = convert_bpp(out, bpp);
+					rfi_bitmap_unload(out);
+					out = tmp;
+				}
+			}
+		} else {
+			out = convert_bpp(in, op->arg[0]);
+		}
+		if (in != cur)
+			FreeImage_Unload(in);
+		if (!out) {
+			args->failed = 1;
+			goto out;
+		}
+		if (owned)
+			rfi_bitmap_unload(cur);
+		cur = out;
+		owned = 1;
+		l = t = 0;
+		r = FreeImage_GetWidth(cur);
+		b = FreeImage_GetHeight(cur);
+	}
+
+	if (args->save.hmem) {
+		/* the encoder reads the window in place */
+		in = rfi_window(cur, l, t, r, b);
+		if (in) {
+			args->save.dib = in;
+			args->save.bpp = FreeImage_GetBPP(in);
+			rfi_save_nogvl(&args->save);
+			if (in != cur)
+				FreeImage_Unload(in);
+		}
+	} else if (r - l < (int)FreeImage_GetWidth(cur) || b - t < (int)FreeImage_GetHeight(cur)) {
+		args->result = FreeImage_Copy(cur, l, t, r, b);
+		args->failed = !args->result;
+	} else if (owned) {
+		args->result = cur;
+		return NULL;
+	} else {
+		args->result = rfi_bitmap_clone(cur);
+		args->failed = !args->result;
+	}
+out:
+	if (owned)
+		rfi_bitmap_unload(cur);
+	return NULL;
+}
+
+/* run the steps recorded by a Pipeline, see lib/rfreeimage/image.rb */
+static VALUE Image_pipeline(VALUE self, VALUE steps, VALUE type, VALUE opts)
+{
+	struct native_image *img;
+	struct rfi_pipeline_args args;
+	struct rfi_op *ops;
+	VALUE step, tmp;
+	ID kind;
+	long i, n, k, argc;
+	int w, h, *a, state;
+
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	RFI_CHECK_IMG(img);
+	Check_Type(steps, T_ARRAY);
+
+	n = RARRAY_LEN(steps);
+	ops = ALLOCV_N(struct rfi_op, tmp, n);
+	memset(ops, 0, sizeof(*ops) * n);
+	w = img->w;
+	h = img->h;
+	for (i = 0; i < n; i++) {
+		step = rb_ary_entry(steps, i);
+		Check_Type(step, T_ARRAY);
+		kind = rb_to_id(rb_ary_entry(step, 0));
+		argc = RARRAY_LEN(step) - 1;
+		a = ops[i].arg;
+		for (k = 0; k < argc && k < 4; k++)
+			a[k] = NUM2INT(rb_ary_entry(step, k + 1));
+		if (kind == rb_intern("crop") && argc == 4) {
+			ops[i].kind = RFI_OP_CROP;
+			if (a[0] < 0 || a[1] < 0 || a[2] <= a[0] || a[3] <= a[1] || a[2] > w || a[3] > h)
+				rb_raise(rb_eArgError, "Invalid boundary");
+			w = a[2] - a[0];
+			h = a[3] - a[1];
+		} else if (kind == rb_intern("resize") && argc == 3) {
+			ops[i].kind = RFI_OP_RESIZE;
+			if (a[0] <= 0 || a[1] <= 0)
+				rb_raise(rb_eArgError, "Invalid size");
+			if (a[2] < FILTER_BOX || a[2] > FILTER_LANCZOS3)
+				rb_raise(rb_eArgError, "Invalid image filter type");
+			w = a[0];
+			h = a[1];
+		} else if (kind == rb_intern("to_bpp") && argc == 1) {
+			ops[i].kind = RFI_OP_TO_BPP;
+			if (a[0] != 8 && a[0] != 24 && a[0] != 32)
+				rb_raise(rb_eArgError, "Invalid bpp");
+		} else {
+			rb_raise(rb_eArgError, "Invalid pipeline step");
+		}
+	}
+
+	memset(&args, 0, sizeof(args));
+	args.ops = ops;
+	args.n = n;
+	if (!NIL_P(type)) {
+		args.save.fif = rfi_format_from_type(type);
+		args.save.flags = rfi_save_flags(args.save.fif, opts);
+		args.save.hmem = FreeImage_OpenMemory(0, 0);
+		if (!args.save.hmem)
+			rb_raise(rb_eIOError, "Fail to allocate blob");
+	}
+	args.dib = rfi_image_dib(img);
+
+	state = rfi_image_nogvl(img, rfi_pipeline_nogvl, &args);
+	rfi_image_dib_done(img, args.dib);
+	ALLOCV_END(tmp);
+	if (state || args.failed || (args.save.hmem && !args.save.result)) {
+		if (args.save.hmem)
+			FreeImage_CloseMemory(args.save.hmem);
+		if (args.result)
+			rfi_bitmap_unload(args.result);
+		if (state)
+			rb_jump_tag(state);
+		if (args.failed)
+			rb_raise(Class_RFIError, "Fail to run pipeline");
+		rb_raise(rb_eIOError, "Fail to save image to blob");
+	}
+	if (args.save.hmem)
+		return rfi_memory_to_str(args.save.hmem);
+	return rfi_get_image(args.result);
+}
+
+#define ALLOC_NEW_IMAGE(__v, img) \
+	VALUE __v = Image_alloc(Class_Image);            \
+	struct native_image* img;                        \
+	TypedData_Get_Struct(__v, struct native_image, &rfi_image_type, img)   \
+
+static VALUE Image_ping(VALUE self, VALUE file)
+{
+	ALLOC_NEW_IMAGE(v, img);
+
+	rd_image(self, file, img, 0, 1, 0);
+	rfi_unload(img);
+
+	return v;
+}
+
+static VALUE Image_from_blob(int argc, VALUE *argv, VALUE self)
+{
+	ALLOC_NEW_IMAGE(v, img);
+
+	switch (argc)
+	{
+		case 1:
+			rd_image_blob(self, argv[0], img, 0, 0, 0);
+			break;
+		case 2:
+			rd_image_blob(self, argv[0], img, NUM2INT(argv[1]), 0, 0);
+			break;
+		case 3:
+			rd_image_blob(self, argv[0], img, NUM2INT(argv[1]), 0, NUM2INT(argv[2]));
+			break;
+		default:
+			rb_raise(rb_eArgError, "wrong number of arguments (%d for 1)", argc);
+			break;
+	}
+
+	return v;
+}
+
+static VALUE Image_ping_blob(VALUE self, VALUE blob)
+{
+	ALLOC_NEW_IMAGE(v, img);
+
+	rd_image_blob(self, blob, img, 0, 1, 0);
+	rfi_unload(img);
+
+	return v;
+}
+
+struct rfi_load_downscale_args {
+	struct rfi_load_args load;
+	int max_size;
+};
+
+/*
+ * The thumbnail path: a DCT scaled decode left as stored, then one area
+ * resize pass that also applies the Exif orientation, instead of a
+ * rotated copy at decode size for downscale to shrink
+ */
+static void *rfi_load_downscale_nogvl(void *ptr)
+{
+	struct rfi_load_downscale_args *args = ptr;
+	struct rfi_load_args *load = &args->load;
+	FIBITMAP *dib;
+	int o, w, h, mlen, scale = 1;
+
+	rfi_load_nogvl(load);
+	if (!(dib = load->result))
+		return NULL;
+	o = load->orientation;
+	w = FreeImage_GetWidth(dib);
+	h = FreeImage_GetHeight(dib);
+	if (o >= 5) {
+		w = FreeImage_GetHeight(dib);
+		h = FreeImage_GetWidth(dib);
+	}
+	/* as Image#downscale */
+	mlen = w > h ? w : h;
+	if (args->max_size > 0 && args->max_size < mlen)
+		scale = (mlen + args->max_size - 1) / args->max_size;
+	if (scale == 1 && o <= 1)
+		return NULL;
+
+	load->result = rfi_area_resize_oriented(dib, w / scale, h / scale, o);
+	rfi_bitmap_unload(dib);
+	if (!load->result)
+		load->err = RFI_ERR_LOAD;
+	return NULL;
+}
+
+/* see Image.load_downscale */
+static VALUE Image_load_downscale(VALUE self, VALUE src, VALUE blob, VALUE max_size)
+{
+	struct rfi_load_downscale_args args;
+	VALUE pinned = Qnil;
+	char *filename = NULL;
+	int state;
+	ALLOC_NEW_IMAGE(v, img);
+
+	Check_Type(src, T_STRING);
+	memset(&args, 0, sizeof(args));
+	args.max_size = NUM2INT(max_size);
+	if (args.max_size < 0 || args.max_size > 65535)
+		rb_raise(rb_eArgError, "Invalid max_size_hint");
+	args.load.bpp = 32;
+	args.load.max_size_hint = args.max_size;
+	args.load.defer_orientation = TRUE;
+	if (RTEST(blob)) {
+		pinned = rb_str_new_frozen(src);
+		args.load.data = (BYTE*)RSTRING_PTR(pinned);
+		args.load.size = RSTRING_LEN(pinned);
+	} else {
+		filename = rfi_value_to_str(src);
+		args.load.filename = filename;
+	}
+
+	state = rfi_nogvl(rfi_load_downscale_nogvl, &args);
+	free(filename);
+	RB_GC_GUARD(pinned);
+	rfi_finish_load(state, &args.load, img);
+	return v;
+}
+
+/* decode from any IO responding to read, see FreeImageIO above */
+static VALUE Image_read_io(int argc, VALUE *argv, VALUE self)
+{
+	struct rfi_load_args args;
+	struct rfi_stream st;
+	int bpp = 0, hint = 0, state;
+	ALLOC_NEW_IMAGE(v, img);
+
+	if (argc < 1 || argc > 3)
+		rb_raise(rb_eArgError, "wrong number of arguments (%d for 1..3)", argc);
+	if (argc > 1)
+		bpp = NUM2INT(argv[1]);
+	if (argc > 2)
+		hint = NUM2INT(argv[2]);
+	if (hint < 0 || hint > 65535)
+		rb_raise(rb_eArgError, "Invalid max_size_hint");
+
+	memset(&st, 0, sizeof(st));
+	st.io = argv[0];
+	memset(&args, 0, sizeof(args));
+	args.io = &rfi_stream_read_io;
+	args.handle = &st;
+	args.bpp = bpp > 0 ? bpp : 32;
+	args.max_size_hint = hint;
+
+	state = rfi_nogvl(rfi_load_nogvl, &args);
+	free(st.data);
+	if (!state && st.state) {
+		if (args.result)
+			rfi_bitmap_unload(args.result);
+		rb_jump_tag(st.state);
+	}
+	rfi_finish_load(state, &args, img);
+	return v;
+}
+
+/* point item at src, a blob (pinned in pins) or a file name */
+static void rfi_batch_source(VALUE src, int blob, VALUE pins, struct rfi_load_args *item)
+{
+	Check_Type(src, T_STRING);
+	if (blob) {
+		src = rb_str_new_frozen(src);
+		rb_ary_push(pins, src);
+		item->data = (BYTE*)RSTRING_PTR(src);
+		item->size = RSTRING_LEN(src);
+	} else {
+		item->filename = rfi_value_to_str(src);
+	}
+}
+
+/* see Image.load_region */
+static VALUE Image_load_region(VALUE self, VALUE src, VALUE blob, VALUE rect, VALUE scale,
+		VALUE bpp)
+{
+	struct rfi_load_args args;
+	VALUE pins = rb_ary_new();
+	int s = NUM2INT(scale), _bpp = NUM2INT(bpp);
+	int state, i;
+	ALLOC_NEW_IMAGE(v, img);
+
+	Check_Type(rect, T_ARRAY);
+	if (RARRAY_LEN(rect) != 4)
+		rb_raise(rb_eArgError, "Invalid boundary");
+	if (s != 1 && s != 2 && s != 4 && s != 8)
+		rb_raise(rb_eArgError, "Invalid scale");
+
+	memset(&args, 0, sizeof(args));
+	for (i = 0; i < 4; i++)
+		args.region[i] = NUM2INT(rb_ary_entry(rect, i));
+	args.scale = s;
+	args.bpp = _bpp > 0 ? _bpp : 32;
+	rfi_batch_source(src, RTEST(blob), pins, &args);
+
+	state = rfi_nogvl(rfi_load_nogvl, &args);
+	free((char*)args.filename);
+	RB_GC_GUARD(pins);
+	rfi_finish_load(state, &args, img);
+	return v;
+}
+
+struct rfi_batch {
+	VALUE sources;
+	struct rfi_load_args *items;
+	long n;
+	int threads;
+	/* sources are blobs, not file names */
+	int blob;
+};
+
+static void rfi_batch_item(void *arg, int i)
+{
+	struct rfi_batch *batch = arg;
+	rfi_load_nogvl(&batch->items[i]);
+}
+
+static void *rfi_batch_nogvl(void *ptr)
+{
+	struct rfi_batch *batch = ptr;
+	rfi_parallel_for((int)batch->n, batch->threads, rfi_batch_item, batch);
+	return NULL;
+}
+
+static VALUE rfi_batch_run(VALUE arg)
+{
+	struct rfi_batch *batch = (struct rfi_batch *)arg;
+	VALUE pins, ret, err;
+	long i;
+	int state;
+
+	pins = rb_ary_new2(batch->n);
+	for (i = 0; i < batch->n; i++) {
+		struct rfi_load_args *item = &batch->items[i];
+
+		rfi_batch_source(rb_ary_entry(batch->sources, i), batch->blob, pins, item);
+	}
+
+	state = rfi_nogvl(rfi_batch_nogvl, batch);
+	RB_GC_GUARD(pins);
+	if (state)
+		rb_jump_tag(state);
+
+	ret = rb_ary_new2(batch->n);
+	for (i = 0; i < batch->n; i++) {
+		struct rfi_load_args *item = &batch->items[i];
+
+		err = rfi_load_error(item);
+		if (NIL_P(err)) {
+			ALLOC_NEW_IMAGE(v, img);
+			rfi_set_handle(img, item->result);
+			img->fif = item->fif;
+			item->result = NULL;
+			rb_ary_push(ret, v);
+		} else {
+			rb_ary_push(ret, err);
+		}
+	}
+	return ret;
+}
+
+static VALUE rfi_batch_cleanup(VALUE arg)
+{
+	struct rfi_batch *batch = (struct rfi_batch *)arg;
+	long i;
+
+	for (i = 0; i < batch->n; i++) {
+		free((char*)batch->items[i].filename);
+		if (batch->items[i].result)
+			rfi_bitmap_unload(batch->items[i].result);
+	}
+	xfree(batch->items);
+	return Qnil;
+}
+
+static VALUE Image_load_batch(VALUE self, VALUE sources, VALUE blob, VALUE bpp,
+		VALUE max_size_hint, VALUE threads)
+{
+	struct rfi_batch batch;
+	int _bpp = NUM2INT(bpp);
+	int hint = NUM2INT(max_size_hint);
+	long i;
+
+	Check_Type(sources, T_ARRAY);
+	if (hint < 0 || hint > 65535)
+		rb_raise(rb_eArgError, "Invalid max_size_hint");
+
+	batch.sources = sources;
+	batch.n = RARRAY_LEN(sources);
+	batch.threads = NUM2INT(threads);
+	batch.blob = RTEST(blob);
+	if (batch.n > INT_MAX)
+		rb_raise(rb_eArgError, "too many images");
+
+	batch.items = ALLOC_N(struct rfi_load_args, batch.n);
+	MEMZERO(batch.items, struct rfi_load_args, batch.n);
+	for (i = 0; i < batch.n; i++) {
+		batch.items[i].bpp = _bpp ? (unsigned int)_bpp : 32;
+		batch.items[i].max_size_hint = hint;
+	}
+
+	return rb_ensure(rfi_batch_run, (VALUE)&batch, rfi_batch_cleanup, (VALUE)&batch);
+}
+
+/*
+ * Probing reads only the headers, see rfi_probe.h. Formats it doesn't
+ * know go to a FreeImage ping instead, without orientation.
+ */
+struct rfi_probe_item {
+	struct rfi_load_args load;
+	struct rfi_probe_info info;
+};
+
+struct rfi_probe_batch {
+	VALUE sources;
+	struct rfi_probe_item *items;
+	long n;
+	int threads;
+	int blob;
+};
+
+static void *rfi_probe_nogvl(void *ptr)
+{
+	struct rfi_probe_item *item = ptr;
+	struct rfi_load_args *load = &item->load;
+	int ret;
+
+	if (load->filename)
+		ret = rfi_probe_file(load->filename, &item->info);
+	else
+		ret = rfi_probe_memory(load->data, load->size, &item->info);
+	if (!ret)
+		return NULL;
+
+	load->ping = 1;
+	rfi_load_nogvl(load);
+	if (load->result) {
+		item->info.fif = load->fif;
+		item->info.width = FreeImage_GetWidth(load->result);
+		item->info.height = FreeImage_GetHeight(load->result);
+		item->info.orientation = 0;
+		rfi_bitmap_unload(load->result);
+		load->result = NULL;
+	}
+	return NULL;
+}
+
+/* a Hash for a probed image, or its exception */
+static VALUE rfi_probe_result(struct rfi_probe_item *item)
+{
+	VALUE h, err = rfi_load_error(&item->load);
+	const char *p;
+
+	if (!NIL_P(err))
+		return err;
+	h = rb_hash_new();
+	p = FreeImage_GetFormatFromFIF(item->info.fif);
+	rb_hash_aset(h, ID2SYM(rb_intern("format")), rb_str_new_cstr(p ? p : ""));
+	rb_hash_aset(h, ID2SYM(rb_intern("width")), INT2NUM(item->info.width));
+	rb_hash_aset(h, ID2SYM(rb_intern("height")), INT2NUM(item->info.height));
+	rb_hash_aset(h, ID2SYM(rb_intern("orientation")), INT2NUM(item->info.orientation));
+	return h;
+}
+
+/* see Image.probe */
+static VALUE Image_probe(VALUE self, VALUE src, VALUE blob)
+{
+	struct rfi_probe_item item;
+	VALUE pins = rb_ary_new(), ret;
+	int state;
+
+	memset(&item, 0, sizeof(item));
+	rfi_batch_source(src, RTEST(blob), pins, &item.load);
+	state = rfi_nogvl(rfi_probe_nogvl, &item);
+	free((char*)item.load.filename);
+	RB_GC_GUARD(pins);
+	if (state)
+		rb_jump_tag(state);
+	ret = rfi_probe_result(&item);
+	if (rb_obj_is_kind_of(ret, rb_eException))
+		rb_exc_raise(ret);
+	return ret;
+}
+
+static void rfi_probe_batch_item(void *arg, int i)
+{
+	struct rfi_probe_batch *batch = arg;
+	rfi_probe_nogvl(&batch->items[i]);
+}
+
+static void *rfi_probe_batch_nogvl(void *ptr)
+{
+	struct rfi_probe_batch *batch = ptr;
+	rfi_parallel_for((int)batch->n, batch->threads, rfi_probe_batch_item, batch);
+	return NULL;
+}
+
+static VALUE rfi_probe_batch_run(VALUE arg)
+{
+	struct rfi_probe_batch *batch = (struct rfi_probe_batch *)arg;
+	VALUE pins, ret;
+	long i;
+	int state;
+
+	pins = rb_ary_new2(batch->n);
+	for (i = 0; i < batch->n; i++)
+		rfi_batch_source(rb_ary_entry(batch->sources, i), batch->blob, pins,
+				&batch->items[i].load);
+
+	state = rfi_nogvl(rfi_probe_batch_nogvl, batch);
+	RB_GC_GUARD(pins);
+	if (state)
+		rb_jump_tag(state);
+
+	ret = rb_ary_new2(batch->n);
+	for (i = 0; i < batch->n; i++)
+		rb_ary_push(ret, rfi_probe_result(&batch->items[i]));
+	return ret;
+}
+
+static VALUE rfi_probe_batch_cleanup(VALUE arg)
+{
+	struct rfi_probe_batch *batch = (struct rfi_probe_batch *)arg;
+	long i;
+
+	for (i = 0; i < batch->n; i++)
+		free((char*)batch->items[i].load.filename);
+	xfree(batch->items);
+	return Qnil;
+}
+
+static VALUE Image_ping_batch(VALUE self, VALUE sources, VALUE blob, VALUE threads)
+{
+	struct rfi_probe_batch batch;
+
+	Check_Type(sources, T_ARRAY);
+	batch.sources = sources;
+	batch.n = RARRAY_LEN(sources);
+	batch.threads = NUM2INT(threads);
+	batch.blob = RTEST(blob);
+	if (batch.n > INT_MAX)
+		rb_raise(rb_eArgError, "too many images");
+
+	batch.items = ALLOC_N(struct rfi_probe_item, batch.n);
+	MEMZERO(batch.items, struct rfi_probe_item, batch.n);
+	return rb_ensure(rfi_probe_batch_run, (VALUE)&batch, rfi_probe_batch_cleanup, (VALUE)&batch);
+}
+
+/*
+ * Lossless JPEG transforms run through FreeImageIO, from the source blob
+ * or file into a growing buffer, in which the Exif orientation can be
+ * reset before it is returned or written out.
+ */
+struct rfi_memio {
+	BYTE *data;
+	size_t len;
+	size_t cap;
+	size_t pos;
+};
+
+static unsigned DLL_CALLCONV rfi_memio_read(void *buffer, unsigned size, unsigned count, fi_handle handle)
+{
+	struct rfi_memio *m = handle;
+	size_t n;
+
+	if (!size || m->pos >= m->len)
+		return 0;
+	n = (m->len - m->pos) / size;
+	if (n > count)
+		n = count;
+	memcpy(buffer, m->data + m->pos, n * size);
+	m->pos += n * size;
+	return n;
+}
+
+static unsigned DLL_CALLCONV rfi_memio_write(void *buffer, unsigned size, unsigned count, fi_handle handle)
+{
+	struct rfi_memio *m = handle;
+	size_t n = (size_t)size * count, cap;
+	BYTE *data;
+
+	if (m->pos + n > m->cap) {
+		cap = m->cap ? m->cap : 64 << 10;
+		while (cap < m->pos + n)
+			cap *= 2;
+		if (!(data = realloc(m->data, cap)))
+			return 0;
+		m->data = data;
+		m->cap = cap;
+	}
+	memcpy(m->data + m->pos, buffer, n);
+	m->pos += n;
+	if (m->pos > m->len)
+		m->len = m->pos;
+	return count;
+}
+
+static int DLL_CALLCONV rfi_memio_seek(fi_handle handle, long offset, int origin)
+{
+	struct rfi_memio *m = handle;
+	long base = origin == SEEK_SET ? 0 : origin == SEEK_CUR ? (long)m->pos : (long)m->len;
+
+	if (base + offset < 0 || (size_t)(base + offset) > m->len)
+		return -1;
+	m->pos = base + offset;
+	return 0;
+}
+
+static long DLL_CALLCONV rfi_memio_tell(fi_handle handle)
+{
+	return ((struct rfi_memio *)handle)->pos;
+}
+
+static FreeImageIO rfi_memio_io = {
+	rfi_memio_read, rfi_memio_write, rfi_memio_seek, rfi_memio_tell,
+};
+
+static unsigned DLL_CALLCONV rfi_file_read(void *buffer, unsigned size, unsigned count, fi_handle handle)
+{
+	return fread(buffer, size, count, handle);
+}
+
+static int DLL_CALLCONV rfi_file_seek(fi_handle handle, long offset, int origin)
+{
+	return fseek(handle, offset, origin);
+}
+
+static long DLL_CALLCONV rfi_file_tell(fi_handle handle)
+{
+	return ftell(handle);
+}
+
+static FreeImageIO rfi_file_io = {
+	rfi_file_read, NULL, rfi_file_seek, rfi_file_tell,
+};
+
+/*
+ * The eight lossless operations, in FREE_IMAGE_JPEG_OPERATION order, as
+ * a transpose, then horizontal and vertical flips
+ */
+static const struct {
+	const char *name;
+	int t, fx, fy;
+} rfi_jpeg_ops[] = {
+	{ "none", 0, 0, 0 },
+	{ "flip_horizontal", 0, 1, 0 },
+	{ "flip_vertical", 0, 0, 1 },
+	{ "transpose", 1, 0, 0 },
+	{ "transverse", 1, 1, 1 },
+	{ "rotate_90", 1, 1, 0 },
+	{ "rotate_180", 0, 1, 1 },
+	{ "rotate_270", 1, 0, 1 },
+};
+
+/* what shows a JPEG of Exif orientation 0..8 the way it is meant to */
+static const FREE_IMAGE_JPEG_OPERATION rfi_orientation_ops[] = {
+	FIJPEG_OP_NONE, FIJPEG_OP_NONE, FIJPEG_OP_FLIP_H, FIJPEG_OP_ROTATE_180, FIJPEG_OP_FLIP_V,
+	FIJPEG_OP_TRANSPOSE, FIJPEG_OP_ROTATE_90, FIJPEG_OP_TRANSVERSE, FIJPEG_OP_ROTATE_270,
+};
+
+/* a, then b, as one operation */
+static FREE_IMAGE_JPEG_OPERATION rfi_jpeg_compose(FREE_IMAGE_JPEG_OPERATION a, FREE_IMAGE_JPEG_OPERATION b)
+{
+	int t, fx, fy, i;
+
+	t = rfi_jpeg_ops[a].t ^ rfi_jpeg_ops[b].t;
+	/* a transpose after a's flips turns them into flips of the other axis */
+	fx = rfi_jpeg_ops[b].t ? rfi_jpeg_ops[a].fy : rfi_jpeg_ops[a].fx;
+	fy = rfi_jpeg_ops[b].t ? rfi_jpeg_ops[a].fx : rfi_jpeg_ops[a].fy;
+	fx ^= rfi_jpeg_ops[b].fx;
+	fy ^= rfi_jpeg_ops[b].fy;
+	for (i = 0; i < (int)(sizeof(rfi_jpeg_ops) / sizeof(rfi_jpeg_ops[0])); i++)
+		if (rfi_jpeg_ops[i].t == t && rfi_jpeg_ops[i].fx == fx && rfi_jpeg_ops[i].fy == fy)
+			break;
+	return (FREE_IMAGE_JPEG_OPERATION)i;
+}
+
+enum rfi_transform_error {
+	RFI_TRANSFORM_OK = 0,
+	RFI_TRANSFORM_FORMAT,
+	RFI_TRANSFORM_FAIL,
+	RFI_TRANSFORM_SAVE,
+};
+
+struct rfi_jpeg_transform_args {
+	/* either a file name or a blob */
+	const char *filename;
+	BYTE *data;
+	size_t size;
+	/* write there, rather than return the result */
+	const char *dst;
+	FREE_IMAGE_JPEG_OPERATION op;
+	/* with crop, (left, top, right, bottom) of the transformed image */
+	int rect[4];
+	int crop;
+	BOOL perfect;
+	int orient;
+
+	struct rfi_memio out;
+	enum rfi_transform_error err;
+};
+
+static void *rfi_jpeg_transform_nogvl(void *ptr)
+{
+	struct rfi_jpeg_transform_args *args = ptr;
+	struct rfi_probe_info info;
+	struct rfi_memio src;
+	FREE_IMAGE_JPEG_OPERATION op = args->op;
+	FILE *fp = NULL;
+	fi_handle handle;
+	FreeImageIO *io;
+	BOOL ok;
+	int *r = args->rect;
+
+	if (args->filename)
+		rfi_probe_file(args->filename, &info);
+	else
+		rfi_probe_memory(args->data, args->size, &info);
+	if (info.fif != FIF_JPEG) {
+		args->err = RFI_TRANSFORM_FORMAT;
+		return NULL;
+	}
+	/* the operation applies to the image as it shows */
+	if (args->orient)
+		op = rfi_jpeg_compose(rfi_orientation_ops[info.orientation], op);
+
+	if (args->filename) {
+		if (!(fp = fopen(args->filename, "rb"))) {
+			args->err = RFI_TRANSFORM_FORMAT;
+			return NULL;
+		}
+		io = &rfi_file_io;
+		handle = fp;
+	} else {
+		memset(&src, 0, sizeof(src));
+		src.data = args->data;
+		src.len = args->size;
+		io = &rfi_memio_io;
+		handle = &src;
+	}
+	ok = FreeImage_JPEGTransformFromHandle(io, handle, &rfi_memio_io, &args->out, op,
+			args->crop ? &r[0] : NULL, args->crop ? &r[1] : NULL,
+			args->crop ? &r[2] : NULL, args->crop ? &r[3] : NULL, args->perfect);
+	if (fp)
+		fclose(fp);
+	if (!ok) {
+		args->err = RFI_TRANSFORM_FAIL;
+		return NULL;
+	}
+	if (args->orient && info.orientation > 1)
+		rfi_jpeg_clear_orientation(args->out.data, args->out.len);
+
+	if (args->dst) {
+		if (!(fp = fopen(args->dst, "wb"))) {
+			args->err = RFI_TRANSFORM_SAVE;
+			return NULL;
+		}
+		if (fwrite(args->out.data, 1, args->out.len, fp) != args->out.len)
+			args->err = RFI_TRANSFORM_SAVE;
+		if (fclose(fp))
+			args->err = RFI_TRANSFORM_SAVE;
+	}
+	return NULL;
+}
+
+/* see Image.jpeg_transform */
+static VALUE Image_jpeg_transform(VALUE self, VALUE src, VALUE blob, VALUE dst, VALUE op,
+		VALUE rect, VALUE perfect, VALUE orient)
+{
+	struct rfi_jpeg_transform_args args;
+	VALUE pins = rb_ary_new(), ret = Qnil;
+	struct rfi_load_args load;
+	char *dst_name = NULL;
+	int state, i;
+	ID id;
+
+	memset(&args, 0, sizeof(args));
+	Check_Type(op, T_SYMBOL);
+	id = SYM2ID(op);
+	for (i = 0; i < (int)(sizeof(rfi_jpeg_ops) / sizeof(rfi_jpeg_ops[0])); i++)
+		if (id == rb_intern(rfi_jpeg_ops[i].name))
+			break;
+	if (i == (int)(sizeof(rfi_jpeg_ops) / sizeof(rfi_jpeg_ops[0])))
+		rb_raise(rb_eArgError, "Invalid JPEG operation");
+	args.op = (FREE_IMAGE_JPEG_OPERATION)i;
+	if (!NIL_P(rect)) {
+		Check_Type(rect, T_ARRAY);
+		if (RARRAY_LEN(rect) != 4)
+			rb_raise(rb_eArgError, "Invalid boundary");
+		for (i = 0; i < 4; i++)
+			args.rect[i] = NUM2INT(rb_ary_entry(rect, i));
+		if (args.rect[0] < 0 || args.rect[1] < 0 || args.rect[2] <= args.rect[0]
+				|| args.rect[3] <= args.rect[1])
+			rb_raise(rb_eArgError, "Invalid boundary");
+		args.crop = 1;
+	}
+	args.perfect = RTEST(perfect);
+	args.orient = RTEST(orient);
+
+	memset(&load, 0, sizeof(load));
+	rfi_batch_source(src, RTEST(blob), pins, &load);
+	args.filename = load.filename;
+	args.data = load.data;
+	args.size = load.size;
+	if (!NIL_P(dst))
+		dst_name = rfi_value_to_str(dst);
+	args.dst = dst_name;
+
+	state = rfi_nogvl(rfi_jpeg_transform_nogvl, &args);
+	free((char*)load.filename);
+	free(dst_name);
+	RB_GC_GUARD(pins);
+	if (!state && !args.err && !args.dst)
+		ret = rb_str_new((const char *)args.out.data, args.out.len);
+	free(args.out.data);
+	if (state)
+		rb_jump_tag(state);
+	switch (args.err) {
+		case RFI_TRANSFORM_FORMAT:
+			rb_raise(rb_eIOError, "Invalid JPEG");
+		case RFI_TRANSFORM_FAIL:
+			rb_raise(rb_eIOError, "Fail to transform JPEG");
+		case RFI_TRANSFORM_SAVE:
+			rb_raise(rb_eIOError, "Fail to save image");
+		default:
+			break;
+	}
+	return ret;
+}
+
+/*
+ * Async jobs run one decode or encode on the thread pool. Completion is
+ * signalled through a pipe, so a waiting thread sleeps in the io wait and
+ * a fiber scheduler can keep running other fibers meanwhile.
+ */
+enum rfi_job_kind {
+	RFI_JOB_LOAD,
+	RFI_JOB_ENCODE,
+};
+
+struct rfi_job {
+	struct rfi_task task;
+	enum rfi_job_kind kind;
+	/* a byte is written to fds[1] when the work is done */
+	int fds[2];
+	/* results are ready */
+	int finished;
+	/* set by the worker last, nothing touches the job after that */
+	int signalled;
+	/* img->busy has been dropped */
+	int settled;
+	/* pinned blob or source Image */
+	VALUE src;
 	struct native_image *img;
-	FIBITMAP *nh;
-	int bpp = NUM2INT(_bpp);
-	Data_Get_Struct(self, struct native_image, img);
-	RFI_CHECK_IMG(img);
-	if (bpp == img->bpp)
-		return self;
+	struct rfi_load_args load;
+	struct rfi_save_args save;
+	/* upright copy save.dib reads, of a top-down img */
+	FIBITMAP *upright;
+	/* Image, String or exception, once value was called */
+	VALUE value;
+};
 
-	nh = convert_bpp(img->handle, bpp);
-	if (!nh) rb_raise(rb_eArgError, "Invalid bpp");
+/* jobs still running, they and what they pin must not be collected */
+static VALUE rfi_jobs;
 
-	return rfi_get_image(nh);
+static void Job_mark(void *ptr)
+{
+	struct rfi_job *job = ptr;
+	rb_gc_mark(job->src);
+	rb_gc_mark(job->value);
 }
 
-static VALUE Image_rotate(VALUE self, VALUE _angle)
+static void Job_free(void *ptr)
 {
-	struct native_image *img;
-	FIBITMAP *nh;
-	double angle = NUM2DBL(_angle);
-
-	Data_Get_Struct(self, struct native_image, img);
-	RFI_CHECK_IMG(img);
-	nh = FreeImage_Rotate(img->handle, angle, NULL);
-	return rfi_get_image(nh);
+	struct rfi_job *job = ptr;
+	if (job->fds[0] >= 0)
+		close(job->fds[0]);
+	if (job->fds[1] >= 0)
+		close(job->fds[1]);
+	if (job->load.result)
+		rfi_bitmap_unload(job->load.result);
+	if (job->save.hmem)
+		FreeImage_CloseMemory(job->save.hmem);
+	if (job->upright)
+		rfi_bitmap_unload(job->upright);
+	free(job);
 }
 
-static VALUE Image_clone(VALUE self)
+static const rb_data_type_t rfi_job_type = {
+	"RFreeImage::Job",
+	{ Job_mark, Job_free, NULL, },
+	0, 0, RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static void rfi_job_run(void *arg)
 {
-	struct native_image *img;
-	FIBITMAP *nh;
+	struct rfi_job *job = arg;
+	ssize_t r;
 
-	Data_Get_Struct(self, struct native_image, img);
-	RFI_CHECK_IMG(img);
-	nh = FreeImage_Clone(img->handle);
-	return rfi_get_image(nh);
+	if (job->kind == RFI_JOB_LOAD)
+		rfi_load_nogvl(&job->load);
+	else
+		rfi_save_nogvl(&job->save);
+	/* the fd only turns readable once finished is visible */
+	__atomic_store_n(&job->finished, 1, __ATOMIC_RELEASE);
+	do {
+		r = write(job->fds[1], "", 1);
+	} while (r < 0 && errno == EINTR);
+	__atomic_store_n(&job->signalled, 1, __ATOMIC_RELEASE);
 }
 
-static VALUE Image_rescale(VALUE self, VALUE dst_width, VALUE dst_height, VALUE filter_type)
+static int rfi_job_finished(struct rfi_job *job)
 {
-	struct native_image *img;
-	FIBITMAP *nh;
-	int w = NUM2INT(dst_width);
-	int h = NUM2INT(dst_height);
-	int f = NUM2INT(filter_type);
-	if (w <= 0 || h <= 0)
-		rb_raise(rb_eArgError, "Invalid size");
-
-	if (f < FILTER_BOX || f > FILTER_LANCZOS3)
-		rb_raise(rb_eArgError, "Invalid image filter type");
-
-	Data_Get_Struct(self, struct native_image, img);
-	RFI_CHECK_IMG(img);
-
-	nh = FreeImage_Rescale(img->handle, w, h, f);
-	return rfi_get_image(nh);
+	return __atomic_load_n(&job->finished, __ATOMIC_ACQUIRE);
 }
 
-static VALUE Image_downscale(VALUE self, VALUE max_size) {
-	// down-sample resize
-	struct native_image *img;
-	FIBITMAP *nh;
-	int i;
-	int j;
-	int w;
-	int h;
-	int scale;
-	int mlen;
-	int msize = NUM2INT(max_size);
-
-	Data_Get_Struct(self, struct native_image, img);
-	RFI_CHECK_IMG(img);
-
-	mlen = img->w > img->h ? img->w : img->h;
-	if (msize <= 0 || msize >= mlen) {
-		nh = FreeImage_Copy(img->handle, 0, 0, img->w, img->h);
-	} else {
-		unsigned char *ph;
-		unsigned char *pnh;
-		int dst_stride;
-		if (img->bpp != 8 && img->bpp != 32)
-			rb_raise(rb_eArgError, "bpp not supported");
-
-		scale = (mlen + msize - 1)  / msize;
-		w = img->w / scale;
-		h = img->h / scale;
-		nh = FreeImage_Allocate(w, h, img->bpp, 0, 0, 0);
-		if (!nh)
-			rb_raise(rb_eArgError, "fail to allocate image");
-
-		ph = FreeImage_GetBits(img->handle);
-		pnh = FreeImage_GetBits(nh);
-		dst_stride = FreeImage_GetPitch(nh);
-		if (img->bpp == 8) {
-			for(i = 0; i < h; i++) {
-				for(j = 0; j < w; j++)
-					*(pnh + j) = *(ph + j * scale);
-				ph += img->stride * scale;
-				pnh += dst_stride;
-			}
-		} else if (img->bpp == 32) {
-			for(i = 0; i < h; i++) {
-				for(j = 0; j < w; j++)
-					*((unsigned int*)pnh + j) = *((unsigned int*)ph + j * scale);
-				ph += img->stride * scale;
-				pnh += dst_stride;
-			}
-		}
+/* give the source image back once the encoder is done with it */
+static void rfi_job_settle(struct rfi_job *job)
+{
+	if (job->settled || !rfi_job_finished(job))
+		return;
+	if (job->img)
+		job->img->busy--;
+	if (job->upright) {
+		rfi_bitmap_unload(job->upright);
+		job->upright = NULL;
 	}
-	return rfi_get_image(nh);
+	job->settled = 1;
 }
 
-static VALUE Image_flip_horizontal(VALUE self) {
-	struct native_image *img;
-	FIBITMAP *nh;
+/* drop jobs the workers are done with from rfi_jobs */
+static void rfi_jobs_reap(void)
+{
+	struct rfi_job *job;
+	long i, j = 0;
+	VALUE v;
 
-	Data_Get_Struct(self, struct native_image, img);
-	RFI_CHECK_IMG(img);
-	nh = FreeImage_Clone(img->handle);
-	if(FreeImage_FlipHorizontal(nh) == FALSE)
-		rb_raise(Class_RFIError, "Malloc Failed");
-	return rfi_get_image(nh);
+	for (i = 0; i < RARRAY_LEN(rfi_jobs); i++) {
+		v = RARRAY_AREF(rfi_jobs, i);
+		TypedData_Get_Struct(v, struct rfi_job, &rfi_job_type, job);
+		rfi_job_settle(job);
+		if (!__atomic_load_n(&job->signalled, __ATOMIC_ACQUIRE))
+			rb_ary_store(rfi_jobs, j++, v);
+	}
+	rb_ary_resize(rfi_jobs, j);
 }
 
-static VALUE Image_flip_vertical(VALUE self) {
-	struct native_image *img;
-	FIBITMAP *nh;
+static VALUE rfi_job_new(enum rfi_job_kind kind, struct rfi_job **out)
+{
+	struct rfi_job *job;
+	VALUE v;
 
-	Data_Get_Struct(self, struct native_image, img);
-	RFI_CHECK_IMG(img);
-	nh = FreeImage_Clone(img->handle);
-	if(FreeImage_FlipVertical(nh) == FALSE)
-		rb_raise(Class_RFIError, "Malloc Failed");
-	return rfi_get_image(nh);
+	job = malloc(sizeof(struct rfi_job));
+	if (!job)
+		rb_memerror();
+	memset(job, 0, sizeof(struct rfi_job));
+	job->kind = kind;
+	job->fds[0] = job->fds[1] = -1;
+	job->src = Qnil;
+	job->value = Qnil;
+	job->task.fn = rfi_job_run;
+	job->task.arg = job;
+	v = TypedData_Wrap_Struct(Class_Job, &rfi_job_type, job);
+	if (rb_cloexec_pipe(job->fds) < 0)
+		rb_sys_fail("pipe");
+	rb_update_max_fd(job->fds[0]);
+	rb_update_max_fd(job->fds[1]);
+	*out = job;
+	return v;
 }
 
-static VALUE Image_crop(VALUE self, VALUE _left, VALUE _top, VALUE _right, VALUE _bottom)
+static VALUE rfi_job_submit(VALUE v, struct rfi_job *job)
 {
-	struct native_image *img;
-	FIBITMAP *nh;
-	int left = NUM2INT(_left);
-	int top = NUM2INT(_top);
-	int right = NUM2INT(_right);
-	int bottom = NUM2INT(_bottom);
-	Data_Get_Struct(self, struct native_image, img);
-	RFI_CHECK_IMG(img);
-
-	if (left < 0 || top < 0
-		|| right < left || bottom < top
-		|| bottom > img->h || right > img->w )
-		rb_raise(rb_eArgError, "Invalid boundary");
-
-	nh = FreeImage_Copy(img->handle, left, top, right, bottom);
-	return rfi_get_image(nh);
+	rfi_jobs_reap();
+	rb_ary_push(rfi_jobs, v);
+	if (job->img)
+		job->img->busy++;
+	/* no worker thread available, do it inline */
+	if (rfi_pool_submit(&job->task) < 0)
+		rfi_job_run(job);
+	return v;
 }
 
-#define ALLOC_NEW_IMAGE(__v, img) \
-	VALUE __v = Image_alloc(Class_Image);            \
-	struct native_image* img;                        \
-	Data_Get_Struct(__v, struct native_image, img)   \
-
-static VALUE Image_ping(VALUE self, VALUE file)
+static VALUE Image_load_job(int argc, VALUE *argv, VALUE self)
 {
-	ALLOC_NEW_IMAGE(v, img);
+	VALUE blob, bpp, max_size_hint, v;
+	struct rfi_job *job;
+	int _bpp, hint;
 
-	rd_image(self, file, img, 0, 1, 0);
-	if (img->handle)
-		FreeImage_Unload(img->handle);
-	img->handle = NULL;
+	rb_scan_args(argc, argv, "12", &blob, &bpp, &max_size_hint);
+	Check_Type(blob, T_STRING);
+	_bpp = NIL_P(bpp) ? 0 : NUM2INT(bpp);
+	hint = NIL_P(max_size_hint) ? 0 : NUM2INT(max_size_hint);
+	if (hint < 0 || hint > 65535)
+		rb_raise(rb_eArgError, "Invalid max_size_hint");
 
-	return v;
+	v = rfi_job_new(RFI_JOB_LOAD, &job);
+	job->src = rb_str_new_frozen(blob);
+	job->load.data = (BYTE*)RSTRING_PTR(job->src);
+	job->load.size = RSTRING_LEN(job->src);
+	job->load.bpp = _bpp > 0 ? _bpp : 32;
+	job->load.max_size_hint = hint;
+	return rfi_job_submit(v, job);
 }
 
-static VALUE Image_from_blob(int argc, VALUE *argv, VALUE self)
+static VALUE Image_to_blob_job(int argc, VALUE *argv, VALUE self)
 {
-	ALLOC_NEW_IMAGE(v, img);
+	struct native_image* img;
+	struct rfi_job *job;
+	FREE_IMAGE_FORMAT fif;
+	VALUE v, type, opts;
+	int flags;
 
-	switch (argc)
-	{
-		case 1:
-			rd_image_blob(self, argv[0], img, 0, 0, 0);
-			break;
-		case 2:
-			rd_image_blob(self, argv[0], img, NUM2INT(argv[1]), 0, 0);
-			break;
-		case 3:
-			rd_image_blob(self, argv[0], img, NUM2INT(argv[1]), 0, NUM2INT(argv[2]));
-			break;
-		default:
-			rb_raise(rb_eArgError, "wrong number of arguments (%d for 1)", argc);
-			break;
-	}
+	rb_scan_args(argc, argv, "11", &type, &opts);
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	RFI_CHECK_IMG(img);
+	fif = rfi_format_from_type(type);
+	flags = rfi_save_flags(fif, opts);
 
-	return v;
+	v = rfi_job_new(RFI_JOB_ENCODE, &job);
+	job->save.hmem = FreeImage_OpenMemory(0, 0);
+	if (!job->save.hmem)
+		rb_raise(rb_eIOError, "Fail to allocate blob");
+	job->save.fif = fif;
+	job->save.flags = flags;
+	job->save.dib = rfi_image_dib(img);
+	if (job->save.dib != img->handle)
+		job->upright = job->save.dib;
+	job->save.bpp = img->bpp;
+	job->src = self;
+	job->img = img;
+	return rfi_job_submit(v, job);
 }
 
-static VALUE Image_ping_blob(VALUE self, VALUE blob)
+static VALUE Job_done(VALUE self)
 {
-	ALLOC_NEW_IMAGE(v, img);
+	struct rfi_job *job;
+	TypedData_Get_Struct(self, struct rfi_job, &rfi_job_type, job);
+	if (!rfi_job_finished(job))
+		return Qfalse;
+	rfi_job_settle(job);
+	return Qtrue;
+}
 
-	rd_image_blob(self, blob, img, 0, 1, 0);
-	if (img->handle)
-		FreeImage_Unload(img->handle);
-	img->handle = NULL;
+static VALUE Job_fileno(VALUE self)
+{
+	struct rfi_job *job;
+	TypedData_Get_Struct(self, struct rfi_job, &rfi_job_type, job);
+	return INT2NUM(job->fds[0]);
+}
 
-	return v;
+static VALUE Job_value(VALUE self)
+{
+	struct rfi_job *job;
+	VALUE err;
+
+	TypedData_Get_Struct(self, struct rfi_job, &rfi_job_type, job);
+	if (NIL_P(job->value)) {
+		/* goes through the fiber scheduler when one is set */
+		while (!rfi_job_finished(job))
+			rb_wait_for_single_fd(job->fds[0], RB_WAITFD_IN, NULL);
+		rfi_job_settle(job);
+		rfi_jobs_reap();
+
+		if (job->kind == RFI_JOB_LOAD) {
+			err = rfi_load_error(&job->load);
+			if (NIL_P(err)) {
+				ALLOC_NEW_IMAGE(v, img);
+				rfi_set_handle(img, job->load.result);
+				img->fif = job->load.fif;
+				job->load.result = NULL;
+				job->value = v;
+			} else {
+				job->value = err;
+			}
+		} else if (job->save.result) {
+			FIMEMORY *hmem = job->save.hmem;
+			job->save.hmem = NULL;
+			job->value = rfi_memory_to_str(hmem);
+		} else {
+			job->value = rb_exc_new_cstr(rb_eIOError, "Fail to save image to blob");
+		}
+	}
+	if (rb_obj_is_kind_of(job->value, rb_eException))
+		rb_exc_raise(job->value);
+	return job->value;
 }
 
 static VALUE Image_from_bytes(VALUE self, VALUE bytes, VALUE width,
@@ -694,26 +3112,27 @@ static VALUE Image_from_bytes(VALUE self, VALUE bytes, VALUE width,
 	unsigned char *p;
 	int i;
 	int src_stride = NUM2INT(stride);
+	int line;
 	FIBITMAP *h;
 
 	ALLOC_NEW_IMAGE(v, img);
 
-	if (_bpp != 8 && _bpp != 32)
-		rb_raise(rb_eArgError, "bpp must be 8 or 32");
+	if (_bpp != 8 && _bpp != 24 && _bpp != 32)
+		rb_raise(rb_eArgError, "bpp must be 8, 24 or 32");
 	Check_Type(bytes, T_STRING);
 	f_len = RSTRING_LEN(bytes);
 	if (f_len < (long)src_stride * NUM2INT(height))
 		rb_raise(rb_eArgError, "buffer too small");
+	/* rows of 24 bpp data are usually packed, tighter than the pitch */
+	line = NUM2INT(width) * (_bpp / 8);
+	if (src_stride < line)
+		rb_raise(rb_eArgError, "stride too small");
 
-	h = FreeImage_Allocate(NUM2INT(width), NUM2INT(height), _bpp, 0, 0, 0);
+	h = rfi_bitmap_allocate(NUM2INT(width), NUM2INT(height), _bpp);
 	if (!h)
 		rb_raise(rb_eArgError, "fail to allocate image");
 
-	img->handle = h;
-	img->w = FreeImage_GetWidth(h);
-	img->h = FreeImage_GetHeight(h);
-	img->bpp = FreeImage_GetBPP(h);
-	img->stride = FreeImage_GetPitch(h);
+	rfi_set_handle(img, h);
 	img->fif = FIF_BMP;
 
 	/* up-side-down */
@@ -721,54 +3140,116 @@ static VALUE Image_from_bytes(VALUE self, VALUE bytes, VALUE width,
 	ptr = RSTRING_PTR(bytes) + img->h * src_stride;
 	for(i = 0; i < img->h; i++) {
 		ptr -= src_stride;
-		memcpy(p, ptr, img->stride);
+		memcpy(p, ptr, line);
 		p += img->stride;
 	}
 
 	return v;
 }
 
+/*
+ * wrap_bytes(bytes, width, height, stride, bpp, top_down = true): like
+ * from_bytes but the image keeps using the (frozen) String's memory.
+ * FreeImage only handles bottom-up rows in place: FreeImage calls read
+ * a temporary upright copy of top-down ones, which stay wrapped until
+ * the image is drawn on or changed in place.
+ */
+static VALUE Image_wrap_bytes(int argc, VALUE *argv, VALUE self)
+{
+	VALUE bytes, width, height, stride, bpp, top_down, pin;
+	int w, h, _bpp, pitch;
+	FIBITMAP *dib;
+
+	rb_scan_args(argc, argv, "51", &bytes, &width, &height, &stride, &bpp, &top_down);
+	w = NUM2INT(width);
+	h = NUM2INT(height);
+	pitch = NUM2INT(stride);
+	_bpp = NUM2INT(bpp);
+	if (w <= 0 || h <= 0)
+		rb_raise(rb_eArgError, "Invalid size");
+	if (_bpp != 8 && _bpp != 24 && _bpp != 32)
+		rb_raise(rb_eArgError, "bpp must be 8, 24 or 32");
+	Check_Type(bytes, T_STRING);
+	if (RSTRING_LEN(bytes) < (long)pitch * h)
+		rb_raise(rb_eArgError, "buffer too small");
+	if (pitch < w * (_bpp / 8))
+		rb_raise(rb_eArgError, "stride too small");
+
+	ALLOC_NEW_IMAGE(v, img);
+	/* later changes to bytes go to a copy of its own */
+	pin = rb_str_new_frozen(bytes);
+	/* never topdown = TRUE, FreeImage would flip the rows in place */
+	dib = FreeImage_ConvertFromRawBitsEx(FALSE, (BYTE *)RSTRING_PTR(pin), FIT_BITMAP,
+			w, h, pitch, _bpp, 0, 0, 0, FALSE);
+	if (!dib)
+		rb_raise(rb_eArgError, "fail to allocate image");
+
+	img->source = pin;
+	img->top_down = argc < 6 || RTEST(top_down);
+	rfi_set_handle(img, dib);
+	img->fif = FIF_BMP;
+	return v;
+}
+
+static VALUE Image_top_down(VALUE self)
+{
+	struct native_image* img;
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	return img->top_down ? Qtrue : Qfalse;
+}
+
 /* draw */
+static void rfi_get_canvas(struct native_image *img, struct rfi_canvas *c, unsigned int bgra)
+{
+	rfi_image_check_writable(img);
+	/* copy on write */
+	rfi_image_own(img);
+	if (rfi_canvas_init(c, img->handle, bgra) < 0)
+		rb_raise(rb_eArgError, "bpp not supported");
+}
+
 static VALUE Image_draw_point(VALUE self, VALUE _x, VALUE _y, VALUE color, VALUE _size)
 {
 	struct native_image* img;
+	struct rfi_canvas canvas;
 	int x = NUM2INT(_x);
 	int y = NUM2INT(_y);
 	int size = NUM2INT(_size);
-	int hs = size / 2, i, j;
 	unsigned int bgra = NUM2UINT(color);
 	if (size < 0)
 		rb_raise(rb_eArgError, "Invalid point size: %d", size);
-	Data_Get_Struct(self, struct native_image, img);
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
 	RFI_CHECK_IMG(img);
+	rfi_get_canvas(img, &canvas, bgra);
 
-	for(i = -hs; i <= hs; i++) {
-		for(j = -hs; j <= hs; j++) {
-			if (i*i + j*j <= hs*hs)
-				FreeImage_SetPixelColor(img->handle, x + i, img->h - (y + j) - 1, (RGBQUAD*)&bgra);
-		}
-	}
+	rfi_fill_disc(&canvas, x, y, size / 2);
 
 	return self;
 }
 
-static VALUE Image_draw_line(VALUE self, VALUE _x1, VALUE _y1,
-		VALUE _x2, VALUE _y2,
-		VALUE color, VALUE _size)
+/* draw_line(x1, y1, x2, y2, color, width, antialias = false) */
+static VALUE Image_draw_line(int argc, VALUE *argv, VALUE self)
 {
 	struct native_image* img;
-	int x1 = NUM2INT(_x1);
-	int y1 = NUM2INT(_y1);
-	int x2 = NUM2INT(_x2);
-	int y2 = NUM2INT(_y2);
-	int size = NUM2INT(_size);
-	unsigned int bgra = NUM2UINT(color);
+	struct rfi_canvas canvas;
+	VALUE _x1, _y1, _x2, _y2, color, _size, aa;
+	int x1, y1, x2, y2, size;
+	unsigned int bgra;
+
+	rb_scan_args(argc, argv, "61", &_x1, &_y1, &_x2, &_y2, &color, &_size, &aa);
+	x1 = NUM2INT(_x1);
+	y1 = NUM2INT(_y1);
+	x2 = NUM2INT(_x2);
+	y2 = NUM2INT(_y2);
+	size = NUM2INT(_size);
+	bgra = NUM2UINT(color);
 	if (size < 0)
 		rb_raise(rb_eArgError, "Invalid point size: %d", size);
-	Data_Get_Struct(self, struct native_image, img);
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
 	RFI_CHECK_IMG(img);
+	rfi_get_canvas(img, &canvas, bgra);
 
-	dd_line(img, x1, y1, x2, y2, bgra, size);
+	rfi_draw_line(&canvas, x1, y1, x2, y2, size, RTEST(aa));
 
 	return self;
 }
@@ -778,34 +3259,20 @@ static VALUE Image_draw_rectangle(VALUE self, VALUE _x1, VALUE _y1,
 		VALUE color, VALUE _width)
 {
 	struct native_image* img;
+	struct rfi_canvas canvas;
 	int x1 = NUM2INT(_x1);
 	int y1 = NUM2INT(_y1);
 	int x2 = NUM2INT(_x2);
 	int y2 = NUM2INT(_y2);
 	int size = NUM2INT(_width);
-	int hs = size / 2, i, j;
 	unsigned int bgra = NUM2UINT(color);
 	if (size < 0)
 		rb_raise(rb_eArgError, "Invalid line width: %d", size);
-	Data_Get_Struct(self, struct native_image, img);
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
 	RFI_CHECK_IMG(img);
+	rfi_get_canvas(img, &canvas, bgra);
 
-	try_sort(&x1, &x2);
-	try_sort(&y1, &y2);
-
-	for(i = -hs; i <= hs; i++) {
-		for(j = x1; j <= x2; j++) {
-			FreeImage_SetPixelColor(img->handle, j, img->h - (y1 + i) - 1, (RGBQUAD*)&bgra);
-			FreeImage_SetPixelColor(img->handle, j, img->h - (y2 + i) - 1, (RGBQUAD*)&bgra);
-		}
-	}
-
-	for(i = -hs; i <= hs; i++) {
-		for(j = y1; j <= y2; j++) {
-			FreeImage_SetPixelColor(img->handle, x1 + i, img->h - j - 1, (RGBQUAD*)&bgra);
-			FreeImage_SetPixelColor(img->handle, x2 + i, img->h - j - 1, (RGBQUAD*)&bgra);
-		}
-	}
+	rfi_draw_rect(&canvas, x1, y1, x2, y2, size);
 
 	return self;
 }
@@ -813,34 +3280,120 @@ static VALUE Image_draw_rectangle(VALUE self, VALUE _x1, VALUE _y1,
 /*
 daw arbitrari quadrangle
 four point is　given clockwise ordered
+draw_quadrangle(x1, y1, ..., x4, y4, color, width, antialias = false)
 */
-static VALUE Image_draw_quadrangle(VALUE self, VALUE _x1, VALUE _y1,
-		VALUE _x2, VALUE _y2,
-		VALUE _x3, VALUE _y3,
-		VALUE _x4, VALUE _y4,
-		VALUE color, VALUE _width)
+static VALUE Image_draw_quadrangle(int argc, VALUE *argv, VALUE self)
 {
 	struct native_image* img;
-	int x1 = NUM2INT(_x1);
-	int y1 = NUM2INT(_y1);
-	int x2 = NUM2INT(_x2);
-	int y2 = NUM2INT(_y2);
-	int x3 = NUM2INT(_x3);
-	int y3 = NUM2INT(_y3);
-	int x4 = NUM2INT(_x4);
-	int y4 = NUM2INT(_y4);
-	int size = NUM2INT(_width);
-	unsigned int bgra = NUM2UINT(color);
+	struct rfi_canvas canvas;
+	int xy[8], i, size, aa;
+	unsigned int bgra;
+
+	if (argc != 10 && argc != 11)
+		rb_raise(rb_eArgError, "wrong number of arguments (given %d, expected 10..11)", argc);
+	for (i = 0; i < 8; i++)
+		xy[i] = NUM2INT(argv[i]);
+	bgra = NUM2UINT(argv[8]);
+	size = NUM2INT(argv[9]);
+	aa = argc > 10 && RTEST(argv[10]);
 	if (size < 0)
 		rb_raise(rb_eArgError, "Invalid line width: %d", size);
-	Data_Get_Struct(self, struct native_image, img);
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	RFI_CHECK_IMG(img);
+	rfi_get_canvas(img, &canvas, bgra);
+
+	for (i = 0; i < 4; i++)
+		rfi_draw_line(&canvas, xy[2 * i], xy[2 * i + 1],
+				xy[(2 * i + 2) & 7], xy[(2 * i + 3) & 7], size, aa);
+
+	return self;
+}
+
+/*
+ * Records of `fields` int32 from a packed String (native byte order) or
+ * an Array of integers, possibly nested. The returned string owns them.
+ */
+static VALUE rfi_unpack_records(VALUE packed, int fields, int color_field,
+		int size_field, long *count)
+{
+	VALUE buf, ary;
+	int32_t *rec;
+	long i, n;
+
+	if (RB_TYPE_P(packed, T_STRING)) {
+		n = RSTRING_LEN(packed);
+		if (n % (fields * 4))
+			rb_raise(rb_eArgError, "packed size must be a multiple of %d", fields * 4);
+		buf = rb_str_new(RSTRING_PTR(packed), n);
+		n /= 4;
+	} else {
+		Check_Type(packed, T_ARRAY);
+		ary = rb_funcall(packed, rb_intern("flatten"), 0);
+		n = RARRAY_LEN(ary);
+		if (n % fields)
+			rb_raise(rb_eArgError, "number of values must be a multiple of %d", fields);
+		buf = rb_str_new(NULL, n * 4);
+		rec = (int32_t *)RSTRING_PTR(buf);
+		for (i = 0; i < n; i++) {
+			VALUE v = RARRAY_AREF(ary, i);
+			rec[i] = i % fields == color_field ? (int32_t)NUM2UINT(v) : NUM2INT(v);
+		}
+	}
+
+	rec = (int32_t *)RSTRING_PTR(buf);
+	for (i = size_field; i < n; i += fields)
+		if (rec[i] < 0)
+			rb_raise(rb_eArgError, "Invalid line width: %d", rec[i]);
+	*count = n / fields;
+	return buf;
+}
+
+static VALUE Image_draw_rectangles(VALUE self, VALUE packed, VALUE tile_sort)
+{
+	struct native_image* img;
+	struct rfi_canvas canvas;
+	long n;
+	VALUE buf = rfi_unpack_records(packed, RFI_RECT_FIELDS, 4, 5, &n);
+
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	RFI_CHECK_IMG(img);
+	rfi_get_canvas(img, &canvas, 0);
+
+	if (rfi_draw_rects(&canvas, (const int32_t *)RSTRING_PTR(buf), n, RTEST(tile_sort)) < 0)
+		rb_memerror();
+	RB_GC_GUARD(buf);
+	return self;
+}
+
+static VALUE Image_draw_lines(VALUE self, VALUE packed, VALUE aa)
+{
+	struct native_image* img;
+	struct rfi_canvas canvas;
+	long n;
+	VALUE buf = rfi_unpack_records(packed, RFI_LINE_FIELDS, 4, 5, &n);
+
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
 	RFI_CHECK_IMG(img);
+	rfi_get_canvas(img, &canvas, 0);
+
+	rfi_draw_lines(&canvas, (const int32_t *)RSTRING_PTR(buf), n, RTEST(aa));
+	RB_GC_GUARD(buf);
+	return self;
+}
 
-	dd_line(img, x1, y1, x2, y2, bgra, size);
-	dd_line(img, x2, y2, x3, y3, bgra, size);
-	dd_line(img, x3, y3, x4, y4, bgra, size);
-	dd_line(img, x4, y4, x1, y1, bgra, size);
+static VALUE Image_draw_points(VALUE self, VALUE packed)
+{
+	struct native_image* img;
+	struct rfi_canvas canvas;
+	long n;
+	VALUE buf = rfi_unpack_records(packed, RFI_POINT_FIELDS, 2, 3, &n);
+
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
+	RFI_CHECK_IMG(img);
+	rfi_get_canvas(img, &canvas, 0);
 
+	rfi_draw_points(&canvas, (const int32_t *)RSTRING_PTR(buf), n);
+	RB_GC_GUARD(buf);
 	return self;
 }
 
@@ -849,24 +3402,20 @@ static VALUE Image_fill_rectangle(VALUE self, VALUE _x1, VALUE _y1,
 		VALUE color)
 {
 	struct native_image* img;
+	struct rfi_canvas canvas;
 	int x1 = NUM2INT(_x1);
 	int y1 = NUM2INT(_y1);
 	int x2 = NUM2INT(_x2);
 	int y2 = NUM2INT(_y2);
 	unsigned int bgra = NUM2UINT(color);
-	int i, j;
-	
-	Data_Get_Struct(self, struct native_image, img);
+
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
 	RFI_CHECK_IMG(img);
+	rfi_get_canvas(img, &canvas, bgra);
 
 	try_sort(&x1, &x2);
 	try_sort(&y1, &y2);
-
-	for(i = x1; i <= x2; i++) {
-		for(j = y1; j <= y2; j++) {
-			FreeImage_SetPixelColor(img->handle, i, img->h - j, (RGBQUAD*)&bgra);
-		}
-	}
+	rfi_fill_rect(&canvas, x1, y1, x2, y2);
 
 	return self;
 }
@@ -882,42 +3431,26 @@ static VALUE Image_fill_quadrangle(VALUE self, VALUE _x1, VALUE _y1,
 		VALUE color)
 {
 	struct native_image* img;
-	int x1 = NUM2INT(_x1);
-	int y1 = NUM2INT(_y1);
-	int x2 = NUM2INT(_x2);
-	int y2 = NUM2INT(_y2);
-	int x3 = NUM2INT(_x3);
-	int y3 = NUM2INT(_y3);
-	int x4 = NUM2INT(_x4);
-	int y4 = NUM2INT(_y4);
-	unsigned int bgra = NUM2UINT(color);
-
-	int d1, d2, d3, d4;
-	int x,y;
-	int minx, miny, maxx, maxy;
-
-	Data_Get_Struct(self, struct native_image, img);
+	struct rfi_canvas canvas;
+	int xy[8];
+	unsigned int bgra;
+
+	xy[0] = NUM2INT(_x1);
+	xy[1] = NUM2INT(_y1);
+	xy[2] = NUM2INT(_x2);
+	xy[3] = NUM2INT(_y2);
+	xy[4] = NUM2INT(_x3);
+	xy[5] = NUM2INT(_y3);
+	xy[6] = NUM2INT(_x4);
+	xy[7] = NUM2INT(_y4);
+	bgra = NUM2UINT(color);
+
+	TypedData_Get_Struct(self, struct native_image, &rfi_image_type, img);
 	RFI_CHECK_IMG(img);
+	rfi_get_canvas(img, &canvas, bgra);
 
-	minx = min_of_arrary(x1,x2,x3,x4);
-	maxx = max_of_arrary(x1,x2,x3,x4);
-	miny = min_of_arrary(y1,y2,y3,y4);
-	maxy = max_of_arrary(y1,y2,y3,y4);
-
-	for(x = minx; x <= maxx; x++) {
-		for(y = miny; y <= maxy; y++) {
-			//if inner
-			d1 = (x2 - x1) * (y - y1) - (y2 - y1) * (x - x1);
-			d2 = (x3 - x2) * (y - y2) - (y3 - y2) * (x - x2);
-			d3 = (x4 - x3) * (y - y3) - (y4 - y3) * (x - x3);
-			d4 = (x1 - x4) * (y - y4) - (y1 - y4) * (x - x4);
-
-			if((d1 > 0 && d2 > 0 && d3 >0 && d4 >0) || (d1 < 0 && d2 < 0 && d3 < 0 && d4 <0))
-			{
-				FreeImage_SetPixelColor(img->handle, x, img->h - y, (RGBQUAD*)&bgra);
-			}
-		}
-	}
+	/* spans between the edges of each row */
+	rfi_fill_quad(&canvas, xy);
 
 	return self;
 }
@@ -927,6 +3460,12 @@ void Init_rfreeimage(void)
 	rb_mFI = rb_define_module("RFreeImage");
 	rb_define_module_function(rb_mFI, "freeimage_version", rb_rfi_version, 0);
 	rb_define_module_function(rb_mFI, "freeimage_string_version", rb_rfi_string_version, 0);
+	rb_define_module_function(rb_mFI, "memory_stats", rb_rfi_memory_stats, 0);
+	rb_define_module_function(rb_mFI, "buffer_pool_stats", rb_rfi_buffer_pool_stats, 0);
+	rb_define_module_function(rb_mFI, "buffer_pool_limit=", rb_rfi_set_buffer_pool_limit, 1);
+	rb_define_module_function(rb_mFI, "buffer_pool_trim", rb_rfi_buffer_pool_trim, 0);
+	rb_define_module_function(rb_mFI, "mmap_loads=", rb_rfi_set_mmap_loads, 1);
+	rb_define_module_function(rb_mFI, "mmap_loads", rb_rfi_mmap_loads, 0);
 
 	Class_Image = rb_define_class_under(rb_mFI, "Image", rb_cObject);
 	Class_RFIError = rb_define_class_under(rb_mFI, "ImageError", rb_eStandardError);
@@ -940,30 +3479,70 @@ void Init_rfreeimage(void)
 	rb_define_method(Class_Image, "format", Image_format, 0);
 	rb_define_method(Class_Image, "buffer_addr", Image_buffer_addr, 0);
 	rb_define_method(Class_Image, "read_bytes", Image_read_bytes, 0);
+	rb_define_method(Class_Image, "top_down?", Image_top_down, 0);
+#ifdef HAVE_RUBY_IO_BUFFER_H
+	rb_define_method(Class_Image, "io_buffer", Image_io_buffer, 0);
+#endif
+#ifdef HAVE_RUBY_MEMORY_VIEW_H
+	rb_memory_view_register(Class_Image, &rfi_memory_view_entry);
+#endif
 	rb_define_method(Class_Image, "bytes?", Image_has_bytes, 0);
-	rb_define_method(Class_Image, "save", Image_save, 1);
+	rb_define_method(Class_Image, "save", Image_save, -1);
+	rb_define_method(Class_Image, "write_io", Image_write_io, -1);
 	rb_define_method(Class_Image, "clone", Image_clone, 0);
 	rb_define_method(Class_Image, "release", Image_release, 0);
 
 	rb_define_method(Class_Image, "to_bpp", Image_to_bpp, 1);
+	rb_define_method(Class_Image, "_to_bpp!", Image_to_bpp_bang, 1);
 	rb_define_method(Class_Image, "rotate", Image_rotate, 1);
+	rb_define_method(Class_Image, "_rotate!", Image_rotate_bang, 1);
 	rb_define_method(Class_Image, "rescale", Image_rescale, 3);
+	rb_define_method(Class_Image, "_freeimage_rescale", Image_freeimage_rescale, 3);
 	rb_define_method(Class_Image, "downscale", Image_downscale, 1);
+	rb_define_method(Class_Image, "_downscale!", Image_downscale_bang, 1);
+	rb_define_method(Class_Image, "shrink", Image_shrink, 2);
 	rb_define_method(Class_Image, "crop", Image_crop, 4);
-	rb_define_method(Class_Image, "to_blob", Image_to_blob, 1);
+	rb_define_method(Class_Image, "_crop!", Image_crop_bang, 4);
+	rb_define_method(Class_Image, "crop_view", Image_crop_view, 4);
+	rb_define_method(Class_Image, "_pipeline", Image_pipeline, 3);
+	rb_define_method(Class_Image, "to_blob", Image_to_blob, -1);
+	rb_define_method(Class_Image, "to_blob_max_bytes", Image_to_blob_max_bytes, -1);
 	rb_define_method(Class_Image, "flip_horizontal", Image_flip_horizontal, 0);
 	rb_define_method(Class_Image, "flip_vertical", Image_flip_vertical, 0);
+	rb_define_method(Class_Image, "_flip_horizontal!", Image_flip_horizontal_bang, 0);
+	rb_define_method(Class_Image, "_flip_vertical!", Image_flip_vertical_bang, 0);
 
 	/* draw */
 	rb_define_method(Class_Image, "draw_point", Image_draw_point, 4);
-	rb_define_method(Class_Image, "draw_line", Image_draw_line, 4 + 2);
+	rb_define_method(Class_Image, "draw_line", Image_draw_line, -1);
 	rb_define_method(Class_Image, "draw_rectangle", Image_draw_rectangle, 4 + 2);
-	rb_define_method(Class_Image, "draw_quadrangle", Image_draw_quadrangle, 8 + 2);
+	rb_define_method(Class_Image, "draw_quadrangle", Image_draw_quadrangle, -1);
+	rb_define_method(Class_Image, "_draw_rectangles", Image_draw_rectangles, 2);
+	rb_define_method(Class_Image, "_draw_lines", Image_draw_lines, 2);
+	rb_define_method(Class_Image, "draw_points", Image_draw_points, 1);
 	rb_define_method(Class_Image, "fill_rectangle", Image_fill_rectangle, 4 + 1);
 	rb_define_method(Class_Image, "fill_quadrangle", Image_fill_quadrangle, 8 + 1);
 
 	rb_define_singleton_method(Class_Image, "ping", Image_ping, 1);
 	rb_define_singleton_method(Class_Image, "from_blob", Image_from_blob, -1);
+	rb_define_singleton_method(Class_Image, "read_io", Image_read_io, -1);
+	rb_define_singleton_method(Class_Image, "_load_downscale", Image_load_downscale, 3);
 	rb_define_singleton_method(Class_Image, "ping_blob", Image_ping_blob, 1);
 	rb_define_singleton_method(Class_Image, "from_bytes", Image_from_bytes, 5);
+	rb_define_singleton_method(Class_Image, "wrap_bytes", Image_wrap_bytes, -1);
+	rb_define_singleton_method(Class_Image, "_load_batch", Image_load_batch, 5);
+	rb_define_singleton_method(Class_Image, "_probe", Image_probe, 2);
+	rb_define_singleton_method(Class_Image, "_ping_batch", Image_ping_batch, 3);
+	rb_define_singleton_method(Class_Image, "_jpeg_transform", Image_jpeg_transform, 7);
+	rb_define_singleton_method(Class_Image, "_load_region", Image_load_region, 5);
+	rb_define_singleton_method(Class_Image, "load_job", Image_load_job, -1);
+	rb_define_method(Class_Image, "to_blob_job", Image_to_blob_job, -1);
+
+	Class_Job = rb_define_class_under(rb_mFI, "Job", rb_cObject);
+	rb_undef_alloc_func(Class_Job);
+	rb_define_method(Class_Job, "value", Job_value, 0);
+	rb_define_method(Class_Job, "done?", Job_done, 0);
+	rb_define_method(Class_Job, "fileno", Job_fileno, 0);
+	rfi_jobs = rb_ary_new();
+	rb_global_variable(&rfi_jobs);
 }
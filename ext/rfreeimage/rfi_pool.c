@@ -0,0 +1,198 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "rfi_pool.h"
+
+#define RFI_POOL_MAX_THREADS 64
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	struct rfi_task *head;
+	struct rfi_task *tail;
+	int nthreads;
+	int atfork;
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* workers don't survive fork(), start over in the child */
+static void pool_atfork_child(void)
+{
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.wakeup, NULL);
+	pool.head = pool.tail = NULL;
+	pool.nthreads = 0;
+}
+
+static void *pool_worker(void *unused)
+{
+	struct rfi_task *task;
+	void (*fn)(void *);
+	void *arg;
+
+	for (;;) {
+		pthread_mutex_lock(&pool.lock);
+		while (!pool.head)
+			pthread_cond_wait(&pool.wakeup, &pool.lock);
+		task = pool.head;
+		pool.head = task->next;
+		if (!pool.head)
+			pool.tail = NULL;
+		/* the task may be gone as soon as fn returns */
+		fn = task->fn;
+		arg = task->arg;
+		pthread_mutex_unlock(&pool.lock);
+
+		fn(arg);
+	}
+	return NULL;
+}
+
+/* called with pool.lock held */
+static void pool_grow(int want)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+	sigset_t all, old;
+
+	if (want > RFI_POOL_MAX_THREADS)
+		want = RFI_POOL_MAX_THREADS;
+	if (pool.nthreads >= want)
+		return;
+
+	if (!pool.atfork) {
+		pthread_atfork(NULL, NULL, pool_atfork_child);
+		pool.atfork = 1;
+	}
+
+	/* leave signal handling to ruby's threads */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	while (pool.nthreads < want) {
+		if (pthread_create(&tid, &attr, pool_worker, NULL))
+			break;
+		pool.nthreads++;
+	}
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* called with pool.lock held */
+static void pool_push(struct rfi_task *task)
+{
+	task->next = NULL;
+	if (pool.tail)
+		pool.tail->next = task;
+	else
+		pool.head = task;
+	pool.tail = task;
+}
+
+int rfi_pool_ncpu(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
+
+int rfi_pool_submit(struct rfi_task *task)
+{
+	pthread_mutex_lock(&pool.lock);
+	pool_grow(rfi_pool_ncpu());
+	if (!pool.nthreads) {
+		pthread_mutex_unlock(&pool.lock);
+		return -1;
+	}
+	pool_push(task);
+	pthread_cond_signal(&pool.wakeup);
+	pthread_mutex_unlock(&pool.lock);
+	return 0;
+}
+
+struct rfi_pfor {
+	void (*fn)(void *arg, int i);
+	void *arg;
+	int n;
+	int next;
+	/* helper tasks not finished yet, guarded by pool.lock */
+	int pending;
+	pthread_cond_t done;
+};
+
+static void pfor_run(struct rfi_pfor *job)
+{
+	int i;
+	while ((i = __sync_fetch_and_add(&job->next, 1)) < job->n)
+		job->fn(job->arg, i);
+}
+
+static void pfor_helper(void *arg)
+{
+	struct rfi_pfor *job = arg;
+
+	pfor_run(job);
+	pthread_mutex_lock(&pool.lock);
+	if (--job->pending == 0)
+		pthread_cond_signal(&job->done);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+void rfi_parallel_for(int n, int threads, void (*fn)(void *arg, int i), void *arg)
+{
+	struct rfi_pfor job;
+	struct rfi_task *tasks, **link;
+	int helpers, i;
+
+	if (threads <= 0)
+		threads = rfi_pool_ncpu();
+	if (threads > n)
+		threads = n;
+	if (threads > RFI_POOL_MAX_THREADS)
+		threads = RFI_POOL_MAX_THREADS;
+	helpers = threads - 1;
+	tasks = helpers > 0 ? malloc(sizeof(struct rfi_task) * helpers) : NULL;
+	if (!tasks) {
+		for (i = 0; i < n; i++)
+			fn(arg, i);
+		return;
+	}
+
+	job.fn = fn;
+	job.arg = arg;
+	job.n = n;
+	job.next = 0;
+	job.pending = helpers;
+	pthread_cond_init(&job.done, NULL);
+
+	pthread_mutex_lock(&pool.lock);
+	pool_grow(helpers);
+	for (i = 0; i < helpers; i++) {
+		tasks[i].fn = pfor_helper;
+		tasks[i].arg = &job;
+		pool_push(&tasks[i]);
+	}
+	pthread_cond_broadcast(&pool.wakeup);
+	pthread_mutex_unlock(&pool.lock);
+
+	pfor_run(&job);
+
+	/* helpers that haven't started yet have nothing left to do */
+	pthread_mutex_lock(&pool.lock);
+	pool.tail = NULL;
+	for (link = &pool.head; *link; ) {
+		if ((*link)->arg == &job) {
+			*link = (*link)->next;
+			job.pending--;
+		} else {
+			pool.tail = *link;
+			link = &(*link)->next;
+		}
+	}
+	while (job.pending > 0)
+		pthread_cond_wait(&job.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+
+	pthread_cond_destroy(&job.done);
+	free(tasks);
+}
@@ -0,0 +1,32 @@
+#ifndef RFI_POOL_H
+#define RFI_POOL_H
+
+/*
+ * A small process-wide pool of native worker threads. Tasks never touch
+ * ruby objects, so they can run while the calling thread holds or has
+ * released the GVL.
+ */
+
+struct rfi_task {
+	void (*fn)(void *arg);
+	void *arg;
+	struct rfi_task *next;
+};
+
+/* number of online cpus, at least 1 */
+int rfi_pool_ncpu(void);
+
+/*
+ * Call fn(arg, i) for every i in [0, n), spread over up to `threads`
+ * threads including the caller (0 means one per cpu). Returns when all
+ * calls are done.
+ */
+void rfi_parallel_for(int n, int threads, void (*fn)(void *arg, int i), void *arg);
+
+/*
+ * Queue task to run on a worker thread, task must stay valid until its fn
+ * is called. Returns -1 if no worker thread could be started.
+ */
+int rfi_pool_submit(struct rfi_task *task);
+
+#endif
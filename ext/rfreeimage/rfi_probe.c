@@ -0,0 +1,214 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rfi_decode.h"
+#include "rfi_probe.h"
+
+/* a blob or an open file, read at offsets */
+struct rfi_probe_src {
+	const BYTE *data;
+	size_t size;
+	FILE *fp;
+};
+
+/* read len bytes at off, -1 if there are fewer */
+static int src_read(struct rfi_probe_src *src, long off, BYTE *buf, size_t len)
+{
+	if (src->fp) {
+		if (fseek(src->fp, off, SEEK_SET) || fread(buf, 1, len, src->fp) != len)
+			return -1;
+		return 0;
+	}
+	if (off < 0 || (size_t)off > src->size || src->size - off < len)
+		return -1;
+	memcpy(buf, src->data + off, len);
+	return 0;
+}
+
+static unsigned int be16(const BYTE *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+static unsigned int le16(const BYTE *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static unsigned int be32(const BYTE *p)
+{
+	return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static unsigned int le24(const BYTE *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16;
+}
+
+static unsigned int le32(const BYTE *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+/* walk the markers up to the frame header, skipping segment bodies */
+static int probe_jpeg(struct rfi_probe_src *src, struct rfi_probe_info *out)
+{
+	BYTE hdr[9], *app;
+	long off = 2;
+	unsigned int len;
+	int m;
+
+	out->fif = FIF_JPEG;
+	for (;;) {
+		if (src_read(src, off, hdr, 2) < 0 || hdr[0] != 0xFF)
+			return -1;
+		m = hdr[1];
+		if (m == 0xFF) {
+			/* fill byte */
+			off++;
+			continue;
+		}
+		/* standalone markers have no length */
+		if (m == 0x01 || (m >= 0xD0 && m <= 0xD7)) {
+			off += 2;
+			continue;
+		}
+		/* scan data or the end before any frame header */
+		if (m == 0xD9 || m == 0xDA)
+			return -1;
+		if (src_read(src, off + 2, hdr + 2, 2) < 0)
+			return -1;
+		len = be16(hdr + 2);
+		if (len < 2)
+			return -1;
+		/* SOF0..15, but DHT, JPG and DAC share the range */
+		if (m >= 0xC0 && m <= 0xCF && m != 0xC4 && m != 0xC8 && m != 0xCC) {
+			if (len < 7 || src_read(src, off + 4, hdr + 4, 5) < 0)
+				return -1;
+			out->height = be16(hdr + 5);
+			out->width = be16(hdr + 7);
+			/* a zero height comes later in a DNL segment */
+			return out->width && out->height ? 0 : -1;
+		}
+		if (m == 0xE1 && !out->orientation && len > 2) {
+			app = malloc(len - 2);
+			if (!app)
+				return -1;
+			if (src_read(src, off + 4, app, len - 2) < 0) {
+				free(app);
+				return -1;
+			}
+			out->orientation = rfi_exif_orientation(app, len - 2);
+			free(app);
+		}
+		off += 2 + len;
+	}
+}
+
+static int probe_webp(struct rfi_probe_src *src, struct rfi_probe_info *out)
+{
+	BYTE p[30];
+
+	if (src_read(src, 0, p, 16) < 0 || memcmp(p + 8, "WEBP", 4))
+		return -1;
+	out->fif = FIF_WEBP;
+	/* the first chunk has the size, in the first bytes of its data */
+	if (src_read(src, 16, p + 16, memcmp(p + 12, "VP8L", 4) ? 14 : 9) < 0)
+		return -1;
+	if (!memcmp(p + 12, "VP8 ", 4)) {
+		/* key frame start code */
+		if (p[23] != 0x9D || p[24] != 0x01 || p[25] != 0x2A)
+			return -1;
+		out->width = le16(p + 26) & 0x3FFF;
+		out->height = le16(p + 28) & 0x3FFF;
+	} else if (!memcmp(p + 12, "VP8L", 4)) {
+		if (p[20] != 0x2F)
+			return -1;
+		out->width = (le32(p + 21) & 0x3FFF) + 1;
+		out->height = (le32(p + 21) >> 14 & 0x3FFF) + 1;
+	} else if (!memcmp(p + 12, "VP8X", 4)) {
+		out->width = le24(p + 24) + 1;
+		out->height = le24(p + 27) + 1;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+static int probe(struct rfi_probe_src *src, struct rfi_probe_info *out)
+{
+	BYTE p[26];
+	int h;
+
+	memset(out, 0, sizeof(*out));
+	out->fif = FIF_UNKNOWN;
+	if (src_read(src, 0, p, 4) < 0)
+		return -1;
+
+	if (p[0] == 0xFF && p[1] == 0xD8 && p[2] == 0xFF)
+		return probe_jpeg(src, out);
+	if (!memcmp(p, "RIFF", 4))
+		return probe_webp(src, out);
+
+	if (!memcmp(p, "\x89PNG", 4)) {
+		out->fif = FIF_PNG;
+		if (src_read(src, 0, p, 24) < 0 || memcmp(p + 12, "IHDR", 4))
+			return -1;
+		out->width = be32(p + 16);
+		out->height = be32(p + 20);
+	} else if (!memcmp(p, "GIF8", 4)) {
+		out->fif = FIF_GIF;
+		if (src_read(src, 0, p, 10) < 0)
+			return -1;
+		out->width = le16(p + 6);
+		out->height = le16(p + 8);
+	} else if (p[0] == 'B' && p[1] == 'M') {
+		out->fif = FIF_BMP;
+		if (src_read(src, 0, p, 26) < 0)
+			return -1;
+		/* the known info header sizes, anything else isn't a BMP */
+		switch (le32(p + 14)) {
+			case 12: case 40: case 52: case 56: case 64: case 108: case 124:
+				break;
+			default:
+				return -1;
+		}
+		if (le32(p + 14) == 12) {
+			/* OS/2 BITMAPCOREHEADER */
+			out->width = le16(p + 18);
+			out->height = le16(p + 20);
+		} else {
+			out->width = (int)le32(p + 18);
+			/* negative for top-down rows */
+			h = (int)le32(p + 22);
+			out->height = h < 0 && h != INT_MIN ? -h : h;
+		}
+	} else {
+		return -1;
+	}
+	return out->width > 0 && out->height > 0 ? 0 : -1;
+}
+
+int rfi_probe_memory(const BYTE *data, size_t size, struct rfi_probe_info *out)
+{
+	struct rfi_probe_src src = { data, size, NULL };
+	return probe(&src, out);
+}
+
+int rfi_probe_file(const char *filename, struct rfi_probe_info *out)
+{
+	struct rfi_probe_src src = { NULL, 0, NULL };
+	int ret;
+
+	memset(out, 0, sizeof(*out));
+	out->fif = FIF_UNKNOWN;
+	src.fp = fopen(filename, "rb");
+	if (!src.fp)
+		return -1;
+	/* the headers are all in the first block or two */
+	setvbuf(src.fp, NULL, _IOFBF, 4096);
+	ret = probe(&src, out);
+	fclose(src.fp);
+	return ret;
+}
@@ -0,0 +1,25 @@
+#ifndef RFI_PROBE_H
+#define RFI_PROBE_H
+
+#include <stddef.h>
+#include <FreeImage.h>
+
+struct rfi_probe_info {
+	FREE_IMAGE_FORMAT fif;
+	/* as stored, before any Exif rotation */
+	int width;
+	int height;
+	/* Exif orientation 1..8, 0 if the image has none */
+	int orientation;
+};
+
+/*
+ * Size, format and orientation of a JPEG, PNG, GIF, WebP or BMP from its
+ * headers alone, without FreeImage's plugins. Only the bytes up to the
+ * frame header are read, a truncated prefix is enough. Returns -1 for
+ * other formats or when the headers are cut short or broken.
+ */
+int rfi_probe_memory(const BYTE *data, size_t size, struct rfi_probe_info *out);
+int rfi_probe_file(const char *filename, struct rfi_probe_info *out);
+
+#endif
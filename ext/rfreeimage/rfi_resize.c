@@ -0,0 +1,1002 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rfi_alloc.h"
+#include "rfi_resize.h"
+#include "rfi_pool.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+/* built for the baseline target, AVX2 is picked at runtime */
+#define RFI_HAVE_AVX2
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+/*
+ * Area weights are Q12. Rows are summed vertically first into a Q12
+ * accumulator per source column, then horizontally into Q24, which stays
+ * below 2^32 for 8-bit samples.
+ */
+#define RFI_AREA_BITS 12
+#define RFI_AREA_ONE (1 << RFI_AREA_BITS)
+
+typedef void (*rfi_vacc_fn)(uint32_t *acc, const BYTE *src, int n, unsigned int w);
+
+/* acc[i] += src[i] * w */
+static void rfi_vacc_c(uint32_t *acc, const BYTE *src, int n, unsigned int w)
+{
+	int i;
+	for (i = 0; i < n; i++)
+		acc[i] += src[i] * w;
+}
+
+#ifdef RFI_HAVE_AVX2
+__attribute__((target("avx2")))
+static void rfi_vacc_avx2(uint32_t *acc, const BYTE *src, int n, unsigned int w)
+{
+	__m256i wv = _mm256_set1_epi32(w);
+	__m256i s0, s1;
+	int i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		s0 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + i)));
+		s1 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + i + 8)));
+		_mm256_storeu_si256((__m256i *)(acc + i), _mm256_add_epi32(
+				_mm256_loadu_si256((const __m256i *)(acc + i)),
+				_mm256_mullo_epi32(s0, wv)));
+		_mm256_storeu_si256((__m256i *)(acc + i + 8), _mm256_add_epi32(
+				_mm256_loadu_si256((const __m256i *)(acc + i + 8)),
+				_mm256_mullo_epi32(s1, wv)));
+	}
+	rfi_vacc_c(acc + i, src + i, n - i, w);
+}
+#endif
+
+#ifdef __SSE2__
+/* w fits in 16 bits, the 32-bit products are put together from halves */
+static void rfi_vacc_sse2(uint32_t *acc, const BYTE *src, int n, unsigned int w)
+{
+	__m128i wv = _mm_set1_epi16((short)w);
+	__m128i zero = _mm_setzero_si128();
+	__m128i s, s16[2], lo, hi;
+	int i = 0, j;
+
+	for (; i + 16 <= n; i += 16) {
+		s = _mm_loadu_si128((const __m128i *)(src + i));
+		s16[0] = _mm_unpacklo_epi8(s, zero);
+		s16[1] = _mm_unpackhi_epi8(s, zero);
+		for (j = 0; j < 2; j++) {
+			uint32_t *a = acc + i + j * 8;
+			lo = _mm_mullo_epi16(s16[j], wv);
+			hi = _mm_mulhi_epu16(s16[j], wv);
+			_mm_storeu_si128((__m128i *)a, _mm_add_epi32(
+					_mm_loadu_si128((const __m128i *)a),
+					_mm_unpacklo_epi16(lo, hi)));
+			_mm_storeu_si128((__m128i *)(a + 4), _mm_add_epi32(
+					_mm_loadu_si128((const __m128i *)(a + 4)),
+					_mm_unpackhi_epi16(lo, hi)));
+		}
+	}
+	rfi_vacc_c(acc + i, src + i, n - i, w);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static void rfi_vacc_neon(uint32_t *acc, const BYTE *src, int n, unsigned int w)
+{
+	uint16x4_t wv = vdup_n_u16((uint16_t)w);
+	uint16x8_t s;
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		s = vmovl_u8(vld1_u8(src + i));
+		vst1q_u32(acc + i, vmlal_u16(vld1q_u32(acc + i), vget_low_u16(s), wv));
+		vst1q_u32(acc + i + 4, vmlal_u16(vld1q_u32(acc + i + 4), vget_high_u16(s), wv));
+	}
+	rfi_vacc_c(acc + i, src + i, n - i, w);
+}
+#endif
+
+static rfi_vacc_fn rfi_vacc_pick(void)
+{
+#ifdef RFI_HAVE_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		return rfi_vacc_avx2;
+#endif
+#if defined(__SSE2__)
+	return rfi_vacc_sse2;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	return rfi_vacc_neon;
+#else
+	return rfi_vacc_c;
+#endif
+}
+
+/* source pixels and weights for each output index along one axis */
+struct rfi_area_axis {
+	int *start;
+	int *count;
+	/* weights per output index in weight[] */
+	int taps;
+	uint16_t *weight;
+};
+
+static void rfi_area_axis_free(struct rfi_area_axis *ax)
+{
+	free(ax->start);
+	free(ax->count);
+	free(ax->weight);
+	ax->start = ax->count = NULL;
+	ax->weight = NULL;
+}
+
+static int rfi_area_axis_init(struct rfi_area_axis *ax, int src, int dst)
+{
+	int64_t lo, hi, covered;
+	int i, k, n, prev, cur;
+
+	ax->taps = (src + dst - 1) / dst + 1;
+	ax->start = malloc(sizeof(int) * dst);
+	ax->count = malloc(sizeof(int) * dst);
+	ax->weight = calloc((size_t)dst * ax->taps, sizeof(uint16_t));
+	if (!ax->start || !ax->count || !ax->weight) {
+		rfi_area_axis_free(ax);
+		return -1;
+	}
+
+	/*
+	 * In units of 1/dst of a source pixel, output i covers [i*src, (i+1)*src)
+	 * and source pixel k covers [k*dst, (k+1)*dst). Weights are rounded
+	 * from the running coverage so they always add up to RFI_AREA_ONE.
+	 */
+	for (i = 0; i < dst; i++) {
+		lo = (int64_t)i * src;
+		hi = lo + src;
+		k = (int)(lo / dst);
+		ax->start[i] = k;
+		prev = 0;
+		for (n = 0; k < src && (int64_t)k * dst < hi; n++, k++) {
+			covered = ((int64_t)(k + 1) * dst < hi ? (int64_t)(k + 1) * dst : hi) - lo;
+			cur = (int)((covered * RFI_AREA_ONE + src / 2) / src);
+			ax->weight[i * ax->taps + n] = cur - prev;
+			prev = cur;
+		}
+		ax->count[i] = n;
+	}
+	return 0;
+}
+
+struct rfi_area_job {
+	FIBITMAP *src;
+	FIBITMAP *dst;
+	struct rfi_area_axis x;
+	struct rfi_area_axis y;
+	rfi_vacc_fn vacc;
+	int channels;
+	/* of the output before orientation, rows are placed into dst */
+	int width;
+	int height;
+	int orientation;
+	int band;
+	int failed;
+};
+
+/*
+ * What shows an Exif orientation the way it is meant to, as a transpose
+ * then horizontal and vertical flips, the same as rfi_exif_rotate
+ */
+static const struct {
+	int t, fx, fy;
+} rfi_orientations[] = {
+	{ 0, 0, 0 }, { 0, 0, 0 }, { 0, 1, 0 }, { 0, 1, 1 }, { 0, 0, 1 },
+	{ 1, 0, 0 }, { 1, 1, 0 }, { 1, 1, 1 }, { 1, 0, 1 },
+};
+
+/*
+ * Scanline ys of the output as stored into dst, as it shows: transposed
+ * rows become columns, which for a thumbnail are still in cache
+ */
+static void rfi_area_place(const struct rfi_area_job *job, const BYTE *row, int ys)
+{
+	int ch = job->channels, dw = FreeImage_GetWidth(job->dst);
+	int dh = FreeImage_GetHeight(job->dst), uy = job->height - 1 - ys;
+	int t = rfi_orientations[job->orientation].t;
+	int fx = rfi_orientations[job->orientation].fx;
+	int fy = rfi_orientations[job->orientation].fy;
+	int x, dx, dy, c;
+	BYTE *out;
+
+	for (x = 0; x < job->width; x++) {
+		dx = t ? uy : x;
+		dy = t ? x : uy;
+		if (fx)
+			dx = dw - 1 - dx;
+		if (fy)
+			dy = dh - 1 - dy;
+		out = FreeImage_GetScanLine(job->dst, dh - 1 - dy) + dx * ch;
+		for (c = 0; c < ch; c++)
+			out[c] = row[x * ch + c];
+	}
+}
+
+static inline void rfi_area_hsum(const struct rfi_area_job *job, const uint32_t *acc,
+		BYTE *out, int width, const int ch)
+{
+	const uint32_t *p;
+	const uint16_t *wt;
+	uint32_t sum;
+	int x, c, n;
+
+	for (x = 0; x < width; x++) {
+		p = acc + job->x.start[x] * ch;
+		wt = job->x.weight + x * job->x.taps;
+		for (c = 0; c < ch; c++) {
+			sum = 1u << (2 * RFI_AREA_BITS - 1);
+			for (n = 0; n < job->x.count[x]; n++)
+				sum += p[n * ch + c] * wt[n];
+			*out++ = (BYTE)(sum >> (2 * RFI_AREA_BITS));
+		}
+	}
+}
+
+static void rfi_area_band(void *arg, int band)
+{
+	struct rfi_area_job *job = arg;
+	int sw = FreeImage_GetWidth(job->src);
+	int dw = job->width;
+	int dh = job->height;
+	int y = band * job->band, end = y + job->band, n;
+	int line = sw * job->channels;
+	const uint16_t *wt;
+	uint32_t *acc;
+	BYTE *out, *row = NULL;
+
+	acc = malloc(sizeof(uint32_t) * line);
+	if (job->orientation > 1)
+		row = malloc((size_t)dw * job->channels);
+	if (!acc || (job->orientation > 1 && !row)) {
+		free(acc);
+		job->failed = 1;
+		return;
+	}
+	if (end > dh)
+		end = dh;
+	/* the mapping is symmetric, so scanline order doesn't matter */
+	for (; y < end; y++) {
+		memset(acc, 0, sizeof(uint32_t) * line);
+		wt = job->y.weight + y * job->y.taps;
+		for (n = 0; n < job->y.count[y]; n++)
+			if (wt[n])
+				job->vacc(acc, FreeImage_GetScanLine(job->src, job->y.start[y] + n), line, wt[n]);
+
+		out = row ? row : FreeImage_GetScanLine(job->dst, y);
+		/* constant channel counts let the compiler unroll */
+		switch (job->channels) {
+			case 1:
+				rfi_area_hsum(job, acc, out, dw, 1);
+				break;
+			case 3:
+				rfi_area_hsum(job, acc, out, dw, 3);
+				break;
+			default:
+				rfi_area_hsum(job, acc, out, dw, 4);
+				break;
+		}
+		if (row)
+			rfi_area_place(job, row, y);
+	}
+	free(acc);
+	free(row);
+}
+
+/* resolution and metadata of src, as FreeImage_Rescale keeps them */
+static void rfi_copy_info(FIBITMAP *dst, FIBITMAP *src, int transposed)
+{
+	unsigned int x = FreeImage_GetDotsPerMeterX(src), y = FreeImage_GetDotsPerMeterY(src);
+
+	FreeImage_SetDotsPerMeterX(dst, transposed ? y : x);
+	FreeImage_SetDotsPerMeterY(dst, transposed ? x : y);
+	FreeImage_CloneMetadata(dst, src);
+}
+
+FIBITMAP *rfi_area_resize(FIBITMAP *src, int width, int height)
+{
+	return rfi_area_resize_oriented(src, width, height, 1);
+}
+
+FIBITMAP *rfi_area_resize_oriented(FIBITMAP *src, int width, int height, int orientation)
+{
+	static rfi_vacc_fn vacc;
+	struct rfi_area_job job;
+	int bpp = FreeImage_GetBPP(src);
+	int threads, nbands;
+
+	if (width <= 0 || height <= 0 || !FreeImage_HasPixels(src)
+			|| FreeImage_GetImageType(src) != FIT_BITMAP)
+		return NULL;
+	if (orientation < 1 || orientation > 8)
+		orientation = 1;
+	if (bpp != 24 && bpp != 32 && !(bpp == 8 && FreeImage_GetColorType(src) == FIC_MINISBLACK))
+		return NULL;
+	if (!vacc)
+		vacc = rfi_vacc_pick();
+
+	memset(&job, 0, sizeof(job));
+	job.src = src;
+	job.vacc = vacc;
+	job.channels = bpp / 8;
+	job.orientation = orientation;
+	job.width = rfi_orientations[orientation].t ? height : width;
+	job.height = rfi_orientations[orientation].t ? width : height;
+	job.dst = rfi_bitmap_allocate(width, height, bpp);
+	if (!job.dst)
+		return NULL;
+	if (rfi_area_axis_init(&job.x, FreeImage_GetWidth(src), job.width) < 0
+			|| rfi_area_axis_init(&job.y, FreeImage_GetHeight(src), job.height) < 0) {
+		job.failed = 1;
+		goto out;
+	}
+
+	/* a few bands per thread to even out the load */
+	threads = rfi_pool_ncpu();
+	job.band = (job.height + threads * 4 - 1) / (threads * 4);
+	if (job.band < 1)
+		job.band = 1;
+	nbands = (job.height + job.band - 1) / job.band;
+	rfi_parallel_for(nbands, threads, rfi_area_band, &job);
+
+out:
+	rfi_area_axis_free(&job.x);
+	rfi_area_axis_free(&job.y);
+	if (job.failed) {
+		rfi_bitmap_unload(job.dst);
+		return NULL;
+	}
+	rfi_copy_info(job.dst, src, rfi_orientations[orientation].t);
+	return job.dst;
+}
+
+/*
+ * Resampling filters, as FreeImage's CGenericFilter subclasses. Weights
+ * are computed in doubles like FreeImage's CWeightsTable, then rounded to
+ * Q14. Pixels are summed in 32 bits and rounded back to 8 bits after each
+ * pass, also like FreeImage.
+ */
+#define RFI_FILTER_BITS 14
+#define RFI_FILTER_ONE (1 << RFI_FILTER_BITS)
+#define RFI_FILTER_CACHE 16
+
+static double rfi_filter_width(FREE_IMAGE_FILTER filter)
+{
+	switch (filter) {
+		case FILTER_BOX:
+			return 0.5;
+		case FILTER_BILINEAR:
+			return 1;
+		case FILTER_LANCZOS3:
+			return 3;
+		default:
+			return 2;
+	}
+}
+
+static double rfi_sinc(double v)
+{
+	return v != 0 ? sin(M_PI * v) / (M_PI * v) : 1;
+}
+
+static double rfi_filter(FREE_IMAGE_FILTER filter, double v)
+{
+	/* Mitchell-Netravali with B = C = 1/3 */
+	const double b = 1.0 / 3, c = 1.0 / 3;
+
+	switch (filter) {
+		case FILTER_BOX:
+			return fabs(v) <= 0.5 ? 1 : 0;
+		case FILTER_BILINEAR:
+			v = fabs(v);
+			return v < 1 ? 1 - v : 0;
+		case FILTER_BICUBIC:
+			v = fabs(v);
+			if (v < 1)
+				return ((6 - 2 * b) + v * v * ((-18 + 12 * b + 6 * c)
+						+ v * (12 - 9 * b - 6 * c))) / 6;
+			if (v < 2)
+				return ((8 * b + 24 * c) + v * ((-12 * b - 48 * c)
+						+ v * ((6 * b + 30 * c) + v * (-b - 6 * c)))) / 6;
+			return 0;
+		case FILTER_BSPLINE:
+			v = fabs(v);
+			if (v < 1)
+				return 0.5 * v * v * v - v * v + 2.0 / 3.0;
+			if (v < 2) {
+				v = 2 - v;
+				return v * v * v / 6;
+			}
+			return 0;
+		case FILTER_CATMULLROM:
+			if (v < -2)
+				return 0;
+			if (v < -1)
+				return 0.5 * (4 + v * (8 + v * (5 + v)));
+			if (v < 0)
+				return 0.5 * (2 + v * v * (-5 - 3 * v));
+			if (v < 1)
+				return 0.5 * (2 + v * v * (-5 + 3 * v));
+			if (v < 2)
+				return 0.5 * (4 + v * (-8 + v * (5 - v)));
+			return 0;
+		case FILTER_LANCZOS3:
+			v = fabs(v);
+			return v < 3 ? rfi_sinc(v) * rfi_sinc(v / 3) : 0;
+	}
+	return 0;
+}
+
+struct rfi_filter_table {
+	int src;
+	int dst;
+	FREE_IMAGE_FILTER filter;
+	/* one for the cache, one per resample using it */
+	int refs;
+	/* weights per output index, even */
+	int taps;
+	int *left;
+	int *count;
+	int16_t *weight;
+	struct rfi_filter_table *next;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	/* most recently used first */
+	struct rfi_filter_table *head;
+} filter_cache = { PTHREAD_MUTEX_INITIALIZER };
+
+static void rfi_filter_table_free(struct rfi_filter_table *t)
+{
+	free(t->left);
+	free(t->count);
+	free(t->weight);
+	free(t);
+}
+
+static struct rfi_filter_table *rfi_filter_table_new(int src, int dst, FREE_IMAGE_FILTER filter)
+{
+	struct rfi_filter_table *t;
+	double scale = (double)dst / src, width, fscale, center, total;
+	double *w;
+	int u, i, left, right, n, sum, peak;
+
+	if (scale < 1) {
+		width = rfi_filter_width(filter) / scale;
+		fscale = scale;
+	} else {
+		width = rfi_filter_width(filter);
+		fscale = 1;
+	}
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+	t->src = src;
+	t->dst = dst;
+	t->filter = filter;
+	t->taps = (2 * (int)ceil(width) + 2) & ~1;
+	t->left = malloc(sizeof(int) * dst);
+	t->count = malloc(sizeof(int) * dst);
+	t->weight = calloc((size_t)dst * t->taps, sizeof(int16_t));
+	w = malloc(sizeof(double) * t->taps);
+	if (!t->left || !t->count || !t->weight || !w) {
+		free(w);
+		rfi_filter_table_free(t);
+		return NULL;
+	}
+
+	for (u = 0; u < dst; u++) {
+		/* dst pixel centre in source coordinates */
+		center = (u + 0.5) / scale;
+		left = (int)(center - width + 0.5);
+		right = (int)(center + width + 0.5);
+		if (left < 0)
+			left = 0;
+		if (right > src)
+			right = src;
+		if (right - left > t->taps)
+			right = left + t->taps;
+
+		total = 0;
+		for (i = left; i < right; i++) {
+			w[i - left] = fscale * rfi_filter(filter, fscale * (i + 0.5 - center));
+			total += w[i - left];
+		}
+		if (total > 0 && total != 1)
+			for (i = left; i < right; i++)
+				w[i - left] /= total;
+		/* FreeImage drops trailing zero weights */
+		n = right - left;
+		while (n > 0 && w[n - 1] == 0)
+			n--;
+
+		/* round to Q14, the peak takes up what rounding lost */
+		sum = 0;
+		peak = 0;
+		for (i = 0; i < n; i++) {
+			t->weight[u * t->taps + i] = (int16_t)lrint(w[i] * RFI_FILTER_ONE);
+			sum += t->weight[u * t->taps + i];
+			if (fabs(w[i]) > fabs(w[peak]))
+				peak = i;
+		}
+		if (n > 0 && total > 0)
+			t->weight[u * t->taps + peak] += RFI_FILTER_ONE - sum;
+		t->left[u] = left;
+		t->count[u] = n;
+	}
+	free(w);
+	return t;
+}
+
+static void rfi_filter_table_put(struct rfi_filter_table *t)
+{
+	int last;
+
+	pthread_mutex_lock(&filter_cache.lock);
+	last = --t->refs == 0;
+	pthread_mutex_unlock(&filter_cache.lock);
+	if (last)
+		rfi_filter_table_free(t);
+}
+
+static struct rfi_filter_table *rfi_filter_table_get(int src, int dst, FREE_IMAGE_FILTER filter)
+{
+	struct rfi_filter_table *t, **link, *evict = NULL;
+	int n;
+
+	pthread_mutex_lock(&filter_cache.lock);
+	for (link = &filter_cache.head; (t = *link); link = &t->next) {
+		if (t->src == src && t->dst == dst && t->filter == filter) {
+			*link = t->next;
+			t->next = filter_cache.head;
+			filter_cache.head = t;
+			t->refs++;
+			pthread_mutex_unlock(&filter_cache.lock);
+			return t;
+		}
+	}
+	pthread_mutex_unlock(&filter_cache.lock);
+
+	t = rfi_filter_table_new(src, dst, filter);
+	if (!t)
+		return NULL;
+	t->refs = 2;
+
+	/* another thread may have added the same table meanwhile, no harm */
+	pthread_mutex_lock(&filter_cache.lock);
+	t->next = filter_cache.head;
+	filter_cache.head = t;
+	for (n = 1, link = &t->next; *link; n++, link = &(*link)->next) {
+		if (n == RFI_FILTER_CACHE) {
+			evict = *link;
+			*link = NULL;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&filter_cache.lock);
+
+	while (evict) {
+		struct rfi_filter_table *next = evict->next;
+		rfi_filter_table_put(evict);
+		evict = next;
+	}
+	return t;
+}
+
+/* rows of pixels, in scanline order */
+struct rfi_plane {
+	BYTE *bits;
+	size_t pitch;
+	int width;
+	int height;
+};
+
+#define RFI_ROW(p, y) ((p)->bits + (size_t)(y) * (p)->pitch)
+
+static inline BYTE rfi_clamp_q14(int32_t sum)
+{
+	if (sum < 0)
+		return 0;
+	sum >>= RFI_FILTER_BITS;
+	return sum > 255 ? 255 : (BYTE)sum;
+}
+
+typedef void (*rfi_vfilter_fn)(BYTE *out, const BYTE *const *rows,
+		const int16_t *w, int n, int len);
+
+static inline BYTE rfi_vfilter_px(const BYTE *const *rows, const int16_t *w, int n, int i)
+{
+	int32_t sum = 1 << (RFI_FILTER_BITS - 1);
+	int k;
+
+	for (k = 0; k < n; k++)
+		sum += rows[k][i] * w[k];
+	return rfi_clamp_q14(sum);
+}
+
+#if !defined(__SSE2__) && !defined(__ARM_NEON) && !defined(__ARM_NEON__)
+/* out[i] = sum of rows[k][i] * w[k], n even */
+static void rfi_vfilter_c(BYTE *out, const BYTE *const *rows,
+		const int16_t *w, int n, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		out[i] = rfi_vfilter_px(rows, w, n, i);
+}
+#endif
+
+#ifdef RFI_HAVE_AVX2
+__attribute__((target("avx2")))
+static void rfi_vfilter_avx2(BYTE *out, const BYTE *const *rows,
+		const int16_t *w, int n, int len)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i half = _mm256_set1_epi32(1 << (RFI_FILTER_BITS - 1));
+	__m256i a0, a1, a2, a3, r0, r1, lo, hi, wv;
+	int i = 0, k;
+
+	/* two rows at a time: interleaved bytes pair up with (w[k], w[k+1]) */
+	for (; i + 32 <= len; i += 32) {
+		a0 = a1 = a2 = a3 = half;
+		for (k = 0; k < n; k += 2) {
+			r0 = _mm256_loadu_si256((const __m256i *)(rows[k] + i));
+			r1 = _mm256_loadu_si256((const __m256i *)(rows[k + 1] + i));
+			wv = _mm256_set1_epi32((int)((uint32_t)(uint16_t)w[k + 1] << 16 | (uint16_t)w[k]));
+			lo = _mm256_unpacklo_epi8(r0, r1);
+			hi = _mm256_unpackhi_epi8(r0, r1);
+			a0 = _mm256_add_epi32(a0, _mm256_madd_epi16(_mm256_unpacklo_epi8(lo, zero), wv));
+			a1 = _mm256_add_epi32(a1, _mm256_madd_epi16(_mm256_unpackhi_epi8(lo, zero), wv));
+			a2 = _mm256_add_epi32(a2, _mm256_madd_epi16(_mm256_unpacklo_epi8(hi, zero), wv));
+			a3 = _mm256_add_epi32(a3, _mm256_madd_epi16(_mm256_unpackhi_epi8(hi, zero), wv));
+		}
+		/* the in-lane unpacks and packs cancel out */
+		a0 = _mm256_packs_epi32(_mm256_srai_epi32(a0, RFI_FILTER_BITS),
+				_mm256_srai_epi32(a1, RFI_FILTER_BITS));
+		a2 = _mm256_packs_epi32(_mm256_srai_epi32(a2, RFI_FILTER_BITS),
+				_mm256_srai_epi32(a3, RFI_FILTER_BITS));
+		_mm256_storeu_si256((__m256i *)(out + i), _mm256_packus_epi16(a0, a2));
+	}
+	for (; i < len; i++)
+		out[i] = rfi_vfilter_px(rows, w, n, i);
+}
+#endif
+
+#ifdef __SSE2__
+static void rfi_vfilter_sse2(BYTE *out, const BYTE *const *rows,
+		const int16_t *w, int n, int len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i half = _mm_set1_epi32(1 << (RFI_FILTER_BITS - 1));
+	__m128i a0, a1, a2, a3, r0, r1, lo, hi, wv;
+	int i = 0, k;
+
+	for (; i + 16 <= len; i += 16) {
+		a0 = a1 = a2 = a3 = half;
+		for (k = 0; k < n; k += 2) {
+			r0 = _mm_loadu_si128((const __m128i *)(rows[k] + i));
+			r1 = _mm_loadu_si128((const __m128i *)(rows[k + 1] + i));
+			wv = _mm_set1_epi32((int)((uint32_t)(uint16_t)w[k + 1] << 16 | (uint16_t)w[k]));
+			lo = _mm_unpacklo_epi8(r0, r1);
+			hi = _mm_unpackhi_epi8(r0, r1);
+			a0 = _mm_add_epi32(a0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), wv));
+			a1 = _mm_add_epi32(a1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), wv));
+			a2 = _mm_add_epi32(a2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), wv));
+			a3 = _mm_add_epi32(a3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), wv));
+		}
+		a0 = _mm_packs_epi32(_mm_srai_epi32(a0, RFI_FILTER_BITS),
+				_mm_srai_epi32(a1, RFI_FILTER_BITS));
+		a2 = _mm_packs_epi32(_mm_srai_epi32(a2, RFI_FILTER_BITS),
+				_mm_srai_epi32(a3, RFI_FILTER_BITS));
+		_mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(a0, a2));
+	}
+	for (; i < len; i++)
+		out[i] = rfi_vfilter_px(rows, w, n, i);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static void rfi_vfilter_neon(BYTE *out, const BYTE *const *rows,
+		const int16_t *w, int n, int len)
+{
+	int32x4_t a0, a1;
+	int16x8_t r;
+	int i = 0, k;
+
+	for (; i + 8 <= len; i += 8) {
+		a0 = a1 = vdupq_n_s32(1 << (RFI_FILTER_BITS - 1));
+		for (k = 0; k < n; k++) {
+			r = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(rows[k] + i)));
+			a0 = vmlal_n_s16(a0, vget_low_s16(r), w[k]);
+			a1 = vmlal_n_s16(a1, vget_high_s16(r), w[k]);
+		}
+		vst1_u8(out + i, vqmovun_s16(vcombine_s16(
+				vqshrn_n_s32(a0, RFI_FILTER_BITS),
+				vqshrn_n_s32(a1, RFI_FILTER_BITS))));
+	}
+	for (; i < len; i++)
+		out[i] = rfi_vfilter_px(rows, w, n, i);
+}
+#endif
+
+static rfi_vfilter_fn rfi_vfilter_pick(void)
+{
+#ifdef RFI_HAVE_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		return rfi_vfilter_avx2;
+#endif
+#if defined(__SSE2__)
+	return rfi_vfilter_sse2;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	return rfi_vfilter_neon;
+#else
+	return rfi_vfilter_c;
+#endif
+}
+
+typedef void (*rfi_line_fn)(BYTE *dst, BYTE *src, int width, RGBQUAD *palette);
+
+/* FreeImage's own line converters, as used by its ConvertTo* functions */
+static void rfi_line_8_24(BYTE *dst, BYTE *src, int width, RGBQUAD *palette)
+{
+	FreeImage_ConvertLine8To24(dst, src, width, palette);
+}
+
+static void rfi_line_8_32(BYTE *dst, BYTE *src, int width, RGBQUAD *palette)
+{
+	FreeImage_ConvertLine8To32(dst, src, width, palette);
+}
+
+static void rfi_line_24_8(BYTE *dst, BYTE *src, int width, RGBQUAD *palette)
+{
+	FreeImage_ConvertLine24To8(dst, src, width);
+}
+
+static void rfi_line_24_32(BYTE *dst, BYTE *src, int width, RGBQUAD *palette)
+{
+	FreeImage_ConvertLine24To32(dst, src, width);
+}
+
+static void rfi_line_32_8(BYTE *dst, BYTE *src, int width, RGBQUAD *palette)
+{
+	FreeImage_ConvertLine32To8(dst, src, width);
+}
+
+static void rfi_line_32_24(BYTE *dst, BYTE *src, int width, RGBQUAD *palette)
+{
+	FreeImage_ConvertLine32To24(dst, src, width);
+}
+
+static rfi_line_fn rfi_line_converter(int from, int to)
+{
+	switch (from * 100 + to) {
+		case 824: return rfi_line_8_24;
+		case 832: return rfi_line_8_32;
+		case 2408: return rfi_line_24_8;
+		case 2432: return rfi_line_24_32;
+		case 3208: return rfi_line_32_8;
+		case 3224: return rfi_line_32_24;
+	}
+	return NULL;
+}
+
+struct rfi_rescale_job {
+	struct rfi_plane src;
+	struct rfi_plane dst;
+	struct rfi_filter_table *table;
+	rfi_vfilter_fn vfilter;
+	/* of src, filtered rows are converted to dst's depth with convert */
+	int channels;
+	rfi_line_fn convert;
+	RGBQUAD *palette;
+	int band;
+	int failed;
+};
+
+static void rfi_hfilter_row(const struct rfi_rescale_job *job, const BYTE *in, BYTE *out)
+{
+	const struct rfi_filter_table *t = job->table;
+	const int16_t *w;
+	const BYTE *p;
+	int32_t sum[4];
+	int x, k, c, ch = job->channels;
+
+	for (x = 0; x < job->dst.width; x++, out += ch) {
+		w = t->weight + (size_t)x * t->taps;
+		p = in + (size_t)t->left[x] * ch;
+#ifdef __SSE2__
+		if (ch == 4) {
+			const __m128i zero = _mm_setzero_si128();
+			__m128i acc = _mm_set1_epi32(1 << (RFI_FILTER_BITS - 1));
+			__m128i p0, p1, wv;
+			/* two pixels a step, each channel pairs up with (w[k], w[k+1]) */
+			for (k = 0; k < t->count[x]; k += 2, p += 8) {
+				p0 = _mm_cvtsi32_si128(*(const int32_t *)p);
+				p1 = k + 1 < t->count[x] ? _mm_cvtsi32_si128(*(const int32_t *)(p + 4)) : zero;
+				wv = _mm_set1_epi32((int)((uint32_t)(uint16_t)w[k + 1] << 16 | (uint16_t)w[k]));
+				acc = _mm_add_epi32(acc, _mm_madd_epi16(
+						_mm_unpacklo_epi8(_mm_unpacklo_epi8(p0, p1), zero), wv));
+			}
+			acc = _mm_srai_epi32(acc, RFI_FILTER_BITS);
+			acc = _mm_packs_epi32(acc, acc);
+			*(int32_t *)out = _mm_cvtsi128_si32(_mm_packus_epi16(acc, acc));
+			continue;
+		}
+#endif
+		for (c = 0; c < ch; c++)
+			sum[c] = 1 << (RFI_FILTER_BITS - 1);
+		for (k = 0; k < t->count[x]; k++, p += ch)
+			for (c = 0; c < ch; c++)
+				sum[c] += p[c] * w[k];
+		for (c = 0; c < ch; c++)
+			out[c] = rfi_clamp_q14(sum[c]);
+	}
+}
+
+static void rfi_hfilter_band(void *arg, int i)
+{
+	struct rfi_rescale_job *job = arg;
+	int y = i * job->band;
+	int end = y + job->band < job->dst.height ? y + job->band : job->dst.height;
+	BYTE *row = NULL;
+
+	if (job->convert && !(row = malloc((size_t)job->dst.width * job->channels))) {
+		job->failed = 1;
+		return;
+	}
+	for (; y < end; y++) {
+		if (!row) {
+			rfi_hfilter_row(job, RFI_ROW(&job->src, y), RFI_ROW(&job->dst, y));
+			continue;
+		}
+		rfi_hfilter_row(job, RFI_ROW(&job->src, y), row);
+		job->convert(RFI_ROW(&job->dst, y), row, job->dst.width, job->palette);
+	}
+	free(row);
+}
+
+static void rfi_vfilter_band(void *arg, int i)
+{
+	struct rfi_rescale_job *job = arg;
+	const struct rfi_filter_table *t = job->table;
+	int y = i * job->band;
+	int end = y + job->band < job->dst.height ? y + job->band : job->dst.height;
+	const BYTE **rows;
+	BYTE *row = NULL;
+	int k, n;
+
+	rows = malloc(sizeof(*rows) * t->taps);
+	if (job->convert && rows && !(row = malloc((size_t)job->dst.width * job->channels))) {
+		free(rows);
+		rows = NULL;
+	}
+	if (!rows) {
+		job->failed = 1;
+		return;
+	}
+	for (; y < end; y++) {
+		n = t->count[y];
+		for (k = 0; k < n; k++)
+			rows[k] = RFI_ROW(&job->src, t->left[y] + k);
+		/* the kernels take rows in pairs, the padding weight is 0 */
+		if (n & 1) {
+			rows[n] = rows[n - 1];
+			n++;
+		}
+		job->vfilter(row ? row : RFI_ROW(&job->dst, y), rows, t->weight + (size_t)y * t->taps,
+				n, job->dst.width * job->channels);
+		if (row)
+			job->convert(RFI_ROW(&job->dst, y), row, job->dst.width, job->palette);
+	}
+	free(row);
+	free(rows);
+}
+
+static void rfi_plane_of(struct rfi_plane *p, FIBITMAP *dib)
+{
+	p->bits = FreeImage_GetBits(dib);
+	p->pitch = FreeImage_GetPitch(dib);
+	p->width = FreeImage_GetWidth(dib);
+	p->height = FreeImage_GetHeight(dib);
+}
+
+/*
+ * one pass along x (vertical == 0) or y, into a new bitmap of depth bpp,
+ * convert turns src's rows into it
+ */
+static FIBITMAP *rfi_filter_pass(FIBITMAP *src, int width, int height,
+		FREE_IMAGE_FILTER filter, int vertical, int bpp, rfi_line_fn convert)
+{
+	static rfi_vfilter_fn vfilter;
+	struct rfi_rescale_job job;
+	FIBITMAP *dst;
+	int threads, nbands;
+
+	if (!vfilter)
+		vfilter = rfi_vfilter_pick();
+
+	dst = rfi_bitmap_allocate(width, height, bpp);
+	if (!dst)
+		return NULL;
+	memset(&job, 0, sizeof(job));
+	job.vfilter = vfilter;
+	job.channels = FreeImage_GetBPP(src) / 8;
+	job.convert = convert;
+	job.palette = FreeImage_GetPalette(src);
+	job.table = vertical ?
+		rfi_filter_table_get(FreeImage_GetHeight(src), height, filter) :
+		rfi_filter_table_get(FreeImage_GetWidth(src), width, filter);
+	if (!job.table) {
+		rfi_bitmap_unload(dst);
+		return NULL;
+	}
+	rfi_plane_of(&job.src, src);
+	rfi_plane_of(&job.dst, dst);
+
+	threads = rfi_pool_ncpu();
+	job.band = (height + threads * 4 - 1) / (threads * 4);
+	if (job.band < 1)
+		job.band = 1;
+	nbands = (height + job.band - 1) / job.band;
+	rfi_parallel_for(nbands, threads,
+			vertical ? rfi_vfilter_band : rfi_hfilter_band, &job);
+
+	rfi_filter_table_put(job.table);
+	if (job.failed) {
+		rfi_bitmap_unload(dst);
+		return NULL;
+	}
+	return dst;
+}
+
+FIBITMAP *rfi_rescale(FIBITMAP *src, int width, int height, FREE_IMAGE_FILTER filter)
+{
+	return rfi_rescale_to(src, width, height, filter, 0);
+}
+
+FIBITMAP *rfi_rescale_to(FIBITMAP *src, int width, int height, FREE_IMAGE_FILTER filter,
+		int out_bpp)
+{
+	FIBITMAP *tmp, *dst;
+	int bpp = FreeImage_GetBPP(src);
+	int sw, sh;
+	rfi_line_fn convert;
+
+	if (width <= 0 || height <= 0 || !FreeImage_HasPixels(src)
+			|| FreeImage_GetImageType(src) != FIT_BITMAP
+			|| filter < FILTER_BOX || filter > FILTER_LANCZOS3
+			|| (bpp != 24 && bpp != 32 && !(bpp == 8 && FreeImage_GetColorType(src) == FIC_MINISBLACK)))
+		return FreeImage_Rescale(src, width, height, filter);
+
+	/* the second pass converts its output rows */
+	convert = rfi_line_converter(bpp, out_bpp);
+	if (!convert)
+		out_bpp = bpp;
+	sw = FreeImage_GetWidth(src);
+	sh = FreeImage_GetHeight(src);
+	/* same order as FreeImage, the smaller intermediate first */
+	if ((double)width * sh <= (double)height * sw) {
+		tmp = rfi_filter_pass(src, width, sh, filter, 0, bpp, NULL);
+		dst = tmp ? rfi_filter_pass(tmp, width, height, filter, 1, out_bpp, convert) : NULL;
+	} else {
+		tmp = rfi_filter_pass(src, sw, height, filter, 1, bpp, NULL);
+		dst = tmp ? rfi_filter_pass(tmp, width, height, filter, 0, out_bpp, convert) : NULL;
+	}
+	if (tmp)
+		rfi_bitmap_unload(tmp);
+	if (dst)
+		rfi_copy_info(dst, src, 0);
+	return dst;
+}
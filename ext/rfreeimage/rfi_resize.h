@@ -0,0 +1,38 @@
+#ifndef RFI_RESIZE_H
+#define RFI_RESIZE_H
+
+#include <FreeImage.h>
+
+/*
+ * Area average resize of an 8 (greyscale), 24 or 32 bpp bitmap: every
+ * output pixel is the mean of the source area it covers, for any ratio.
+ * Rows are spread over the thread pool. Returns NULL for other bitmaps
+ * or when out of memory.
+ */
+FIBITMAP *rfi_area_resize(FIBITMAP *src, int width, int height);
+
+/*
+ * rfi_area_resize of a bitmap as stored, with the output shown as Exif
+ * orientation (1..8) says: width x height is the size once rotated. Each
+ * output row is written straight to where it ends up, so no rotated copy
+ * of src is ever made.
+ */
+FIBITMAP *rfi_area_resize_oriented(FIBITMAP *src, int width, int height, int orientation);
+
+/*
+ * Separable resample with FreeImage_Rescale's filters, weights and pass
+ * order, in 14-bit fixed point and spread over the thread pool. Filter
+ * weights are cached per (source size, size, filter). Bitmaps other than
+ * 8 (greyscale), 24 or 32 bpp go to FreeImage_Rescale.
+ */
+FIBITMAP *rfi_rescale(FIBITMAP *src, int width, int height, FREE_IMAGE_FILTER filter);
+
+/*
+ * rfi_rescale with the output rows converted to 8, 24 or 32 bpp as they
+ * are written, like FreeImage's ConvertTo* would after it. The result
+ * keeps src's depth when that can't be done on the fly.
+ */
+FIBITMAP *rfi_rescale_to(FIBITMAP *src, int width, int height, FREE_IMAGE_FILTER filter,
+		int bpp);
+
+#endif
@@ -41,6 +41,15 @@ module RFreeImage
 			to_bpp 8
 		end
 
+		def bgr?
+			bpp == ImageBPP::BGR
+		end
+
+		def to_bgr
+			return self if bgr?
+			to_bpp 24
+		end
+
 		def bgra?
 			bpp == ImageBPP::BGRA
 		end
@@ -50,31 +59,184 @@ module RFreeImage
 			to_bpp 32
 		end
 
+		# Where io_buffer keeps each pixel, top row first: channel c of
+		# (x, y) is at offset + y * strides[0] + x * strides[1] + c
+		def pixel_layout
+			ch = bpp / 8
+			return { shape: [rows, cols, ch], strides: [stride, ch, 1], offset: 0 } if top_down?
+			{ shape: [rows, cols, ch], strides: [-stride, ch, 1], offset: (rows - 1) * stride }
+		end
+
 		def resize(width, height, filter = Filter::FILTER_CATMULLROM)
 			return self.rescale(width, height, filter)
 		end
 
+    # Image.new then downscale, for thumbnails. JPEGs are scaled by the
+    # codec, and their Exif orientation is applied by the downscale pass
+    # rather than to a full decode.
     def self.load_downscale file, max_size
-      # only work on jpeg
-      img = Image.new file, 0, max_size
-      _downscale_nocopy img, max_size
+      _load_downscale file, false, max_size
     end
 
     def self.from_blob_downscale blob, max_size
-      # only work on jpeg
-      img = Image.from_blob blob, 0, max_size
-      _downscale_nocopy img, max_size
+      _load_downscale blob, true, max_size
+    end
+
+    # Decode many images at once on a native thread pool. sources are file
+    # names, or image blobs with blob: true. Returns one Image, or the
+    # exception raised while loading it, per source.
+    def self.load_batch sources, blob: false, bpp: 0, max_size_hint: 0, threads: 0
+      _load_batch sources, blob, bpp, max_size_hint, threads
+    end
+
+    # Format, width and height (as stored) and Exif orientation of a file,
+    # or with blob: true of a blob, which may be just its first few KB.
+    def self.probe src, blob: false
+      _probe src, blob
+    end
+
+    # Image.probe for many files or blobs at once, on the thread pool.
+    # Returns one Hash, or the exception raised while probing, per source.
+    def self.ping_batch sources, blob: false, threads: 0
+      _ping_batch sources, blob, threads
+    end
+
+    # Rotate, flip or crop a JPEG file (or blob, with blob: true) without
+    # decoding it, and return the new JPEG. op is :none, :flip_horizontal,
+    # :flip_vertical, :transpose, :transverse or :rotate_90/180/270
+    # (clockwise). crop, [left, top, right, bottom] of the result, is
+    # widened to whole MCUs. Partial MCUs at the right and bottom edges are
+    # trimmed unless perfect is set, which raises instead. With orient, op
+    # applies to the image as its Exif orientation shows it, and the result
+    # has none; jpeg_transform(src) alone does that normalisation.
+    def self.jpeg_transform src, op = :none, blob: false, crop: nil, perfect: false, orient: true
+      _jpeg_transform src, blob, nil, op, crop, perfect, orient
+    end
+
+    # jpeg_transform, written to the file dst
+    def self.jpeg_transform_file src, dst, op = :none, blob: false, crop: nil, perfect: false,
+                                 orient: true
+      _jpeg_transform src, blob, dst, op, crop, perfect, orient
+    end
+
+    # Decode only rect, [left, top, right, bottom], of a file (or blob, with
+    # blob: true) at 1/scale size (1, 2, 4 or 8). JPEGs are scaled by the codec and, with
+    # libjpeg-turbo, decode little more than the iMCUs under rect; other
+    # formats are decoded whole, then cropped and shrunk.
+    def self.load_region src, rect, blob: false, scale: 1, bpp: 0
+      _load_region src, blob, rect, scale, bpp
+    end
+
+    # Decode a blob on the thread pool; only the calling thread (or fiber,
+    # under a fiber scheduler) waits for it. load_job returns the Job
+    # right away, for callers that want to wait on its fileno themselves.
+    def self.load_async blob, bpp = 0, max_size_hint = 0
+      load_job(blob, bpp, max_size_hint).value
+    end
+
+    # to_blob on the thread pool, see load_async
+    def to_blob_async type, **opts
+      to_blob_job(type, opts).value
+    end
+
+    # Draw many primitives in one call. packed is a String of native int32
+    # (Array#pack("l*")) or an Array of integers, one record per shape:
+    #   draw_rectangles: x1, y1, x2, y2, color, width
+    #   draw_lines:      x1, y1, x2, y2, color, width
+    #   draw_points:     x, y, color, size
+    # tile_sort draws the rectangles grouped by 64x64 tiles for locality,
+    # overlapping rectangles may then stack in another order.
+    def draw_rectangles packed, tile_sort: false
+      _draw_rectangles packed, tile_sort
+    end
+
+    def draw_lines packed, antialias: false
+      _draw_lines packed, antialias
+    end
+
+    # In-place variants: the image's bitmap is flipped, or replaced by
+    # the result, so the full-size original is freed right away. They
+    # return self.
+    def flip_horizontal!
+      _flip_horizontal!
+      @bytes = nil
+      self
+    end
+
+    def flip_vertical!
+      _flip_vertical!
+      @bytes = nil
+      self
+    end
+
+    def crop! left, top, right, bottom
+      _crop! left, top, right, bottom
+      @bytes = nil
+      self
+    end
+
+    def to_bpp! bpp
+      _to_bpp! bpp
+      @bytes = nil
+      self
+    end
+
+    def rotate! angle
+      _rotate! angle
+      @bytes = nil
+      self
+    end
+
+    def downscale! max_size
+      _downscale! max_size
+      @bytes = nil
+      self
+    end
+
+    # Records crop, resize and to_bpp, run together by image or encode:
+    #   img.pipeline.crop(l, t, r, b).resize(w, h).to_bpp(8).encode("jpeg")
+    # gives what the eager calls would, without full-size intermediates.
+    def pipeline
+      Pipeline.new self
     end
 
 		alias_method :write, :save
 		alias_method :columns, :cols
 
-    private
-    def self._downscale_nocopy img, max_size
-      return img if img.cols <= max_size && img.rows <= max_size
-      nimg = img.downscale max_size
-      img.destroy!
-      nimg
+    class Pipeline
+      def initialize image
+        @image = image
+        @steps = []
+      end
+
+      def crop left, top, right, bottom
+        @steps << [:crop, left, top, right, bottom]
+        self
+      end
+
+      def resize width, height, filter = Filter::FILTER_CATMULLROM
+        @steps << [:resize, width, height, filter]
+        self
+      end
+
+      def to_bpp bpp
+        @steps << [:to_bpp, bpp]
+        self
+      end
+
+      def to_gray
+        to_bpp ImageBPP::GRAY
+      end
+
+      # a new Image with the steps applied
+      def image
+        @image._pipeline @steps, nil, nil
+      end
+
+      # the result encoded as type, see Image#to_blob
+      def encode type, **opts
+        @image._pipeline @steps, type, opts
+      end
     end
   end
 end
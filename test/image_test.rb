@@ -1,11 +1,25 @@
 require "test/unit"
 require 'tempfile'
+require 'stringio'
+require 'zlib'
 require 'rfreeimage'
 
 def get_image fn
 	File.expand_path("../images/#{fn}", __FILE__)
 end
 
+# a JPEG blob with an APP1 segment tagging it with Exif orientation o
+def with_orientation jpeg, o
+	tiff = ["II*\0", 8, 1, 0x112, 3, 1, o, 0, 0].pack("a4VvvvVvvV")
+	app1 = "Exif\0\0".b + tiff
+	jpeg[0, 2] + "\xFF\xE1".b + [app1.size + 2].pack("n") + app1 + jpeg[2..-1]
+end
+
+# density unit and x, y densities in the JFIF header of a JPEG blob
+def jfif_density jpeg
+	jpeg[13, 5].unpack("Cnn")
+end
+
 def assert_dim img
 	byte_per_pixel = img.bpp / 8
 	assert img.stride % 4 == 0
@@ -255,6 +269,24 @@ class TestFastZoomout < Test::Unit::TestCase
     # nimg2.write '/tmp/t2.jpg'
   end
 
+  def test_area_average
+    gray = Image.from_bytes [0, 255, 10, 20, 100, 155, 30, 40].pack("C*"), 4, 2, 4, ImageBPP::GRAY
+    assert_equal [128, 25], gray.shrink(2, 1).bytes.unpack("C*")
+    assert_equal [30, 150], Image.from_bytes([0, 90, 180].pack("C*"), 3, 1, 3, ImageBPP::GRAY).shrink(2, 1).bytes.unpack("C*")
+    bgra = Image.from_bytes [0, 10, 20, 255, 100, 110, 120, 255].pack("C*"), 2, 1, 8, ImageBPP::BGRA
+    assert_equal [50, 60, 70, 255], bgra.shrink(1, 1).bytes.unpack("C*")
+    assert_raise ArgumentError do
+      @img.shrink 0, 10
+    end
+  end
+
+  def test_shrink
+    img = @img.shrink 123, 77
+    assert_equal [123, 77], [img.cols, img.rows]
+    assert_equal [1, 100, 100], jfif_density(img.to_blob("jpeg"))
+    assert_equal @gray.shrink(123, 77).bytes, @gray.to_bgra.shrink(123, 77).to_gray.bytes
+  end
+
   def test_load_downscale
     img = Image.load_downscale get_image("test.jpg"), 100
     assert img.cols <= 100
@@ -287,3 +319,926 @@ class TestFlip < Test::Unit::TestCase
     assert_not_equal img_flip_v.bytes, @img.bytes
   end
 end
+
+class TestFill < Test::Unit::TestCase
+  def blank bpp
+    Image.from_bytes "\0" * (40 * 30 * bpp / 8), 40, 30, 40 * bpp / 8, bpp
+  end
+
+  def test_fill_rectangle
+    # red is grey level 54 at 8 bpp
+    { ImageBPP::GRAY => [54], ImageBPP::BGR => [0, 0, 255], ImageBPP::BGRA => [0, 0, 255, 255] }.each do |bpp, red|
+      img = blank(bpp).fill_rectangle 35, 2, -5, 4, Color::RED
+      empty = [0] * red.size * 40
+      row = red * 36 + [0] * red.size * 4
+      assert_equal empty * 2 + row * 3 + empty * 25, img.bytes.unpack("C*")
+    end
+  end
+
+  def test_fill_quadrangle
+    quad = [5, 3, 36, 10, 28, 27, -4, 20]
+    inside = lambda do |x, y|
+      d = 4.times.map do |i|
+        x1, y1, x2, y2 = quad[2 * i], quad[2 * i + 1], quad[(2 * i + 2) % 8], quad[(2 * i + 3) % 8]
+        (x2 - x1) * (y - y1) - (y2 - y1) * (x - x1)
+      end
+      d.all? { |v| v > 0 } || d.all? { |v| v < 0 }
+    end
+    expected = 30.times.flat_map { |y| 40.times.map { |x| inside[x, y] ? 255 : 0 } }
+    img = blank(ImageBPP::GRAY).fill_quadrangle(*quad, Color::WHITE)
+    assert_equal expected, img.bytes.unpack("C*")
+    img = blank(ImageBPP::GRAY).fill_quadrangle(*quad.each_slice(2).to_a.reverse.flatten, Color::WHITE)
+    assert_equal expected, img.bytes.unpack("C*")
+  end
+
+  def test_fill_quadrangle_far
+    max, min = 2**31 - 1, -2**31
+    # covers the canvas, edges far outside it
+    img = blank(ImageBPP::GRAY).fill_quadrangle(min, min, max, min, max, max, min, max, Color::WHITE)
+    assert_equal [255] * 1200, img.bytes.unpack("C*")
+    # the diagonal y = x through the canvas, from corner to corner of the int range
+    img = blank(ImageBPP::GRAY).fill_quadrangle(min, min, max, max, max, 0, 0, min, Color::WHITE)
+    expected = 30.times.flat_map { |y| 40.times.map { |x| x > y ? 255 : 0 } }
+    assert_equal expected, img.bytes.unpack("C*")
+  end
+end
+
+class TestDrawLine < Test::Unit::TestCase
+  def blank
+    Image.from_bytes "\0" * 600, 30, 20, 30, ImageBPP::GRAY
+  end
+
+  def pixels img
+    img.bytes.unpack("C*").each_slice(img.cols).to_a
+  end
+
+  def test_thin_line
+    rows = pixels blank.draw_line(5, 1, 8, 18, Color::WHITE, 1)
+    # one pixel per row, no gaps on steep lines
+    assert_equal [0] + [1] * 18 + [0], rows.map { |r| r.count 255 }
+    assert_equal [5, 8], [rows[1].index(255), rows[18].index(255)]
+  end
+
+  def test_thick_line
+    rows = pixels blank.draw_line(3, 10, 26, 10, Color::WHITE, 4)
+    assert_equal [0] * 8 + [24, 26, 28, 26, 24] + [0] * 7, rows.map { |r| r.count 255 }
+    rows = pixels blank.draw_line(2, 2, 27, 15, Color::WHITE, 5, true)
+    assert rows.flatten.any? { |v| v > 0 && v < 255 }
+    assert_equal 255, rows[8][14]
+  end
+
+  def test_far_off_canvas
+    max, min = 2**31 - 1, -2**31
+    rows = pixels blank.draw_line(min, min, max, max, Color::WHITE, 1)
+    assert_equal 20.times.to_a, rows.map { |r| r.index 255 }
+    assert_equal [1] * 20, rows.map { |r| r.count 255 }
+    assert_equal [0] * 600, blank.draw_line(min, 5, -10, 5, Color::WHITE, 1).bytes.unpack("C*")
+    rows = pixels blank.draw_line(min, 10, max, 10, Color::WHITE, 3)
+    assert_equal [0] * 9 + [30] * 3 + [0] * 8, rows.map { |r| r.count 255 }
+    assert_equal [255] * 600, blank.draw_point(0, 0, Color::WHITE, max).bytes.unpack("C*")
+    assert_equal [255] * 600, blank.draw_rectangle(0, 0, 29, 19, Color::WHITE, max).bytes.unpack("C*")
+  end
+end
+
+class TestDrawBatch < Test::Unit::TestCase
+  def blank
+    Image.from_bytes "\0" * 4 * 200 * 150, 200, 150, 800, ImageBPP::BGRA
+  end
+
+  def test_draw_rectangles
+    rects = 50.times.map { |i| [i * 3, (i * 7) % 140, i * 3 + 20, (i * 7) % 140 + 9, Color::RED + i, i % 4] }
+    expected = blank
+    rects.each { |r| expected.draw_rectangle(*r) }
+    assert_equal expected.bytes, blank.draw_rectangles(rects.flatten.pack("l*")).bytes
+    assert_equal expected.bytes, blank.draw_rectangles(rects).bytes
+    # distinct tiles, no overlaps: same pixels in any order
+    tiles = [[130, 70, 180, 90, Color::RED, 1], [10, 10, 40, 40, Color::BLUE, 3]]
+    assert_equal blank.draw_rectangles(tiles).bytes, blank.draw_rectangles(tiles, tile_sort: true).bytes
+    assert_raise ArgumentError do
+      blank.draw_rectangles [1, 2, 3]
+    end
+    assert_raise ArgumentError do
+      blank.draw_rectangles [1, 2, 3, 4, Color::RED, -1]
+    end
+  end
+
+  def test_draw_lines_points
+    lines = [[0, 0, 199, 149, Color::GREEN, 1], [5, 140, 190, 3, Color::YELLOW, 5]]
+    expected = blank
+    lines.each { |l| expected.draw_line(*l, true) }
+    assert_equal expected.bytes, blank.draw_lines(lines.flatten.pack("L*"), antialias: true).bytes
+    expected = blank.draw_point(10, 10, Color::WHITE, 6).draw_point(100, 50, Color::CYAN, 3)
+    assert_equal expected.bytes, blank.draw_points([10, 10, Color::WHITE, 6, 100, 50, Color::CYAN, 3]).bytes
+  end
+end
+
+class TestExport < Test::Unit::TestCase
+  def setup
+    @img = Image.new(get_image("test.jpg"), ImageBPP::BGR).crop(10, 20, 41, 37)
+  end
+
+  def test_io_buffer
+    buf = @img.io_buffer
+    assert_same buf, @img.io_buffer
+    l = @img.pixel_layout
+    assert_equal [17, 31, 3], l[:shape]
+    bytes = l[:shape][0].times.map { |y| buf.get_string(l[:offset] + y * l[:strides][0], 31 * 3) }.join
+    assert_equal @img.bytes, bytes
+    @img.release
+    assert_raise IO::Buffer::AllocationError do
+      buf.get_string
+    end
+  end
+
+  def test_locked_io_buffer
+    buf = @img.io_buffer
+    bytes = @img.bytes
+    buf.locked do
+      assert_raise(ImageError) { @img.to_bpp! ImageBPP::GRAY }
+      assert_raise(ImageError) { @img.release }
+    end
+    assert_equal bytes, @img.bytes
+    @img.to_bpp! ImageBPP::GRAY
+  end
+
+  def test_memory_view
+    require 'fiddle'
+    view = Fiddle::MemoryView.new @img
+    assert_equal [17, 31, 3], view.shape
+    assert_equal [-@img.stride, 3, 1], view.strides
+    assert_equal @img.bytes.getbyte((2 * 31 + 5) * 3 + 1), view[2, 5, 1]
+    assert_raise ImageError do
+      @img.release
+    end
+    view.release
+    @img.release
+  end
+end
+
+class TestWrapBytes < Test::Unit::TestCase
+  def setup
+    @src = Image.new(get_image("test.jpg"), ImageBPP::BGR).crop(0, 0, 61, 40)
+    @data = @src.bytes.dup
+  end
+
+  def test_wrap_top_down
+    img = Image.wrap_bytes @data, 61, 40, 61 * 3, ImageBPP::BGR
+    assert img.top_down?
+    assert_equal @src.bytes, img.bytes
+    buf = img.io_buffer
+    assert buf.readonly?
+    assert_equal @data.b, buf.get_string(0, 61 * 3 * 40)
+    assert_equal @src.to_blob("png"), img.to_blob("png")
+    assert img.top_down?
+    assert_same buf, img.io_buffer
+  end
+
+  def test_read_while_exported
+    require 'fiddle'
+    img = Image.wrap_bytes @data, 61, 40, 61 * 3, ImageBPP::BGR
+    buf = img.io_buffer
+    view = Fiddle::MemoryView.new img
+    buf.locked do
+      assert_equal Image.from_blob(@src.to_blob("jpeg")).bytes, Image.from_blob(img.to_blob("jpeg")).bytes
+      assert_equal @src.to_blob("png"), img.to_blob_job("png").value
+      assert_equal @src.resize(20, 10).bytes, img.resize(20, 10).bytes
+      assert_equal @src.crop(5, 6, 30, 20).bytes, img.crop(5, 6, 30, 20).bytes
+      assert_equal @src.crop(5, 6, 30, 20).bytes, img.crop_view(5, 6, 30, 20).clone.bytes
+      assert_equal @src.flip_vertical.bytes, img.flip_vertical.bytes
+      assert_equal @src.bytes, img.clone.bytes
+      assert_equal @src.crop(0, 0, 30, 20).to_gray.bytes, img.pipeline.crop(0, 0, 30, 20).to_bpp(8).image.bytes
+      assert_raise(ImageError) { img.fill_rectangle 0, 0, 10, 10, Color::RED }
+    end
+    assert img.top_down?
+    assert_equal @data.b, buf.get_string(0, 61 * 3 * 40)
+    assert_equal @src.bytes.getbyte(5), view[0, 1, 2]
+    view.release
+  end
+
+  def test_wrap_bottom_up
+    rows = @data.scan(/.{#{61 * 3}}/m).reverse.join
+    img = Image.wrap_bytes rows, 61, 40, 61 * 3, ImageBPP::BGR, false
+    assert !img.top_down?
+    assert_equal @src.resize(20, 10).bytes, img.resize(20, 10).bytes
+    assert_equal @src.bytes, img.read_bytes
+  end
+
+  def test_copy_on_write
+    orig = @data.dup
+    img = Image.wrap_bytes @data, 61, 40, 61 * 3, ImageBPP::BGR
+    @data.setbyte 0, 255 - @data.getbyte(0)
+    assert_equal orig, img.read_bytes
+    img.fill_rectangle 0, 0, 10, 10, Color::RED
+    assert_not_equal orig, img.read_bytes
+    assert_equal orig.getbyte(1), @data.getbyte(1)
+    assert_raise ArgumentError do
+      Image.wrap_bytes @data, 61, 40, 60, ImageBPP::BGR
+    end
+  end
+end
+
+class TestMemoryStats < Test::Unit::TestCase
+  def test_memory_stats
+    require 'objspace'
+    # images of other tests must not be collected meanwhile
+    GC.start
+    GC.disable
+    before = RFreeImage.memory_stats
+    img = Image.new get_image("test.jpg")
+    stats = RFreeImage.memory_stats
+    assert_equal before[:live_bytes] + img.stride * img.rows, stats[:live_bytes]
+    assert_equal before[:live_images] + 1, stats[:live_images]
+    assert stats[:peak_bytes] >= stats[:live_bytes]
+    assert ObjectSpace.memsize_of(img) >= img.stride * img.rows
+    wrapped = Image.wrap_bytes "\0" * 300, 10, 10, 30, ImageBPP::BGR
+    assert_equal stats[:live_bytes], RFreeImage.memory_stats[:live_bytes]
+    wrapped.release
+    img.release
+    assert_equal before, RFreeImage.memory_stats.merge(peak_bytes: before[:peak_bytes])
+  ensure
+    GC.enable
+  end
+end
+
+class TestBufferPool < Test::Unit::TestCase
+  def test_reuse
+    data = File.read get_image("test.jpg")
+    Image.from_blob(data).release
+    before = RFreeImage.buffer_pool_stats
+    assert before[:cached_bytes] > 0
+    img = Image.from_blob data
+    assert_equal before[:hits] + 1, RFreeImage.buffer_pool_stats[:hits]
+    assert_equal Image.from_blob(data).bytes, img.bytes
+    assert_equal img.bytes, img.clone.bytes
+    img.release
+    RFreeImage.buffer_pool_trim
+    assert_equal 0, RFreeImage.buffer_pool_stats[:cached_bytes]
+  end
+
+  def test_no_stale_pixels
+    blob = File.binread get_image("test.jpg")
+    cut = blob[0, blob.size / 2]
+    fresh = Image.from_blob(cut).bytes
+    # a pooled block of the same size, full of noise
+    Image.from_bytes(Random.new(1).bytes(500 * 588 * 4), 500, 588, 2000, ImageBPP::BGRA).release
+    assert_equal fresh, Image.from_blob(cut).bytes
+
+    # 24 bpp rows of 501 pixels have one byte of padding
+    Image.from_bytes("\xFF".b * (1504 * 200), 1504, 200, 1504, ImageBPP::GRAY).release
+    img = Image.from_bytes "\0" * (501 * 3 * 200), 501, 200, 501 * 3, ImageBPP::BGR
+    assert_equal 1504, img.stride
+    assert_equal "\0" * (1504 * 200), img.io_buffer.get_string
+  end
+
+  def test_limit
+    limit = RFreeImage.buffer_pool_stats[:limit]
+    RFreeImage.buffer_pool_limit = 0
+    Image.from_blob(File.read(get_image("test.jpg"))).release
+    assert_equal 0, RFreeImage.buffer_pool_stats[:cached_blocks]
+    assert_raise(ArgumentError) { RFreeImage.buffer_pool_limit = -1 }
+  ensure
+    RFreeImage.buffer_pool_limit = limit
+  end
+end
+
+class TestInPlace < Test::Unit::TestCase
+  def setup
+    @img = Image.new get_image("test.jpg")
+  end
+
+  def test_same_as_copying
+    [[:flip_horizontal], [:flip_vertical], [:crop, 10, 20, 110, 70],
+     [:to_bpp, 8], [:rotate, 90], [:downscale, 100]].each do |m, *args|
+      expected = @img.send(m, *args)
+      img = @img.clone
+      img.bytes
+      assert_same img, img.send("#{m}!", *args)
+      assert_equal [expected.cols, expected.rows, expected.bpp], [img.cols, img.rows, img.bpp]
+      assert_equal expected.bytes, img.bytes, m
+    end
+  end
+
+  def test_frees_original
+    GC.disable
+    full = @img.stride * @img.rows
+    before = RFreeImage.memory_stats[:live_bytes]
+    @img.crop! 0, 0, 10, 10
+    assert_equal before - full + @img.stride * 10, RFreeImage.memory_stats[:live_bytes]
+  ensure
+    GC.enable
+  end
+
+  def test_wrapped
+    data = "\x10" * 300
+    img = Image.wrap_bytes data, 10, 10, 30, ImageBPP::BGR
+    img.flip_vertical!
+    assert_equal "\x10" * 300, data
+    assert !img.top_down?
+  end
+end
+
+class TestCropView < Test::Unit::TestCase
+  def setup
+    @img = Image.new get_image("test.jpg"), ImageBPP::BGR
+  end
+
+  def test_shares_pixels
+    view = @img.crop_view 10, 20, 110, 70
+    assert_equal [100, 50], [view.cols, view.rows]
+    assert_equal @img.crop(10, 20, 110, 70).bytes, view.bytes
+    inner = view.crop_view 5, 5, 25, 25
+    assert_equal @img.crop(15, 25, 35, 45).bytes, inner.bytes
+    assert_equal @img.stride, view.stride
+    assert_raise(RFreeImage::ImageError) { @img.release }
+    assert_raise(RFreeImage::ImageError) { @img.crop! 0, 0, 10, 10 }
+    assert_raise(RFreeImage::ImageError) { @img.flip_horizontal! }
+    assert_raise(RFreeImage::ImageError) { @img.fill_rectangle 10, 20, 20, 30, Color::RED }
+    assert_equal @img.crop(15, 25, 35, 45).bytes, inner.bytes
+    view.release
+    inner.release
+    @img.flip_vertical!
+    @img.release
+  end
+
+  def test_copy_on_write
+    view = @img.crop_view 10, 20, 110, 70
+    parent = @img.crop(10, 20, 110, 70).bytes
+    view.fill_rectangle 0, 0, 99, 49, Color::RED
+    assert_equal parent, @img.crop(10, 20, 110, 70).bytes
+    assert_not_equal parent, view.read_bytes
+    @img.release
+  end
+
+  def test_keeps_parent
+    view = Image.new(get_image("test.jpg")).crop_view 0, 0, 50, 50
+    expected = view.read_bytes
+    GC.start
+    assert_equal expected, view.read_bytes
+    assert_raise(ArgumentError) { view.crop_view 0, 0, 60, 10 }
+  end
+end
+
+class TestPipeline < Test::Unit::TestCase
+  def setup
+    @img = Image.new get_image("test.jpg")
+  end
+
+  def test_same_as_eager
+    [ImageBPP::BGRA, ImageBPP::BGR].each do |bpp|
+      img = @img.to_bpp bpp
+      expected = img.crop(30, 40, 230, 190).resize(64, 48).to_bpp(8)
+      result = img.pipeline.crop(30, 40, 230, 190).resize(64, 48).to_bpp(8).image
+      assert_equal [64, 48, 8], [result.cols, result.rows, result.bpp]
+      assert_equal expected.bytes, result.bytes
+    end
+    assert_equal @img.crop(10, 10, 50, 40).crop(5, 5, 20, 20).bytes,
+      @img.pipeline.crop(10, 10, 50, 40).crop(5, 5, 20, 20).image.bytes
+    assert_equal @img.to_bpp(24).resize(33, 21, Filter::FILTER_BILINEAR).bytes,
+      @img.pipeline.to_bpp(24).resize(33, 21, Filter::FILTER_BILINEAR).image.bytes
+    assert_equal @img.bytes, @img.pipeline.image.bytes
+  end
+
+  def test_encode
+    expected = @img.crop(0, 0, 100, 80).resize(50, 40).to_blob("png")
+    assert_equal expected, @img.pipeline.crop(0, 0, 100, 80).resize(50, 40).encode("png")
+    assert_equal @img.crop(5, 5, 25, 25).to_blob("png"), @img.pipeline.crop(5, 5, 25, 25).encode("png")
+  end
+
+  def test_invalid
+    assert_raise(ArgumentError) { @img.pipeline.crop(0, 0, 10, 10).crop(0, 0, 20, 5).image }
+    assert_raise(ArgumentError) { @img.pipeline.resize(0, 10).image }
+    assert_raise(ArgumentError) { @img.pipeline.to_bpp(16).image }
+  end
+end
+
+class TestLoadRegion < Test::Unit::TestCase
+  def setup
+    @file = get_image("test.jpg")
+    @blob = File.binread @file
+  end
+
+  def test_region
+    [ImageBPP::GRAY, ImageBPP::BGR, ImageBPP::BGRA].each do |bpp|
+      full = Image.new @file, bpp
+      img = Image.load_region @file, [37, 21, 170, 99], bpp: bpp
+      assert_equal [133, 78, bpp], [img.cols, img.rows, img.bpp]
+      assert_equal full.crop(37, 21, 170, 99).bytes, img.bytes
+    end
+    png = Image.new(@file).to_blob("png")
+    assert_equal Image.new(@file).crop(5, 6, 50, 40).bytes, Image.load_region(png, [5, 6, 50, 40], blob: true).bytes
+    assert_raise(ArgumentError) { Image.load_region @file, [0, 0, 100000, 10] }
+    assert_raise(ArgumentError) { Image.load_region @file, [0, 0, 10, 10], scale: 3 }
+  end
+
+  def test_scale
+    full = Image.new @file
+    half = Image.new @file, 0, (full.cols + 1) / 2
+    img = Image.load_region @blob, [32, 16, 160, 96], blob: true, scale: 2
+    assert_equal half.crop(16, 8, 80, 48).bytes, img.bytes
+  end
+
+  def test_orientation
+    (1..8).each do |o|
+      blob = with_orientation @blob, o
+      expected = Image.from_blob(blob).crop(11, 5, 60, 90)
+      assert_equal expected.bytes, Image.load_region(blob, [11, 5, 60, 90], blob: true).bytes, "orientation #{o}"
+    end
+  end
+end
+
+class TestStreamIO < Test::Unit::TestCase
+  # only read, no seek: a pipe or socket
+  class Reader
+    def initialize data
+      @data = data
+      @pos = 0
+    end
+
+    def read n
+      return nil if @pos >= @data.size
+      s = @data.byteslice(@pos, n)
+      @pos += s.size
+      s
+    end
+  end
+
+  def test_read_io
+    blob = File.binread get_image("test.jpg")
+    expected = Image.from_blob blob
+    img = Image.read_io StringIO.new(blob)
+    assert_equal expected.bytes, img.bytes
+    assert_equal "JPEG", img.format
+
+    png = expected.to_blob "png"
+    img = Image.read_io Reader.new(png), 24
+    assert_equal Image.from_blob(png, 24).bytes, img.bytes
+
+    File.open(get_image("test.jpg"), "rb") do |f|
+      img = Image.read_io f
+      assert_equal [500, 588], [img.cols, img.rows]
+    end
+    assert_raise(IOError) { Image.read_io StringIO.new("not an image") }
+  end
+
+  def test_write_io
+    img = Image.new get_image("test.jpg")
+    io = StringIO.new "".b
+    assert_nil img.write_io(io, "png")
+    assert_equal img.to_blob("png"), io.string
+
+    r, w = IO.pipe
+    r.binmode
+    reader = Thread.new { r.read }
+    img.write_io w, "jpg"
+    w.close
+    assert_equal img.to_blob("jpg"), reader.value
+  end
+
+  def test_io_errors
+    bad = Object.new
+    def bad.read(n); raise Errno::EIO; end
+    def bad.write(s); raise Errno::EPIPE; end
+    assert_raise(Errno::EIO) { Image.read_io bad }
+    assert_raise(Errno::EPIPE) { Image.new(get_image("test.jpg")).write_io bad, "png" }
+  end
+end
+
+class TestProbe < Test::Unit::TestCase
+  def setup
+    @file = get_image("test.jpg")
+    @blob = File.binread @file
+  end
+
+  def info format, width, height, orientation = 0
+    { format: format, width: width, height: height, orientation: orientation }
+  end
+
+  def test_probe
+    assert_equal info("JPEG", 500, 588), Image.probe(@file)
+    # only up to the frame header
+    assert_equal info("JPEG", 500, 588), Image.probe(@blob[0, 200], blob: true)
+    rotated = with_orientation @blob[0, 302], 6
+    assert_equal info("JPEG", 500, 588, 6), Image.probe(rotated, blob: true)
+
+    png = Image.new(@file).to_blob("png")
+    assert_equal info("PNG", 500, 588), Image.probe(png[0, 33], blob: true)
+    gif = ["GIF89a", 300, 20, 0xF7, 0, 0].pack("a6vvCCC")
+    assert_equal info("GIF", 300, 20), Image.probe(gif, blob: true)
+    bmp = ["BM", 0, 0, 54, 40, 640, -480, 1, 24].pack("a2VVVVVl<vv")
+    assert_equal info("BMP", 640, 480), Image.probe(bmp, blob: true)
+    vp8l = ["RIFF", 100, "WEBPVP8L", 90, 0x2F, 799 | 399 << 14].pack("a4Va8VCV")
+    assert_equal info("WEBP", 800, 400), Image.probe(vp8l, blob: true)
+    vp8x = ["RIFF", 100, "WEBPVP8X", 10, 0, 1023, 0, 767, 0, 0].pack("a4Va8VVvCvCC")
+    assert_equal info("WEBP", 1024, 768), Image.probe(vp8x, blob: true)
+    # no NUL byte in it, still a blob
+    gif = ["GIF89a", 300, 276, 0xF7, 1, 1].pack("a6vvCCC")
+    assert_equal info("GIF", 300, 276), Image.probe(gif, blob: true)
+  end
+
+  def test_probe_errors
+    assert_raise(IOError) { Image.probe "XXX.jpg" }
+    assert_raise(IOError) { Image.probe @blob[0, 100], blob: true }
+    assert_raise(IOError) { Image.probe @file, blob: true }
+  end
+
+  def test_ping_batch
+    tiff = Image.new(@file).to_blob("tiff")
+    ret = Image.ping_batch [@file, "XXX.jpg"], threads: 2
+    assert_equal info("JPEG", 500, 588), ret[0]
+    assert_kind_of IOError, ret[1]
+    ret = Image.ping_batch [@blob[0, 1000], tiff], blob: true, threads: 2
+    assert_equal info("JPEG", 500, 588), ret[0]
+    # not probed, pinged by FreeImage
+    assert_equal info("TIFF", 500, 588), ret[1]
+  end
+end
+
+class TestMappedLoad < Test::Unit::TestCase
+  def setup
+    assert !RFreeImage.mmap_loads
+    RFreeImage.mmap_loads = true
+  end
+
+  def teardown
+    RFreeImage.mmap_loads = false
+  end
+
+  def test_file_matches_blob
+    file = get_image("test.jpg")
+    blob = File.binread file
+    [ImageBPP::GRAY, ImageBPP::BGRA].each do |bpp|
+      assert_equal Image.from_blob(blob, bpp).bytes, Image.new(file, bpp).bytes
+    end
+    Tempfile.create(["rfi", ".png"]) do |f|
+      f.binmode
+      f.write Image.new(file).to_blob("png")
+      f.flush
+      assert_equal Image.new(file).bytes, Image.new(f.path).bytes
+    end
+  end
+
+  def test_unmappable
+    Tempfile.create("rfi") do |f|
+      e = assert_raise(IOError) { Image.new f.path }
+      assert_equal "Invalid image file", e.message
+    end
+    e = assert_raise(IOError) { Image.new "XXX.jpg" }
+    assert_equal "Invalid image file", e.message
+  end
+end
+
+class TestEncoderOptions < Test::Unit::TestCase
+  def setup
+    @img = Image.new get_image("test.jpg")
+  end
+
+  def test_jpeg
+    small = @img.to_blob "jpeg", quality: 10
+    large = @img.to_blob "jpeg", quality: 95
+    assert small.size < large.size
+    assert_equal @img.to_blob("jpeg"), @img.to_blob("jpeg", {})
+    # SOF2, a progressive frame
+    assert_not_nil @img.to_blob("jpeg", progressive: true, subsampling: 420).index("\xFF\xC2".b)
+    assert_nil large.index("\xFF\xC2".b)
+    assert_equal small, @img.to_blob_async("jpeg", quality: 10)
+    assert_equal small, @img.pipeline.encode("jpeg", quality: 10)
+    Tempfile.create(["rfi", ".jpg"]) do |f|
+      @img.save f.path, quality: 10
+      assert_equal small, File.binread(f.path)
+    end
+  end
+
+  def test_png
+    [0, 1, 9].each do |level|
+      blob = @img.to_blob "png", compression: level
+      assert_equal @img.bytes, Image.from_blob(blob).bytes
+    end
+  end
+
+  def test_invalid
+    assert_raise(ArgumentError) { @img.to_blob "jpeg", quality: 0 }
+    assert_raise(ArgumentError) { @img.to_blob "jpeg", subsampling: 421 }
+    assert_raise(ArgumentError) { @img.to_blob "jpeg", compression: 1 }
+    assert_raise(ArgumentError) { @img.to_blob "png", filter: :paeth }
+    assert_raise(ArgumentError) { @img.to_blob "webp", method: 6 }
+    assert_raise(ArgumentError) { @img.to_blob "bmp", quality: 50 }
+    assert_raise(TypeError) { @img.to_blob "jpeg", subsampling: "420" }
+    assert_raise(TypeError) { @img.to_blob "jpeg", quality: "90" }
+  end
+end
+
+class TestMaxBytes < Test::Unit::TestCase
+  def setup
+    @img = Image.new get_image("test.jpg")
+  end
+
+  def test_fit
+    [80_000, 20_000].each do |max|
+      blob, q = @img.to_blob_max_bytes "jpeg", max
+      assert blob.size <= max
+      assert_equal [500, 588], [Image.from_blob(blob).cols, Image.from_blob(blob).rows]
+      # to_blob encodes differently, only fits of the same image compare:
+      # the same budget finds the same encode, one byte less a lower one
+      assert_equal [blob, q], @img.to_blob_max_bytes("jpeg", blob.size)
+      lower = @img.to_blob_max_bytes "jpeg", blob.size - 1
+      assert lower.nil? || lower[1] < q
+      assert @img.to_blob_max_bytes("jpeg", max * 2)[1] >= q
+    end
+    gray = Image.new get_image("test.jpg"), ImageBPP::GRAY
+    blob, = gray.to_blob_max_bytes "jpeg", 20_000, progressive: true
+    # a progressive frame of one component
+    sof = blob.index "\xFF\xC2".b
+    assert_equal 1, blob.getbyte(sof + 9)
+    assert_nil @img.to_blob_max_bytes("jpeg", 100)
+  end
+
+  def test_invalid
+    assert_raise(ArgumentError) { @img.to_blob_max_bytes "png", 10_000 }
+    assert_raise(ArgumentError) { @img.to_blob_max_bytes "jpeg", 0 }
+    assert_raise(ArgumentError) { @img.to_blob_max_bytes "jpeg", 10_000, quality: 50 }
+  end
+end
+
+class TestJPEGTransform < Test::Unit::TestCase
+  def setup
+    @file = get_image("test.jpg")
+    @blob = File.binread @file
+    @img = Image.from_blob @blob
+  end
+
+  def assert_close expected, blob
+    img = Image.from_blob blob
+    assert_equal [expected.cols, expected.rows], [img.cols, img.rows]
+    a, b = expected.bytes, img.bytes
+    idx = (0...a.bytesize).step(11)
+    diff = idx.sum { |i| (a.getbyte(i) - b.getbyte(i)).abs }.fdiv(idx.size)
+    assert diff < 4, "mean difference #{diff}"
+  end
+
+  def eager img, op
+    case op
+    when :none then img
+    when :flip_horizontal then img.flip_horizontal
+    when :flip_vertical then img.flip_vertical
+    when :transpose then img.rotate(90).flip_vertical
+    when :transverse then img.rotate(-90).flip_vertical
+    when :rotate_90 then img.rotate(-90)
+    when :rotate_180 then img.rotate(180)
+    when :rotate_270 then img.rotate(90)
+    end
+  end
+
+  def test_operations
+    [:none, :flip_horizontal, :flip_vertical, :transpose, :transverse,
+     :rotate_90, :rotate_180, :rotate_270].each do |op|
+      assert_close eager(@img, op), Image.jpeg_transform(@blob, op, blob: true)
+    end
+    assert_close @img.rotate(-90).crop(16, 32, 80, 64),
+      Image.jpeg_transform(@file, :rotate_90, crop: [16, 32, 80, 64])
+  end
+
+  def test_orientation
+    (2..8).each do |o|
+      blob = with_orientation @blob, o
+      shown = Image.from_blob blob
+      out = Image.jpeg_transform blob, blob: true
+      assert_equal 1, Image.probe(out, blob: true)[:orientation], "orientation #{o}"
+      assert_close shown, out
+      assert_close eager(shown, :rotate_90), Image.jpeg_transform(blob, :rotate_90, blob: true)
+      kept = Image.jpeg_transform blob, :flip_vertical, blob: true, orient: false
+      assert_equal o, Image.probe(kept, blob: true)[:orientation]
+    end
+  end
+
+  def test_file
+    Tempfile.create(["rfi", ".jpg"]) do |f|
+      assert_nil Image.jpeg_transform_file(with_orientation(@blob, 6), f.path, :rotate_180, blob: true)
+      assert_close eager(Image.from_blob(with_orientation(@blob, 6)), :rotate_180), File.binread(f.path)
+    end
+  end
+
+  def test_invalid
+    assert_raise(IOError) { Image.jpeg_transform @img.to_blob("png"), blob: true }
+    assert_raise(IOError) { Image.jpeg_transform "XXX.jpg" }
+    assert_raise(ArgumentError) { Image.jpeg_transform @blob, :rotate_45, blob: true }
+    assert_raise(ArgumentError) { Image.jpeg_transform @blob, blob: true, crop: [10, 10, 5, 20] }
+  end
+end
+
+class TestFusedOrientation < Test::Unit::TestCase
+  def setup
+    @file = get_image("test.jpg")
+    @blob = File.binread @file
+  end
+
+  def test_matches_rotate_then_downscale
+    (1..8).each do |o|
+      blob = with_orientation @blob, o
+      [0, 100, 57].each do |max|
+        expected = Image.from_blob(blob, 0, max).downscale(max)
+        img = Image.from_blob_downscale blob, max
+        assert_equal [expected.cols, expected.rows, 32], [img.cols, img.rows, img.bpp], "orientation #{o}, #{max}"
+        assert_equal expected.bytes, img.bytes, "orientation #{o}, #{max}"
+      end
+    end
+  end
+
+  def test_file_and_other_formats
+    expected = Image.new(@file, 0, 64).downscale(64)
+    assert_equal expected.bytes, Image.load_downscale(@file, 64).bytes
+    png = Image.new(@file).to_blob("png")
+    assert_equal Image.from_blob(png).downscale(64).bytes, Image.from_blob_downscale(png, 64).bytes
+    assert_raise(ArgumentError) { Image.from_blob_downscale @blob, -1 }
+    assert_raise(IOError) { Image.load_downscale "XXX.jpg", 64 }
+  end
+end
+
+class TestThreaded < Test::Unit::TestCase
+  def test_concurrent_decode
+    data = File.read get_image("test.jpg")
+    expected = Image.from_blob(data).bytes
+    threads = 4.times.map do
+      Thread.new do
+        img = Image.from_blob data
+        [img.bytes, img.resize(100, 100).cols, img.to_blob('PNG').size]
+      end
+    end
+    threads.each do |t|
+      bytes, cols, size = t.value
+      assert_equal expected, bytes
+      assert_equal 100, cols
+      assert size > 0
+    end
+  end
+end
+
+class TestLoadBatch < Test::Unit::TestCase
+  def test_load_batch
+    path = get_image("test.jpg")
+    blob = File.binread path
+    files = Image.load_batch [path, "XXX.jpg"] * 3, bpp: ImageBPP::GRAY, threads: 3
+    blobs = Image.load_batch [blob, "XX\0FDS", "GIF8"] * 3, blob: true, bpp: ImageBPP::GRAY, threads: 3
+    assert_equal [6, 9], [files.size, blobs.size]
+    files.each_slice(2).zip(blobs.each_slice(3)) do |(file, missing), (mem, bad, short)|
+      assert_equal 500, file.cols
+      assert_equal ImageBPP::GRAY, file.bpp
+      assert_equal file.bytes, mem.bytes
+      assert_kind_of IOError, missing
+      assert_kind_of IOError, bad
+      assert_kind_of IOError, short
+    end
+  end
+
+  def test_load_batch_args
+    assert_equal [], Image.load_batch([])
+    assert_raise TypeError do
+      Image.load_batch [1]
+    end
+    assert_raise ArgumentError do
+      Image.load_batch [get_image("test.jpg")], max_size_hint: -1
+    end
+  end
+end
+
+class TestAsync < Test::Unit::TestCase
+  def test_load_async
+    blob = File.binread get_image("test.jpg")
+    img = Image.load_async blob, ImageBPP::GRAY
+    assert_equal Image.from_blob(blob, ImageBPP::GRAY).bytes, img.bytes
+    job = Image.load_job blob
+    assert_kind_of Integer, job.fileno
+    assert_same job.value, job.value
+    assert job.done?
+    job = Image.load_job "XX\0FDS"
+    2.times do
+      assert_raise IOError do
+        job.value
+      end
+    end
+  end
+
+  def test_to_blob_async
+    img = Image.new get_image("test.jpg")
+    jobs = 4.times.map { img.to_blob_job "png" }
+    assert_equal img.to_blob("png"), img.to_blob_async("png")
+    jobs.each { |j| assert_equal img.to_blob("png"), j.value }
+    img.release
+    assert_raise ImageError do
+      img.to_blob_job "png"
+    end
+  end
+
+  def test_release_after_done
+    img = Image.new get_image("test.jpg")
+    job = img.to_blob_job "png"
+    IO.for_fd(job.fileno, autoclose: false).wait_readable
+    assert job.done?
+    img.flip_horizontal!
+    img.release
+    assert_equal Image.new(get_image("test.jpg")).to_blob("png"), job.value
+  end
+end
+
+class TestDecode < Test::Unit::TestCase
+  def test_png_to_bpp
+    src = Image.new get_image("test.jpg")
+    blob = src.to_blob "png"
+    assert_equal src.bytes, Image.from_blob(blob, ImageBPP::BGRA).bytes
+    assert_equal src.to_gray.bytes, Image.from_blob(blob, ImageBPP::GRAY).bytes
+  end
+
+  def test_exif_orientation
+    blob = File.binread(get_image("test.jpg")).b
+    tiff = "MM\0*".b + [8, 1, 0x0112, 3, 1, 6, 0].pack("NnnnNnN")
+    exif = "Exif\0\0".b + tiff
+    app1 = "\xFF\xE1".b + [exif.size + 2].pack("n") + exif
+    img = Image.from_blob blob[0, 2] + app1 + blob[2..-1], ImageBPP::GRAY
+    assert_equal [588, 500], [img.cols, img.rows]
+  end
+
+  def test_resolution
+    jpeg = File.binread(get_image("test.jpg")).b
+    assert_equal [1, 100, 100], jfif_density(jpeg)
+    [Image.new(get_image("test.jpg")), Image.from_blob(jpeg, ImageBPP::GRAY),
+     Image.load_region(jpeg, [10, 10, 90, 90], blob: true, scale: 2)].each do |img|
+      assert_equal [1, 100, 100], jfif_density(img.to_blob("jpeg"))
+    end
+    jpeg[13, 5] = [2, 40, 20].pack("Cnn")
+    assert_equal [1, 102, 51], jfif_density(Image.from_blob(jpeg).to_blob("jpeg"))
+
+    png = Image.new(get_image("test.jpg")).to_blob "png"
+    phys = "pHYs" + [3937, 1969, 1].pack("NNC")
+    png[33, 0] = [9].pack("N") + phys + [Zlib.crc32(phys)].pack("N")
+    assert_equal [1, 100, 50], jfif_density(Image.from_blob(png).to_blob("jpeg"))
+  end
+
+  def test_comment
+    jpeg = File.binread(get_image("test.jpg")).b
+    com = "made by rfreeimage"
+    jpeg[2, 0] = "\xFF\xFE".b + [com.size + 2].pack("n") + com
+    assert_include Image.from_blob(jpeg).to_blob("jpeg"), com
+  end
+end
+
+class TestBGR < Test::Unit::TestCase
+  def setup
+    @bgra = Image.new get_image("test.jpg")
+    @bgr = Image.new get_image("test.jpg"), ImageBPP::BGR
+  end
+
+  def test_decode
+    assert @bgr.bgr?
+    assert_equal @bgra.to_bgr.bytes, @bgr.bytes
+    assert_equal @bgr.bytes, Image.from_blob(@bgra.to_blob("png"), ImageBPP::BGR).bytes
+    assert_equal @bgra.to_blob("jpeg"), @bgr.to_blob("jpeg")
+  end
+
+  def test_downscale
+    assert_equal @bgra.downscale(100).to_bgr.bytes, @bgr.downscale(100).bytes
+  end
+
+  def test_from_bytes
+    img = Image.from_bytes @bgr.bytes, @bgr.cols, @bgr.rows, @bgr.cols * 3, ImageBPP::BGR
+    assert_equal @bgr.bytes, img.bytes
+    assert_raise ArgumentError do
+      Image.from_bytes "A" * 300, 10, 10, 20, ImageBPP::BGR
+    end
+  end
+
+  def test_draw
+    @bgra.draw_rectangle 10, 10, 50, 60, Color::RED, 3
+    @bgr.draw_rectangle 10, 10, 50, 60, Color::RED, 3
+    assert_equal @bgra.to_bgr.bytes, @bgr.bytes
+  end
+end
+
+class TestRescale < Test::Unit::TestCase
+  def setup
+    @img = Image.new(get_image("test.jpg")).crop(100, 100, 220, 190)
+  end
+
+  def max_diff a, b
+    assert_equal [a.cols, a.rows, a.bpp], [b.cols, b.rows, b.bpp]
+    a.bytes.unpack("C*").zip(b.bytes.unpack("C*")).map { |x, y| (x - y).abs }.max
+  end
+
+  def test_matches_freeimage
+    assert_equal [1, 100, 100], jfif_density(@img.to_blob("jpeg"))
+    [@img, @img.to_bgr, @img.to_gray].each do |img|
+      (Filter::FILTER_BOX..Filter::FILTER_LANCZOS3).each do |f|
+        [[37, 29], [251, 97], [120, 90]].each do |w, h|
+          a, b = img.rescale(w, h, f), img._freeimage_rescale(w, h, f)
+          assert_operator max_diff(a, b), :<=, 2
+          assert_equal jfif_density(b.to_blob("jpeg")), jfif_density(a.to_blob("jpeg"))
+        end
+      end
+    end
+  end
+
+  def test_threaded
+    expected = @img.resize 50, 40
+    4.times.map { Thread.new { @img.resize 50, 40 } }.each do |t|
+      assert_equal expected.bytes, t.value.bytes
+    end
+  end
+end